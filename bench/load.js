@@ -0,0 +1,326 @@
+// Load benchmark of getRevocationStatusAsync against bench/responder.cpp,
+// built by node-gyp as build/Release/ocsp_responder. Keeps a fixed number
+// of lookups in flight for a while at each concurrency level and reports
+// throughput and latency percentiles:
+//
+//   yarn bench [--concurrency 1,8,32,128] [--duration 5] [--certs 256]
+//              [--latency MS] [--jitter MS] [--error-rate F] [--size BYTES]
+//              [--keep-alive 0|1] [--cache] [--engine THREADS]
+//              [--json FILE] [--baseline FILE]
+//              [--soak LOOKUPS] [--samples N] [--rss-slack MB]
+//
+// The response cache is off unless --cache is given, so every lookup goes
+// to the responder. --json saves the results, --baseline compares them
+// with results saved earlier.
+//
+// --soak runs LOOKUPS lookups at the first concurrency level instead,
+// printing RSS at N evenly spaced points (20 by default). It fails when
+// RSS at the end is more than --rss-slack MB (16 by default) above RSS
+// once the first tenth of the lookups warmed everything up, so leaks
+// show over millions of lookups that a short run hides.
+
+const { spawn } = require('child_process');
+const fs = require('fs');
+const os = require('os');
+const path = require('path');
+const readline = require('readline');
+
+const ocsp = require('..');
+
+const parseArgs = argv => {
+    const args = {
+        concurrency: [1, 8, 32, 128],
+        duration: 5,
+        certs: 256,
+        responder: [],
+        cache: false,
+        engine: 0,
+        soak: 0,
+        samples: 20,
+        'rss-slack': 16,
+    };
+    const responderFlags = [
+        'latency',
+        'jitter',
+        'error-rate',
+        'size',
+        'keep-alive',
+    ];
+    const numberFlags = [
+        'duration',
+        'certs',
+        'engine',
+        'soak',
+        'samples',
+        'rss-slack',
+    ];
+    for (let i = 0; i < argv.length; i++) {
+        const name = argv[i].replace(/^--/, '');
+        if (name === 'cache') {
+            args.cache = true;
+        } else if (name === 'concurrency') {
+            args.concurrency = argv[++i].split(',').map(Number);
+        } else if (responderFlags.includes(name)) {
+            args.responder.push(argv[i], argv[++i]);
+        } else if (numberFlags.includes(name)) {
+            args[name] = Number(argv[++i]);
+        } else if (name === 'json' || name === 'baseline') {
+            args[name] = argv[++i];
+        } else {
+            throw new Error(`Unknown option ${argv[i]}`);
+        }
+    }
+    return args;
+};
+
+const startResponder = (dir, args) =>
+    new Promise((resolve, reject) => {
+        const binary = path.join(
+            __dirname,
+            '..',
+            'build',
+            'Release',
+            'ocsp_responder'
+        );
+        const child = spawn(
+            binary,
+            [
+                '--dir',
+                dir,
+                '--certs',
+                String(args.certs),
+                ...args.responder,
+            ],
+            { stdio: ['ignore', 'pipe', 'inherit'] }
+        );
+        child.on('error', reject);
+        child.on('exit', code =>
+            reject(new Error(`Responder exited with ${code}`))
+        );
+        readline.createInterface({ input: child.stdout }).once('line', line =>
+            resolve({ child, port: Number(line.split(' ')[1]) })
+        );
+    });
+
+const der = pem =>
+    Buffer.from(pem.replace(/-----[^-]+-----|\s/g, ''), 'base64');
+
+// What getRevocationStatusAsync reads of a TLS peer certificate
+const peerCertificates = (dir, count, url) => {
+    const issuer = {
+        raw: der(fs.readFileSync(path.join(dir, 'ca.pem'), 'ascii')),
+    };
+    const peers = [];
+    for (let i = 0; i < count; i++) {
+        const pem = fs.readFileSync(path.join(dir, `leaf${i}.pem`), 'ascii');
+        peers.push({
+            raw: der(pem),
+            issuerCertificate: issuer,
+            infoAccess: { 'OCSP - URI': [url] },
+        });
+    }
+    return peers;
+};
+
+const percentile = (sorted, q) =>
+    sorted.length === 0 ? 0 : sorted[Math.ceil(q * sorted.length) - 1];
+
+// Keeps concurrency lookups in flight for duration seconds
+const run = (peers, concurrency, duration) =>
+    new Promise(resolve => {
+        const latencies = [];
+        const deadline = Date.now() + duration * 1000;
+        const started = process.hrtime();
+        let next = 0;
+        let errors = 0;
+        let running = concurrency;
+
+        const lookup = () => {
+            if (Date.now() >= deadline) {
+                if (--running === 0) {
+                    const elapsed = process.hrtime(started);
+                    const seconds = elapsed[0] + elapsed[1] / 1e9;
+                    latencies.sort((a, b) => a - b);
+                    resolve({
+                        concurrency,
+                        lookups: latencies.length,
+                        errors,
+                        throughput: latencies.length / seconds,
+                        p50: percentile(latencies, 0.5),
+                        p90: percentile(latencies, 0.9),
+                        p99: percentile(latencies, 0.99),
+                        p999: percentile(latencies, 0.999),
+                        max: latencies[latencies.length - 1] || 0,
+                    });
+                }
+                return;
+            }
+            const peer = peers[next++ % peers.length];
+            const start = process.hrtime();
+            ocsp.getRevocationStatusAsync(peer, err => {
+                const elapsed = process.hrtime(start);
+                latencies.push(elapsed[0] * 1e3 + elapsed[1] / 1e6);
+                if (err) {
+                    errors++;
+                }
+                lookup();
+            });
+        };
+        for (let i = 0; i < concurrency; i++) {
+            lookup();
+        }
+    });
+
+const megabytes = bytes => bytes / (1024 * 1024);
+
+// Runs total lookups, concurrency at a time, and samples RSS every
+// total / samples lookups
+const soak = (peers, concurrency, total, samples) =>
+    new Promise(resolve => {
+        const every = Math.max(1, Math.floor(total / samples));
+        const rss = [];
+        const started = Date.now();
+        let next = 0;
+        let done = 0;
+        let errors = 0;
+
+        const lookup = () => {
+            if (next >= total) {
+                return;
+            }
+            const peer = peers[next++ % peers.length];
+            ocsp.getRevocationStatusAsync(peer, err => {
+                if (err) {
+                    errors++;
+                }
+                if (++done % every === 0 || done === total) {
+                    const sample = {
+                        lookups: done,
+                        seconds: (Date.now() - started) / 1000,
+                        rss: megabytes(process.memoryUsage().rss),
+                        errors,
+                    };
+                    rss.push(sample);
+                    const seconds = sample.seconds.toFixed(0);
+                    const mb = sample.rss.toFixed(1);
+                    console.log(
+                        `${done} lookups ${seconds} s rss ${mb} MB errors ${errors}`
+                    );
+                }
+                if (done === total) {
+                    resolve({ concurrency, lookups: total, errors, rss });
+                } else {
+                    lookup();
+                }
+            });
+        };
+        for (let i = 0; i < concurrency; i++) {
+            lookup();
+        }
+    });
+
+// RSS growth from the first sample past a tenth of the lookups to the end
+const rssGrowth = result => {
+    const warm =
+        result.rss.find(sample => sample.lookups >= result.lookups / 10) ||
+        result.rss[0];
+    return result.rss[result.rss.length - 1].rss - warm.rss;
+};
+
+const change = (value, base) =>
+    base ? `${(((value - base) / base) * 100).toFixed(1)}%` : '-';
+
+const report = (results, baseline) => {
+    const rows = results.map(result => {
+        const row = {
+            concurrency: result.concurrency,
+            'lookups/s': result.throughput.toFixed(0),
+            'p50 ms': result.p50.toFixed(2),
+            'p90 ms': result.p90.toFixed(2),
+            'p99 ms': result.p99.toFixed(2),
+            'p99.9 ms': result.p999.toFixed(2),
+            'max ms': result.max.toFixed(2),
+            errors: result.errors,
+        };
+        const base =
+            baseline &&
+            baseline.find(entry => entry.concurrency === result.concurrency);
+        if (base) {
+            row['lookups/s vs base'] = change(
+                result.throughput,
+                base.throughput
+            );
+            row['p99 vs base'] = change(result.p99, base.p99);
+        }
+        return row;
+    });
+    console.table(rows);
+};
+
+const main = async () => {
+    const args = parseArgs(process.argv.slice(2));
+    const baseline = args.baseline
+        ? JSON.parse(fs.readFileSync(args.baseline, 'utf8')).results
+        : undefined;
+    const dir = fs.mkdtempSync(path.join(os.tmpdir(), 'ocsp-bench-'));
+    const { child, port } = await startResponder(dir, args);
+    const url = `http://127.0.0.1:${port}`;
+    const peers = peerCertificates(dir, args.certs, url);
+
+    ocsp.configureTrustStore({ caFile: path.join(dir, 'ca.pem') });
+    if (!args.cache) {
+        ocsp.configureCache({ maxEntries: 0, margin: 0 });
+    }
+    if (args.engine > 0) {
+        ocsp.configureEngine({ threads: args.engine });
+    }
+
+    const results = [];
+    try {
+        // Warms up connections, the trust store and the signer cache
+        await run(peers, 1, 0.5);
+        if (args.soak > 0) {
+            results.push(
+                await soak(
+                    peers,
+                    args.concurrency[0],
+                    args.soak,
+                    args.samples
+                )
+            );
+        } else {
+            for (const concurrency of args.concurrency) {
+                results.push(await run(peers, concurrency, args.duration));
+            }
+        }
+    } finally {
+        child.removeAllListeners('exit');
+        child.kill();
+        // fs.rmSync needs Node 14.14
+        (fs.rmSync || fs.rmdirSync)(dir, { recursive: true });
+    }
+
+    if (args.soak > 0) {
+        const growth = rssGrowth(results[0]);
+        console.log(`RSS grew ${growth.toFixed(1)} MB after warming up`);
+        if (growth > args['rss-slack']) {
+            process.exitCode = 1;
+        }
+    } else {
+        report(results, baseline);
+    }
+    if (args.json) {
+        fs.writeFileSync(
+            args.json,
+            JSON.stringify({ options: process.argv.slice(2), results }, null, 4)
+        );
+    }
+    if (args.engine > 0) {
+        ocsp.configureEngine({ threads: 0 });
+    }
+};
+
+main().catch(error => {
+    console.error(error);
+    process.exit(1);
+});
@@ -0,0 +1,437 @@
+// Micro-benchmarks of the steps of verifyOCSP, run on a corpus of test
+// certificates and responses generated at startup, so no responder or
+// network is involved:
+//
+//   ocsp_micro [--time MS] [FILTER]
+//
+// Runs each benchmark whose name contains FILTER for about MS milliseconds
+// (default 500) after a warm-up, and prints its time and the heap
+// allocations it makes per operation, counting both OpenSSL allocations
+// and operator new. finish/* covers what finishOCSP does once the response
+// is decoded: the nonce check, signature checks with the signer already
+// verified, and the status summary.
+
+#include <unistd.h>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <string>
+#include <vector>
+
+#include <openssl/crypto.h>
+#include <openssl/ocsp.h>
+#include <openssl/pem.h>
+
+#include "../src/cache.h"
+#include "../src/helper.h"
+#include "../src/ocsp.h"
+#include "../src/store.h"
+#include "pki.h"
+
+using std::chrono::steady_clock;
+
+static std::atomic<uint64_t> allocations(0);
+
+static void *count_malloc(size_t num, const char *, int)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return malloc(num);
+}
+
+static void *count_realloc(void *addr, size_t num, const char *, int)
+{
+    // Growing a buffer in place is not a new allocation
+    if (addr == NULL)
+        allocations.fetch_add(1, std::memory_order_relaxed);
+    return realloc(addr, num);
+}
+
+static void count_free(void *addr, const char *, int)
+{
+    free(addr);
+}
+
+void *operator new(size_t size)
+{
+    void *p;
+
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    p = malloc(size == 0 ? 1 : size);
+    if (p == NULL)
+        abort();
+    return p;
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete(void *p, size_t) noexcept
+{
+    free(p);
+}
+
+// A CA signing responses itself and one of its leaves, in both encodings
+struct signerCorpus {
+    EVP_PKEY *ca_key = NULL;
+    X509 *ca = NULL;
+    X509 *leaf = NULL;
+    std::string ca_pem;
+    std::string leaf_pem;
+    std::vector<unsigned char> ca_der;
+    std::vector<unsigned char> leaf_der;
+    // Signed response about leaf and the parts of it verifyOCSP works on
+    OCSP_RESPONSE *resp = NULL;
+    OCSP_BASICRESP *bs = NULL;
+    ocspRequest request;
+};
+
+static signerCorpus ec, rsa;
+// Responses of the EC CA about 1, 16 and 64 serials, and the last CertID
+// of each, the one OCSP_resp_find_status finds last
+static const int multi_sizes[] = { 1, 16, 64 };
+static OCSP_BASICRESP *multi_bs[3];
+static OCSP_CERTID *multi_last[3];
+static X509_STORE *store = NULL;
+static char ca_file[] = "/tmp/ocsp-micro-XXXXXX";
+
+static std::string pem_of(X509 *cert)
+{
+    BIO *bio = BIO_new(BIO_s_mem());
+    char *data;
+    long len;
+    std::string pem;
+
+    if (bio != NULL && PEM_write_bio_X509(bio, cert)) {
+        len = BIO_get_mem_data(bio, &data);
+        pem.assign(data, len);
+    }
+    BIO_free(bio);
+    return pem;
+}
+
+static std::vector<unsigned char> der_of(X509 *cert)
+{
+    int len = i2d_X509(cert, NULL);
+    std::vector<unsigned char> der(len > 0 ? len : 0);
+    unsigned char *p = der.data();
+
+    if (len > 0)
+        i2d_X509(cert, &p);
+    return der;
+}
+
+// Signs a response with one good status for each CertID in ids
+static OCSP_BASICRESP *sign_response(signerCorpus *c, STACK_OF(OCSP_CERTID) *ids)
+{
+    OCSP_BASICRESP *bs = OCSP_BASICRESP_new();
+    ASN1_TIME *thisupd = X509_gmtime_adj(NULL, 0);
+    ASN1_TIME *nextupd = X509_gmtime_adj(NULL, 24 * 3600);
+    int ok = bs != NULL && thisupd != NULL && nextupd != NULL;
+    int i;
+
+    for (i = 0; ok && i < sk_OCSP_CERTID_num(ids); i++)
+        ok = OCSP_basic_add1_status(bs, sk_OCSP_CERTID_value(ids, i), V_OCSP_CERTSTATUS_GOOD,
+                                    0, NULL, thisupd, nextupd) != NULL;
+    ok = ok && OCSP_basic_sign(bs, c->ca, c->ca_key, EVP_sha256(), NULL, 0);
+    ASN1_TIME_free(thisupd);
+    ASN1_TIME_free(nextupd);
+    if (!ok) {
+        OCSP_BASICRESP_free(bs);
+        return NULL;
+    }
+    return bs;
+}
+
+static int create_signer(signerCorpus *c, int type, const char *name)
+{
+    const std::string url = "http://127.0.0.1/";
+    EVP_PKEY *leaf_key = pki_new_key(type);
+    STACK_OF(OCSP_CERTID) *ids = sk_OCSP_CERTID_new_null();
+    OCSP_BASICRESP *bs;
+    int ok;
+
+    c->ca_key = pki_new_key(type);
+    ok = leaf_key != NULL && c->ca_key != NULL && ids != NULL
+        && (c->ca = pki_new_cert(c->ca_key, 1, name, NULL, NULL, url)) != NULL
+        && (c->leaf = pki_new_cert(leaf_key, 2, "leaf", c->ca, c->ca_key, url)) != NULL
+        && sk_OCSP_CERTID_push(ids, OCSP_cert_to_id(EVP_sha1(), c->leaf, c->ca));
+    if (ok) {
+        c->ca_pem = pem_of(c->ca);
+        c->leaf_pem = pem_of(c->leaf);
+        c->ca_der = der_of(c->ca);
+        c->leaf_der = der_of(c->leaf);
+        bs = sign_response(c, ids);
+        ok = bs != NULL
+            && (c->resp = OCSP_response_create(OCSP_RESPONSE_STATUS_SUCCESSFUL, bs)) != NULL;
+        OCSP_BASICRESP_free(bs);
+    }
+    if (ok)
+        c->bs = OCSP_response_get1_basic(c->resp);
+    EVP_PKEY_free(leaf_key);
+    sk_OCSP_CERTID_pop_free(ids, OCSP_CERTID_free);
+    return ok && c->bs != NULL;
+}
+
+static int create_multi()
+{
+    ASN1_INTEGER *serial = ASN1_INTEGER_new();
+    int ok = serial != NULL;
+    int i, k;
+
+    for (k = 0; ok && k < 3; k++) {
+        STACK_OF(OCSP_CERTID) *ids = sk_OCSP_CERTID_new_null();
+        ok = ids != NULL;
+        for (i = 0; ok && i < multi_sizes[k]; i++) {
+            ok = ASN1_INTEGER_set(serial, 100 + i)
+                && sk_OCSP_CERTID_push(ids, OCSP_cert_id_new(EVP_sha1(), X509_get_subject_name(ec.ca),
+                                                             X509_get0_pubkey_bitstr(ec.ca), serial));
+        }
+        if (ok) {
+            multi_bs[k] = sign_response(&ec, ids);
+            multi_last[k] = OCSP_CERTID_dup(sk_OCSP_CERTID_value(ids, multi_sizes[k] - 1));
+            ok = multi_bs[k] != NULL && multi_last[k] != NULL;
+        }
+        sk_OCSP_CERTID_pop_free(ids, OCSP_CERTID_free);
+    }
+    ASN1_INTEGER_free(serial);
+    return ok;
+}
+
+static int create_corpus()
+{
+    FILE *fp;
+    int fd, ok;
+
+    if (!create_signer(&ec, EVP_PKEY_EC, "ECDSA CA") || !create_signer(&rsa, EVP_PKEY_RSA, "RSA CA")
+        || !create_multi())
+        return 0;
+
+    fd = mkstemp(ca_file);
+    if (fd < 0)
+        return 0;
+    fp = fdopen(fd, "w");
+    ok = fp != NULL && PEM_write_X509(fp, ec.ca) && PEM_write_X509(fp, rsa.ca);
+    if (fp != NULL)
+        fclose(fp);
+    else
+        close(fd);
+    if (!ok)
+        return 0;
+
+    store = X509_STORE_new();
+    if (store == NULL || !X509_STORE_add_cert(store, ec.ca) || !X509_STORE_add_cert(store, rsa.ca))
+        return 0;
+    // The shared store finishOCSP verifies against
+    if (configure_store(ca_file, NULL, NULL, 0) != NULL)
+        return 0;
+    // Every prepareOCSP builds a request rather than answering from cache
+    configure_cache(0, 0);
+
+    // The requests finish/* answers, without a nonce as for stapled
+    // responses
+    ec.request.cert_der = ec.leaf_der.data();
+    ec.request.cert_der_len = (long)ec.leaf_der.size();
+    ec.request.issuer_der = ec.ca_der.data();
+    ec.request.issuer_der_len = (long)ec.ca_der.size();
+    rsa.request.cert_der = rsa.leaf_der.data();
+    rsa.request.cert_der_len = (long)rsa.leaf_der.size();
+    rsa.request.issuer_der = rsa.ca_der.data();
+    rsa.request.issuer_der_len = (long)rsa.ca_der.size();
+    return prepareOCSP(&ec.request, NULL, NULL, NULL, NULL, -1)
+        && prepareOCSP(&rsa.request, NULL, NULL, NULL, NULL, -1);
+}
+
+static void bench_parse_pem()
+{
+    // As prepareOCSP reads PEM arguments
+    BIO *bio = BIO_new(BIO_s_mem());
+    BIO_puts(bio, ec.leaf_pem.c_str());
+    X509_free(PEM_read_bio_X509_AUX(bio, NULL, NULL, NULL));
+    BIO_free(bio);
+}
+
+static void bench_parse_der()
+{
+    const unsigned char *p = ec.leaf_der.data();
+    X509_free(d2i_X509(NULL, &p, (long)ec.leaf_der.size()));
+}
+
+static void bench_cert_to_id()
+{
+    OCSP_CERTID_free(OCSP_cert_to_id(EVP_sha1(), ec.leaf, ec.ca));
+}
+
+static void bench_request_encode()
+{
+    OCSP_REQUEST *req = OCSP_REQUEST_new();
+    OCSP_CERTID *id = OCSP_cert_to_id(EVP_sha1(), ec.leaf, ec.ca);
+    unsigned char *der = NULL;
+
+    if (req != NULL && id != NULL && OCSP_request_add0_id(req, id)) {
+        id = NULL;
+        OCSP_request_add1_nonce(req, NULL, -1);
+        i2d_OCSP_REQUEST(req, &der);
+    }
+    OPENSSL_free(der);
+    OCSP_CERTID_free(id);
+    OCSP_REQUEST_free(req);
+}
+
+static void bench_setup_verify()
+{
+    ocspCheck retval;
+    X509_STORE_free(setup_verify(&retval, ca_file, NULL, 0, 1));
+}
+
+static void bench_basic_verify_rsa()
+{
+    OCSP_basic_verify(rsa.bs, NULL, store, 0);
+}
+
+static void bench_basic_verify_ecdsa()
+{
+    OCSP_basic_verify(ec.bs, NULL, store, 0);
+}
+
+static void find_status(int k)
+{
+    int status, reason;
+    ASN1_GENERALIZEDTIME *rev, *thisupd, *nextupd;
+
+    OCSP_resp_find_status(multi_bs[k], multi_last[k], &status, &reason, &rev, &thisupd, &nextupd);
+}
+
+static void bench_find_status_1()
+{
+    find_status(0);
+}
+
+static void bench_find_status_16()
+{
+    find_status(1);
+}
+
+static void bench_find_status_64()
+{
+    find_status(2);
+}
+
+static void bench_prepare_pem()
+{
+    ocspRequest r;
+    prepareOCSP(&r, ec.leaf_pem.c_str(), ec.ca_pem.c_str(), NULL, NULL, -1);
+    freeOCSP(&r);
+}
+
+static void bench_prepare_der()
+{
+    ocspRequest r;
+    r.cert_der = ec.leaf_der.data();
+    r.cert_der_len = (long)ec.leaf_der.size();
+    r.issuer_der = ec.ca_der.data();
+    r.issuer_der_len = (long)ec.ca_der.size();
+    prepareOCSP(&r, NULL, NULL, NULL, NULL, -1);
+    freeOCSP(&r);
+}
+
+static void finish(signerCorpus *c)
+{
+    c->request.retval = ocspCheck();
+    finishOCSP(&c->request, c->resp);
+}
+
+static void bench_finish_rsa()
+{
+    finish(&rsa);
+}
+
+static void bench_finish_ecdsa()
+{
+    finish(&ec);
+}
+
+struct benchCase {
+    const char *name;
+    void (*run)();
+};
+
+static const benchCase benches[] = {
+    { "parse/pem", bench_parse_pem },
+    { "parse/der", bench_parse_der },
+    { "cert_to_id", bench_cert_to_id },
+    { "request/encode", bench_request_encode },
+    { "setup_verify", bench_setup_verify },
+    { "basic_verify/rsa", bench_basic_verify_rsa },
+    { "basic_verify/ecdsa", bench_basic_verify_ecdsa },
+    { "find_status/1", bench_find_status_1 },
+    { "find_status/16", bench_find_status_16 },
+    { "find_status/64", bench_find_status_64 },
+    { "prepare/pem", bench_prepare_pem },
+    { "prepare/der", bench_prepare_der },
+    { "finish/rsa", bench_finish_rsa },
+    { "finish/ecdsa", bench_finish_ecdsa },
+};
+
+// Doubles the iterations until one round takes at least budget, then
+// reports that round
+static void measure(const benchCase &bench, steady_clock::duration budget)
+{
+    uint64_t iterations = 1, i, allocated;
+    steady_clock::time_point start;
+    steady_clock::duration elapsed;
+
+    // Warms up caches, lazily loaded algorithms and the signer cache
+    for (i = 0; i < 16; i++)
+        bench.run();
+    for (;;) {
+        allocated = allocations.load(std::memory_order_relaxed);
+        start = steady_clock::now();
+        for (i = 0; i < iterations; i++)
+            bench.run();
+        elapsed = steady_clock::now() - start;
+        allocated = allocations.load(std::memory_order_relaxed) - allocated;
+        if (elapsed >= budget)
+            break;
+        iterations *= 2;
+    }
+    printf("%-20s %12llu %12.0f %12.1f\n", bench.name, (unsigned long long)iterations,
+           (double)std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count() / iterations,
+           (double)allocated / iterations);
+}
+
+int main(int argc, char **argv)
+{
+    long time_ms = 500;
+    const char *filter = "";
+    int i;
+
+    // Before OpenSSL allocates anything
+    if (!CRYPTO_set_mem_functions(count_malloc, count_realloc, count_free)) {
+        fprintf(stderr, "Unable to count OpenSSL allocations\n");
+        return 1;
+    }
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--time") == 0 && i + 1 < argc)
+            time_ms = atol(argv[++i]);
+        else
+            filter = argv[i];
+    }
+    if (!create_corpus()) {
+        fprintf(stderr, "Unable to create the test corpus\n");
+        unlink(ca_file);
+        return 1;
+    }
+
+    printf("%-20s %12s %12s %12s\n", "benchmark", "iterations", "ns/op", "allocs/op");
+    for (const benchCase &bench : benches) {
+        if (strstr(bench.name, filter) != NULL)
+            measure(bench, std::chrono::milliseconds(time_ms));
+    }
+    unlink(ca_file);
+    return 0;
+}
@@ -0,0 +1,65 @@
+#include <openssl/ec.h>
+#include <openssl/rsa.h>
+#include <openssl/x509v3.h>
+
+#include "pki.h"
+
+EVP_PKEY *pki_new_key(int type)
+{
+    EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_id(type, NULL);
+    EVP_PKEY *key = NULL;
+    int ok;
+
+    ok = ctx != NULL && EVP_PKEY_keygen_init(ctx) > 0;
+    if (ok && type == EVP_PKEY_EC)
+        ok = EVP_PKEY_CTX_set_ec_paramgen_curve_nid(ctx, NID_X9_62_prime256v1) > 0;
+    else if (ok)
+        ok = EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, 2048) > 0;
+    if (!ok || EVP_PKEY_keygen(ctx, &key) <= 0)
+        key = NULL;
+    EVP_PKEY_CTX_free(ctx);
+    return key;
+}
+
+static int add_ext(X509 *cert, X509V3_CTX *ctx, int nid, const char *value)
+{
+    X509_EXTENSION *ext = X509V3_EXT_conf_nid(NULL, ctx, nid, (char *)value);
+    int ok = ext != NULL && X509_add_ext(cert, ext, -1);
+
+    X509_EXTENSION_free(ext);
+    return ok;
+}
+
+X509 *pki_new_cert(EVP_PKEY *key, long serial, const char *cn, X509 *issuer,
+                   EVP_PKEY *issuer_key, const std::string &ocsp_url)
+{
+    X509 *cert = X509_new();
+    X509_NAME *name;
+    X509V3_CTX ctx;
+    int ok;
+
+    if (cert == NULL)
+        return NULL;
+    name = X509_get_subject_name(cert);
+    ok = X509_set_version(cert, 2)
+        && ASN1_INTEGER_set(X509_get_serialNumber(cert), serial)
+        && X509_gmtime_adj(X509_getm_notBefore(cert), -3600) != NULL
+        && X509_gmtime_adj(X509_getm_notAfter(cert), 365L * 24 * 3600) != NULL
+        && X509_set_pubkey(cert, key)
+        && X509_NAME_add_entry_by_txt(name, "CN", MBSTRING_ASC, (const unsigned char *)cn, -1, -1, 0)
+        && X509_set_issuer_name(cert, issuer == NULL ? name : X509_get_subject_name(issuer));
+    if (ok) {
+        X509V3_set_ctx(&ctx, issuer == NULL ? cert : issuer, cert, NULL, NULL, 0);
+        if (issuer == NULL)
+            ok = add_ext(cert, &ctx, NID_basic_constraints, "critical,CA:TRUE")
+                && add_ext(cert, &ctx, NID_key_usage, "critical,keyCertSign,cRLSign,digitalSignature");
+        else
+            ok = add_ext(cert, &ctx, NID_basic_constraints, "CA:FALSE")
+                && add_ext(cert, &ctx, NID_info_access, ("OCSP;URI:" + ocsp_url).c_str());
+    }
+    if (!ok || !X509_sign(cert, issuer == NULL ? key : issuer_key, EVP_sha256())) {
+        X509_free(cert);
+        return NULL;
+    }
+    return cert;
+}
@@ -0,0 +1,20 @@
+#ifndef OCSP_BENCH_PKI_H
+#define OCSP_BENCH_PKI_H
+
+#include <string>
+
+#include <openssl/evp.h>
+#include <openssl/x509.h>
+
+// Test certificates for the mock responder and the micro-benchmarks
+
+// A fresh P-256 key for EVP_PKEY_EC, a 2048-bit one for EVP_PKEY_RSA
+EVP_PKEY *pki_new_key(int type);
+
+// A CA signed by key when issuer is NULL, otherwise a leaf signed by
+// issuer_key with an OCSP URI of ocsp_url. Valid from an hour ago for a
+// year.
+X509 *pki_new_cert(EVP_PKEY *key, long serial, const char *cn, X509 *issuer,
+                   EVP_PKEY *issuer_key, const std::string &ocsp_url);
+
+#endif
@@ -0,0 +1,344 @@
+// Mock OCSP responder for benchmarks and offline tests. Creates a test CA
+// and leaf certificates whose OCSP URI points at itself, writes them as
+// PEM, then answers requests for them over HTTP/1.1 with responses the
+// CA signs itself:
+//
+//   --port N          port on 127.0.0.1, 0 picks a free one (default 0)
+//   --dir PATH        where ca.pem and leaf0.pem... go (default .)
+//   --certs N         leaf certificates (default 256)
+//   --revoked N       every Nth leaf is revoked, 0 for none (default 0)
+//   --latency MS      delay before each response (default 0)
+//   --jitter MS       uniform extra delay of up to MS (default 0)
+//   --error-rate F    fraction of requests answered tryLater (default 0)
+//   --size BYTES      padding added to each response (default 0)
+//   --keep-alive 0|1  keep connections open between requests (default 1)
+//
+// Prints "listening <port>" once ready and serves until killed, one thread
+// per connection.
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <openssl/evp.h>
+#include <openssl/ocsp.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+
+#include "pki.h"
+
+struct responderOptions {
+    int port = 0;
+    std::string dir = ".";
+    long certs = 256;
+    long revoked = 0;
+    long latency = 0;
+    long jitter = 0;
+    double error_rate = 0;
+    long size = 0;
+    int keep_alive = 1;
+};
+
+static responderOptions options;
+static X509 *ca_cert = NULL;
+static EVP_PKEY *ca_key = NULL;
+// Private arc, unknown to clients, so they skip it
+static ASN1_OBJECT *padding_obj = NULL;
+
+static int write_pem(const std::string &path, X509 *cert)
+{
+    FILE *f = fopen(path.c_str(), "w");
+    int ok;
+
+    if (f == NULL)
+        return 0;
+    ok = PEM_write_X509(f, cert);
+    return fclose(f) == 0 && ok;
+}
+
+// Creates the CA and the leaves, leaf i having serial i + 1
+static int create_pki(const std::string &url)
+{
+    EVP_PKEY *leaf_key;
+    long i;
+    int ok = 1;
+
+    ca_key = pki_new_key(EVP_PKEY_EC);
+    if (ca_key == NULL)
+        return 0;
+    ca_cert = pki_new_cert(ca_key, 1, "OCSP benchmark CA", NULL, NULL, url);
+    if (ca_cert == NULL || !write_pem(options.dir + "/ca.pem", ca_cert))
+        return 0;
+    // One key for every leaf, only their serials matter here
+    leaf_key = pki_new_key(EVP_PKEY_EC);
+    if (leaf_key == NULL)
+        return 0;
+    for (i = 0; ok && i < options.certs; i++) {
+        std::string cn = "leaf" + std::to_string(i);
+        X509 *leaf = pki_new_cert(leaf_key, i + 1, cn.c_str(), ca_cert, ca_key, url);
+        ok = leaf != NULL && write_pem(options.dir + "/" + cn + ".pem", leaf);
+        X509_free(leaf);
+    }
+    EVP_PKEY_free(leaf_key);
+    return ok;
+}
+
+// Undoes the URL and base64 encoding of an RFC 5019 GET path
+static OCSP_REQUEST *decode_get(const std::string &path)
+{
+    std::string b64;
+    const unsigned char *p;
+    size_t i;
+    int len;
+
+    for (i = path.rfind('/') + 1; i < path.size(); i++) {
+        if (path[i] == '%' && i + 2 < path.size()) {
+            b64 += (char)strtol(path.substr(i + 1, 2).c_str(), NULL, 16);
+            i += 2;
+        } else {
+            b64 += path[i];
+        }
+    }
+    std::vector<unsigned char> der(b64.size() / 4 * 3 + 3);
+    len = EVP_DecodeBlock(der.data(), (const unsigned char *)b64.data(), (int)b64.size());
+    if (len < 0)
+        return NULL;
+    // EVP_DecodeBlock counts the padding as zero bytes
+    for (i = b64.size(); i > 0 && b64[i - 1] == '='; i--)
+        len--;
+    p = der.data();
+    return d2i_OCSP_REQUEST(NULL, &p, len);
+}
+
+// Answers every CertID of req, leaves known by serial only
+static OCSP_RESPONSE *answer(OCSP_REQUEST *req, std::mt19937 *rng)
+{
+    OCSP_BASICRESP *bs = NULL;
+    OCSP_RESPONSE *resp = NULL;
+    ASN1_TIME *now = NULL, *next = NULL;
+    ASN1_OCTET_STRING *padding = NULL;
+    int i;
+
+    if (req == NULL)
+        return OCSP_response_create(OCSP_RESPONSE_STATUS_MALFORMEDREQUEST, NULL);
+    if (std::uniform_real_distribution<double>(0, 1)(*rng) < options.error_rate)
+        return OCSP_response_create(OCSP_RESPONSE_STATUS_TRYLATER, NULL);
+    now = X509_gmtime_adj(NULL, 0);
+    next = X509_gmtime_adj(NULL, 3600);
+    bs = OCSP_BASICRESP_new();
+    if (bs == NULL || now == NULL || next == NULL)
+        goto end;
+    for (i = 0; i < OCSP_request_onereq_count(req); i++) {
+        OCSP_CERTID *id = OCSP_onereq_get0_id(OCSP_request_onereq_get0(req, i));
+        ASN1_INTEGER *serial = NULL;
+        long n;
+        int status = V_OCSP_CERTSTATUS_GOOD;
+
+        OCSP_id_get0_info(NULL, NULL, NULL, &serial, id);
+        n = ASN1_INTEGER_get(serial);
+        if (n < 1 || n > options.certs)
+            status = V_OCSP_CERTSTATUS_UNKNOWN;
+        else if (options.revoked > 0 && n % options.revoked == 0)
+            status = V_OCSP_CERTSTATUS_REVOKED;
+        if (!OCSP_basic_add1_status(bs, id, status, OCSP_REVOKED_STATUS_KEYCOMPROMISE,
+                                    status == V_OCSP_CERTSTATUS_REVOKED ? now : NULL, now, next))
+            goto end;
+    }
+    OCSP_copy_nonce(bs, req);
+    if (options.size > 0) {
+        std::vector<unsigned char> zeros((size_t)options.size);
+        padding = ASN1_OCTET_STRING_new();
+        if (padding == NULL || !ASN1_OCTET_STRING_set(padding, zeros.data(), (int)zeros.size()))
+            goto end;
+        X509_EXTENSION *ext = X509_EXTENSION_create_by_OBJ(NULL, padding_obj, 0, padding);
+        if (ext == NULL || !OCSP_BASICRESP_add_ext(bs, ext, -1)) {
+            X509_EXTENSION_free(ext);
+            goto end;
+        }
+        X509_EXTENSION_free(ext);
+    }
+    if (OCSP_basic_sign(bs, ca_cert, ca_key, EVP_sha256(), NULL, 0))
+        resp = OCSP_response_create(OCSP_RESPONSE_STATUS_SUCCESSFUL, bs);
+
+ end:
+    ASN1_OCTET_STRING_free(padding);
+    ASN1_TIME_free(now);
+    ASN1_TIME_free(next);
+    OCSP_BASICRESP_free(bs);
+    if (resp == NULL)
+        resp = OCSP_response_create(OCSP_RESPONSE_STATUS_INTERNALERROR, NULL);
+    return resp;
+}
+
+static int send_all(int fd, const std::string &data)
+{
+    size_t sent = 0;
+
+    while (sent < data.size()) {
+        ssize_t n = send(fd, data.data() + sent, data.size() - sent, 0);
+        if (n <= 0)
+            return 0;
+        sent += (size_t)n;
+    }
+    return 1;
+}
+
+static void serve(int fd)
+{
+    std::mt19937 rng(std::random_device{}());
+    std::string buf;
+    char chunk[16384];
+    int keep = 1;
+
+    while (keep) {
+        size_t header_end;
+        while ((header_end = buf.find("\r\n\r\n")) == std::string::npos) {
+            ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+            if (n <= 0)
+                goto end;
+            buf.append(chunk, (size_t)n);
+        }
+        std::string head = buf.substr(0, header_end);
+        std::string lower = head;
+        std::transform(lower.begin(), lower.end(), lower.begin(), ::tolower);
+        size_t length = 0, pos = lower.find("\r\ncontent-length:");
+        if (pos != std::string::npos)
+            length = strtoul(lower.c_str() + pos + 17, NULL, 10);
+        while (buf.size() < header_end + 4 + length) {
+            ssize_t n = recv(fd, chunk, sizeof(chunk), 0);
+            if (n <= 0)
+                goto end;
+            buf.append(chunk, (size_t)n);
+        }
+        std::string body = buf.substr(header_end + 4, length);
+        buf.erase(0, header_end + 4 + length);
+
+        // HTTP/1.1 keeps connections open unless told otherwise, 1.0 closes
+        // them unless asked to keep them
+        std::string request_line = lower.substr(0, lower.find("\r\n"));
+        if (lower.find("\r\nconnection: close") != std::string::npos)
+            keep = 0;
+        else if (request_line.size() >= 8
+                 && request_line.compare(request_line.size() - 8, 8, "http/1.0") == 0)
+            keep = lower.find("\r\nconnection: keep-alive") != std::string::npos;
+        keep = keep && options.keep_alive;
+
+        OCSP_REQUEST *req = NULL;
+        if (head.compare(0, 4, "GET ") == 0) {
+            req = decode_get(head.substr(4, head.find(' ', 4) - 4));
+        } else {
+            const unsigned char *p = (const unsigned char *)body.data();
+            req = d2i_OCSP_REQUEST(NULL, &p, (long)body.size());
+        }
+        OCSP_RESPONSE *resp = answer(req, &rng);
+        unsigned char *der = NULL;
+        int len = i2d_OCSP_RESPONSE(resp, &der);
+        OCSP_REQUEST_free(req);
+        OCSP_RESPONSE_free(resp);
+        if (len <= 0)
+            goto end;
+
+        long delay = options.latency;
+        if (options.jitter > 0)
+            delay += std::uniform_int_distribution<long>(0, options.jitter)(rng);
+        if (delay > 0)
+            std::this_thread::sleep_for(std::chrono::milliseconds(delay));
+
+        std::string out = "HTTP/1.1 200 OK\r\nContent-Type: application/ocsp-response\r\n"
+            "Content-Length: " + std::to_string(len) + "\r\nConnection: "
+            + (keep ? "keep-alive" : "close") + "\r\n\r\n";
+        out.append((const char *)der, (size_t)len);
+        OPENSSL_free(der);
+        if (!send_all(fd, out))
+            goto end;
+    }
+
+ end:
+    close(fd);
+}
+
+static int parse_options(int argc, char **argv)
+{
+    int i;
+
+    for (i = 1; i + 1 < argc; i += 2) {
+        std::string name = argv[i];
+        const char *value = argv[i + 1];
+        if (name == "--port")
+            options.port = atoi(value);
+        else if (name == "--dir")
+            options.dir = value;
+        else if (name == "--certs")
+            options.certs = atol(value);
+        else if (name == "--revoked")
+            options.revoked = atol(value);
+        else if (name == "--latency")
+            options.latency = atol(value);
+        else if (name == "--jitter")
+            options.jitter = atol(value);
+        else if (name == "--error-rate")
+            options.error_rate = atof(value);
+        else if (name == "--size")
+            options.size = atol(value);
+        else if (name == "--keep-alive")
+            options.keep_alive = atoi(value);
+        else
+            return 0;
+    }
+    return i == argc;
+}
+
+int main(int argc, char **argv)
+{
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    int fd, one = 1;
+
+    if (!parse_options(argc, argv)) {
+        fprintf(stderr, "usage: %s [--port N] [--dir PATH] [--certs N] [--revoked N] "
+                "[--latency MS] [--jitter MS] [--error-rate F] [--size BYTES] "
+                "[--keep-alive 0|1]\n", argv[0]);
+        return 2;
+    }
+    // Clients closing early must not kill the responder
+    signal(SIGPIPE, SIG_IGN);
+
+    fd = socket(AF_INET, SOCK_STREAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons((uint16_t)options.port);
+    if (fd < 0 || setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0
+        || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(fd, 1024) != 0
+        || getsockname(fd, (struct sockaddr *)&addr, &addr_len) != 0) {
+        perror("listen");
+        return 1;
+    }
+
+    padding_obj = OBJ_txt2obj("1.3.6.1.4.1.55555.1.1", 1);
+    if (padding_obj == NULL
+        || !create_pki("http://127.0.0.1:" + std::to_string(ntohs(addr.sin_port)))) {
+        fprintf(stderr, "Error creating certificates in %s\n", options.dir.c_str());
+        return 1;
+    }
+    printf("listening %d\n", ntohs(addr.sin_port));
+    fflush(stdout);
+
+    for (;;) {
+        int conn = accept(fd, NULL, NULL);
+        if (conn < 0)
+            continue;
+        std::thread(serve, conn).detach();
+    }
+}
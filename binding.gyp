@@ -2,9 +2,37 @@
     "targets": [
         {
             "target_name": "ocsp",
-            "sources": ["src/helper.cpp", "src/ocsp.cpp", "src/binding.cpp"],
+            "sources": ["src/helper.cpp", "src/ocsp.cpp", "src/store.cpp", "src/issuers.cpp", "src/signers.cpp", "src/cache.cpp", "src/shmcache.cpp", "src/refresh.cpp", "src/snapshot.cpp", "src/pool.cpp", "src/breaker.cpp", "src/engine.cpp", "src/workers.cpp", "src/latency.cpp", "src/binding.cpp"],
             "include_dirs": [
                 "<!(node -e \"require('nan')\")"
+            ],
+            "conditions": [
+                ["OS=='linux'", {
+                    "libraries": ["-lrt"]
+                }]
+            ]
+        },
+        {
+            "target_name": "ocsp_responder",
+            "type": "executable",
+            "sources": ["bench/responder.cpp", "bench/pki.cpp"],
+            "conditions": [
+                ["OS!='win'", {
+                    "libraries": ["-lssl", "-lcrypto", "-lpthread"]
+                }]
+            ]
+        },
+        {
+            "target_name": "ocsp_micro",
+            "type": "executable",
+            "sources": ["bench/micro.cpp", "bench/pki.cpp", "src/helper.cpp", "src/ocsp.cpp", "src/store.cpp", "src/issuers.cpp", "src/signers.cpp", "src/cache.cpp", "src/shmcache.cpp", "src/refresh.cpp", "src/snapshot.cpp", "src/pool.cpp", "src/breaker.cpp", "src/latency.cpp"],
+            "conditions": [
+                ["OS!='win'", {
+                    "libraries": ["-lssl", "-lcrypto", "-lpthread"]
+                }],
+                ["OS=='linux'", {
+                    "libraries": ["-lrt"]
+                }]
             ]
         }
     ]
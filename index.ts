@@ -2,23 +2,8 @@ import bindings = require('bindings');
 import * as tls from 'tls';
 
 const ocsp = bindings('ocsp');
-
-const chunks = (s: string, chunkSize: number) => {
-    const retval = [];
-    for (let offset = 0; offset < s.length; offset += chunkSize) {
-        retval.push(s.slice(offset, chunkSize + offset));
-    }
-    return retval;
-};
-
-// alternative https://stackoverflow.com/a/32028304/1435156
-// but does not work with wikipedia.org or google.com
-const derToPem = (buf: Buffer) =>
-    [
-        '-----BEGIN CERTIFICATE-----',
-        ...chunks(buf.toString('base64'), 64),
-        '-----END CERTIFICATE-----',
-    ].join('\n');
+// tslint:disable-next-line:no-var-requires
+const { performance } = require('perf_hooks');
 
 export const enum CertificateStatus {
     // see https://github.com/openssl/openssl/blob/0c496700631d89a895617af005a338eb280095db/crypto/ocsp/ocsp_prn.c#L65-L67
@@ -43,26 +28,194 @@ export const enum RevokedStatus {
     UnknownStatus = '(UNKNOWN)',
 }
 
+// Phases of a lookup: waiting for a worker, resolving, connecting and the
+// TLS handshake to the responder, sending the request and reading the
+// response, verifying it, waiting for the callback to run, and all of it
+export interface PhaseTimings {
+    queue?: number;
+    dns?: number;
+    connect?: number;
+    tls?: number;
+    read?: number;
+    verify?: number;
+    callback?: number;
+    total?: number;
+}
+
 interface ResponseCallback {
     status: number;
     statusStr: CertificateStatus;
     reason: number;
     reasonStr: RevokedStatus;
-    thisUpdate: string;
-    nextUpdate: string;
-    revocationTime: string;
+    // milliseconds since the epoch, as taken by new Date(), null when the
+    // response has none and revocationTime only present when revoked
+    thisUpdate: number | null;
+    nextUpdate: number | null;
+    revocationTime?: number;
+    // microseconds spent in each phase of the lookup, only with the timings
+    // option. Phases that did not run, such as dns on a reused connection,
+    // are left out.
+    timings?: PhaseTimings;
+}
+
+export interface RequestOptions {
+    // send a nonce the response has to echo, defaults to configureRequests
+    nonce?: boolean;
+    // send requests as RFC 5019 GET requests when the URL fits in 255 bytes,
+    // defaults to configureRequests
+    get?: boolean;
+    // milliseconds for the whole exchange with the responder, then for each
+    // of its phases: sending the request and reading the response is the
+    // read phase. Each ends at an absolute deadline, and a lookup running
+    // out fails with 'Timeout on DNS', 'Timeout on connect', 'Timeout on TLS'
+    // or 'Timeout on read'. 0 means no limit, all default to configureRequests.
+    timeout?: number;
+    dnsTimeout?: number;
+    connectTimeout?: number;
+    tlsTimeout?: number;
+    readTimeout?: number;
+    // 'low' for background work such as audits: queued lookups of high
+    // priority, the default, run first, and a full queue sheds low priority
+    // ones first. Only the module's worker threads and the engine queue
+    // lookups.
+    priority?: 'high' | 'low';
+    // add the time spent in each phase to the result, see PhaseTimings
+    timings?: boolean;
+}
+
+// Published on the 'ocsp:lookup:start' and 'ocsp:lookup:end'
+// diagnostics_channel channels, the same object for both so subscribers can
+// tie them together. Fields past url are only set by the end.
+export interface LookupTrace {
+    url: string;
+    error?: string | null;
+    // hex DER of the CertID looked up, empty when the inputs did not parse
+    certId?: string;
+    // host:port
+    responder?: string;
+    // where the result came from: the responder on a 'miss', the response
+    // cache, a stale response while the responder's circuit is open, or a
+    // saved snapshot
+    cache?: 'miss' | 'hit' | 'stale' | 'snapshot';
+    // DER bytes of the request and the response, 0 without an exchange
+    sent?: number;
+    received?: number;
+    timings?: PhaseTimings;
+}
+
+// Published on 'ocsp:lookup:phase' for each phase of a finished lookup,
+// duration in microseconds
+export interface PhaseTrace {
+    lookup: LookupTrace;
+    phase: keyof PhaseTimings;
+    duration: number;
+}
+
+interface Channel {
+    hasSubscribers: boolean;
+    publish(message: any): void;
+}
+
+// diagnostics_channel needs Node 14.17 or 15.1, older versions only trace
+// to PerformanceEntries
+const channels: { start?: Channel; phase?: Channel; end?: Channel } = {};
+try {
+    // tslint:disable-next-line:no-var-requires
+    const diagnostics = require('diagnostics_channel');
+    channels.start = diagnostics.channel('ocsp:lookup:start');
+    channels.phase = diagnostics.channel('ocsp:lookup:phase');
+    channels.end = diagnostics.channel('ocsp:lookup:end');
+} catch (error) {
+    // lookups are not published
+}
+
+// performance.measure only takes a start time and a detail from Node 16
+const measureOptions = Number(process.versions.node.split('.')[0]) >= 16;
+let performanceEntries = false;
+
+export interface TracingOptions {
+    // also emit a PerformanceEntry named 'ocsp.lookup' for every lookup,
+    // its LookupTrace as detail, for PerformanceObserver watching 'measure'
+    // entries. Needs Node 16, older versions emit none. Entries stay in the
+    // performance timeline until performance.clearMeasures().
+    performanceEntries: boolean;
 }
 
+export const configureTracing = (options: TracingOptions) => {
+    performanceEntries = options.performanceEntries && measureOptions;
+};
+
+// Whether a lookup starting now is traced. Native code only gathers what
+// traces report for lookups that are.
+const tracing = () =>
+    performanceEntries ||
+    (channels.start !== undefined && channels.start.hasSubscribers) ||
+    (channels.phase !== undefined && channels.phase.hasSubscribers) ||
+    (channels.end !== undefined && channels.end.hasSubscribers);
+
+// Publishes the start of a lookup of url, the returned function its end
+// from what native code reported
+const startTrace = (url: string) => {
+    const lookup: LookupTrace = { url };
+    const start = performance.now();
+    if (channels.start !== undefined) {
+        channels.start.publish(lookup);
+    }
+    return (error: string | null, trace: LookupTrace) => {
+        Object.assign(lookup, trace, { error });
+        const timings = lookup.timings || {};
+        if (channels.phase !== undefined && channels.phase.hasSubscribers) {
+            for (const phase of Object.keys(timings)) {
+                const name = phase as keyof PhaseTimings;
+                channels.phase.publish({
+                    lookup,
+                    phase: name,
+                    duration: timings[name],
+                });
+            }
+        }
+        if (channels.end !== undefined) {
+            channels.end.publish(lookup);
+        }
+        if (performanceEntries) {
+            performance.measure('ocsp.lookup', {
+                start,
+                detail: lookup,
+            });
+        }
+    };
+};
+
+// cb, publishing the start and end of the lookup of url
+const traceLookup = (
+    url: string,
+    cb: (err: any, response?: any) => void
+) => {
+    const end = startTrace(url);
+    return (err: any, response: any, trace: LookupTrace) => {
+        end(err, trace);
+        cb(err, response);
+    };
+};
+
+// Budgets in the order the native lookups take them
+const timeouts = (options: RequestOptions) => [
+    options.timeout,
+    options.dnsTimeout,
+    options.connectTimeout,
+    options.tlsTimeout,
+    options.readTimeout,
+];
+
 export const getRevocationStatusAsync = (
     socketCertificate: tls.DetailedPeerCertificate,
-    cb: (err: Error, response?: ResponseCallback) => void
+    cb: (err: Error, response?: ResponseCallback) => void,
+    options: RequestOptions = {}
 ) => {
-    const certPem = derToPem(socketCertificate.raw);
     if (socketCertificate.issuerCertificate === undefined) {
         cb(new Error('Missing issuer certificate'));
         return;
     }
-    const issuerPem = derToPem(socketCertificate.issuerCertificate.raw);
     const uris = socketCertificate.infoAccess['OCSP - URI'];
     let url = '';
     let header = '';
@@ -77,7 +230,21 @@ export const getRevocationStatusAsync = (
         return;
     }
 
-    ocsp.getRevocationStatusAsync(certPem, issuerPem, header, url, cb);
+    const traced = tracing();
+    // DER is parsed straight from the buffers, no PEM round trip
+    ocsp.getRevocationStatusDerAsync(
+        socketCertificate.raw,
+        socketCertificate.issuerCertificate.raw,
+        header,
+        url,
+        traced ? traceLookup(url, cb) : cb,
+        options.nonce,
+        options.get,
+        timeouts(options),
+        options.priority === 'low',
+        options.timings,
+        traced
+    );
 };
 
 export const getRevocationStatusAsyncForTesting = (
@@ -85,7 +252,563 @@ export const getRevocationStatusAsyncForTesting = (
     issuerPem: string,
     header: string,
     url: string,
+    cb: (err: Error, response: ResponseCallback) => void,
+    options: RequestOptions = {}
+) => {
+    const traced = tracing();
+    ocsp.getRevocationStatusAsync(
+        certPem,
+        issuerPem,
+        header,
+        url,
+        traced ? traceLookup(url, cb) : cb,
+        options.nonce,
+        options.get,
+        timeouts(options),
+        options.priority === 'low',
+        options.timings,
+        traced
+    );
+};
+
+export const getRevocationStatusDerAsyncForTesting = (
+    certDer: Buffer,
+    issuerDer: Buffer,
+    header: string,
+    url: string,
+    cb: (err: Error, response: ResponseCallback) => void,
+    options: RequestOptions = {}
+) => {
+    const traced = tracing();
+    ocsp.getRevocationStatusDerAsync(
+        certDer,
+        issuerDer,
+        header,
+        url,
+        traced ? traceLookup(url, cb) : cb,
+        options.nonce,
+        options.get,
+        timeouts(options),
+        options.priority === 'low',
+        options.timings,
+        traced
+    );
+};
+
+// Parses an issuer once (DER Buffer or PEM string) and returns a handle,
+// its hex SHA-256 fingerprint, to use in place of the issuer certificate
+export const registerIssuer = (issuer: Buffer | string): string =>
+    ocsp.registerIssuer(issuer);
+
+export const unregisterIssuer = (handle: string): boolean =>
+    ocsp.unregisterIssuer(handle);
+
+export const getRevocationStatusForIssuerAsync = (
+    certDer: Buffer,
+    issuerHandle: string,
+    url: string,
+    cb: (err: Error, response?: ResponseCallback) => void,
+    options: RequestOptions = {}
+) => {
+    let header = '';
+    try {
+        // Some OCSP responders require a Host header
+        header = `Host=${new URL(url).host}`;
+    } catch (error) {
+        cb(error);
+        return;
+    }
+    const traced = tracing();
+    ocsp.getRevocationStatusDerAsync(
+        certDer,
+        issuerHandle,
+        header,
+        url,
+        traced ? traceLookup(url, cb) : cb,
+        options.nonce,
+        options.get,
+        timeouts(options),
+        options.priority === 'low',
+        options.timings,
+        traced
+    );
+};
+
+export interface BatchEntry {
+    cert: Buffer;
+    // issuer DER, or a handle from registerIssuer
+    issuer: Buffer | string;
+    url: string;
+}
+
+export interface BatchOptions extends RequestOptions {
+    // CertIDs sent in one request to a responder, responders rejecting
+    // multi-certificate requests are asked one certificate at a time
+    maxPerRequest?: number;
+}
+
+export interface BatchResult {
+    error: string | null;
+    response: ResponseCallback;
+}
+
+export interface ManyOptions extends BatchOptions {
+    // results as TypedResults instead of one object per entry
+    typed?: boolean;
+}
+
+// status[i] and reason[i] as in ResponseCallback, error[i] is 0 or one
+// plus the index of the error message in errors
+export interface TypedResults {
+    status: Int32Array;
+    reason: Int32Array;
+    error: Int32Array;
+    errors: string[];
+}
+
+// cb, publishing the start and end of the lookup of each entry
+const traceMany = (
+    entries: BatchEntry[],
+    cb: (err: Error | null, results?: any) => void
+) => {
+    const ends = entries.map(entry => startTrace(entry.url));
+    return (
+        err: Error | null,
+        results: BatchResult[] | TypedResults,
+        traces: LookupTrace[]
+    ) => {
+        traces.forEach((trace, i) => {
+            if (Array.isArray(results)) {
+                ends[i](results[i].error, trace);
+            } else {
+                const code = results.error[i];
+                ends[i](code === 0 ? null : results.errors[code - 1], trace);
+            }
+        });
+        cb(err, results);
+    };
+};
+
+const queryMany = (
+    entries: BatchEntry[],
+    options: BatchOptions,
+    typed: boolean,
+    cb: (err: Error | null, results?: any) => void
+) => {
+    const headers = [];
+    try {
+        for (const entry of entries) {
+            // Some OCSP responders require a Host header
+            headers.push(`Host=${new URL(entry.url).host}`);
+        }
+    } catch (error) {
+        cb(error);
+        return;
+    }
+    const traced = tracing();
+    ocsp.getRevocationStatusMany(
+        entries.map(entry => entry.cert),
+        entries.map(entry => entry.issuer),
+        headers,
+        entries.map(entry => entry.url),
+        options.maxPerRequest === undefined ? 16 : options.maxPerRequest,
+        typed,
+        traced ? traceMany(entries, cb) : cb,
+        options.nonce,
+        options.get,
+        timeouts(options),
+        options.priority === 'low',
+        options.timings,
+        traced
+    );
+};
+
+// Looks up many certificates, packing those that share a responder into
+// as few exchanges as possible. results follow the order of entries.
+export const getRevocationStatusBatchAsync = (
+    entries: BatchEntry[],
+    options: BatchOptions,
+    cb: (err: Error | null, results?: BatchResult[]) => void
+) => {
+    queryMany(entries, options, false, cb);
+};
+
+// getRevocationStatusBatchAsync handing all entries to native code at
+// once, returns a Promise when no callback is given
+export const getRevocationStatusMany = (
+    entries: BatchEntry[],
+    options: ManyOptions = {},
+    cb?: (err: Error | null, results?: BatchResult[] | TypedResults) => void
+): Promise<BatchResult[] | TypedResults> | undefined => {
+    if (cb === undefined) {
+        return new Promise((resolve, reject) => {
+            queryMany(entries, options, !!options.typed, (err, results) =>
+                err ? reject(err) : resolve(results)
+            );
+        });
+    }
+    queryMany(entries, options, !!options.typed, cb);
+    return undefined;
+};
+
+// Verifies a DER OCSP response received without asking the responder,
+// e.g. from the TLSSocket 'OCSPResponse' event, and caches it. issuer is
+// the issuer DER or a handle from registerIssuer. Throws when the response
+// does not verify or does not cover cert.
+export const verifyStapledResponse = (
+    response: Buffer,
+    cert: Buffer,
+    issuer: Buffer | string
+): ResponseCallback => ocsp.verifyStapledResponse(response, cert, issuer);
+
+export const verifyStapledResponseAsync = (
+    response: Buffer,
+    cert: Buffer,
+    issuer: Buffer | string,
     cb: (err: Error, response: ResponseCallback) => void
 ) => {
-    ocsp.getRevocationStatusAsync(certPem, issuerPem, header, url, cb);
+    ocsp.verifyStapledResponseAsync(response, cert, issuer, cb);
+};
+
+// Answers from the response cache without any I/O, returning undefined
+// when no fresh response is cached so the caller can fall back to an
+// async lookup. issuer is the issuer DER or a handle from registerIssuer.
+export const peekRevocationStatus = (
+    cert: Buffer,
+    issuer: Buffer | string
+): ResponseCallback | undefined => ocsp.peekRevocationStatus(cert, issuer);
+
+export interface TrustStoreOptions {
+    // PEM file, hashed directory and/or in-memory PEM bundle of trusted CAs,
+    // when none is given the OpenSSL defaults are used
+    caFile?: string;
+    caDir?: string;
+    caPem?: string;
+    // seconds between checks of caFile/caDir for changes, 0 disables reloading
+    reloadInterval?: number;
+}
+
+export const configureTrustStore = (options: TrustStoreOptions) => {
+    ocsp.configureTrustStore(
+        options.caFile,
+        options.caDir,
+        options.caPem,
+        options.reloadInterval === undefined ? 60 : options.reloadInterval
+    );
+};
+
+export interface CacheOptions {
+    // number of responses kept, least recently used ones are evicted first,
+    // 0 disables the cache
+    maxEntries: number;
+    // seconds before nextUpdate at which a cached response stops being served
+    margin: number;
+}
+
+export interface CacheStats {
+    hits: number;
+    misses: number;
+    evictions: number;
+    // served past the margin because the responder's circuit was open
+    stale: number;
+    // answered and missed by peekRevocationStatus
+    peeks: number;
+    peekMisses: number;
+    size: number;
+}
+
+export const configureCache = (options: CacheOptions) => {
+    ocsp.configureCache(options.maxEntries, options.margin);
+};
+
+export const getCacheStats = (): CacheStats => ocsp.getCacheStats();
+
+// Responder signing certificates are verified once per trust store and
+// then trusted until they expire, later responses they sign only need
+// their signature checked
+export interface SignerStats {
+    // responses from an already verified signer
+    fast: number;
+    // responses whose signer chain was verified
+    full: number;
+    // verified signers remembered
+    size: number;
+}
+
+export const getSignerStats = (): SignerStats => ocsp.getSignerStats();
+
+export interface SharedCacheOptions {
+    // POSIX shared memory name such as '/ocsp', processes using the same
+    // name share verified responses, an empty string detaches
+    name: string;
+    // 4 KiB records, only used by the process creating the segment
+    slots?: number;
+}
+
+export interface SharedCacheStats {
+    hits: number;
+    misses: number;
+    writes: number;
+    // records replaced to make room, or too large to share
+    evictions: number;
+    // records taken over from processes that died while writing them
+    recovered: number;
+    slots: number;
+}
+
+export const configureSharedCache = (options: SharedCacheOptions) => {
+    ocsp.configureSharedCache(
+        options.name,
+        options.slots === undefined ? 4096 : options.slots
+    );
 };
+
+export const getSharedCacheStats = (): SharedCacheStats =>
+    ocsp.getSharedCacheStats();
+
+export interface RefreshOptions {
+    // responses refetched at once in the background, 0 disables refreshing
+    concurrency: number;
+    // part of a response's validity window after which it is refetched
+    fraction?: number;
+    // up to this part of the window is added at random to spread refreshes
+    jitter?: number;
+    // seconds without a cache hit after which a response is left to expire
+    idleTimeout?: number;
+}
+
+export interface RefreshStats {
+    refreshed: number;
+    failed: number;
+    // left to expire after idleTimeout, or evicted from the cache
+    expired: number;
+    tracked: number;
+    active: number;
+}
+
+// Keeps cached responses that are still being looked up fresh, so their
+// lookups keep hitting the cache past nextUpdate
+export const configureRefresh = (options: RefreshOptions) => {
+    ocsp.configureRefresh(
+        options.concurrency,
+        options.fraction === undefined ? 0.5 : options.fraction,
+        options.jitter === undefined ? 0.1 : options.jitter,
+        options.idleTimeout === undefined ? 3600 : options.idleTimeout
+    );
+};
+
+export const getRefreshStats = (): RefreshStats => ocsp.getRefreshStats();
+
+export interface SnapshotOptions {
+    // file cached responses are saved to and loaded from at startup, an
+    // empty string saves one last time and stops saving
+    path: string;
+    // seconds between saves, 0 only saves on writeSnapshot
+    interval?: number;
+}
+
+export interface SnapshotStats {
+    loaded: number;
+    served: number;
+    // failed signature or validity checks when first looked up
+    rejected: number;
+    written: number;
+    // loaded responses not looked up yet
+    pending: number;
+}
+
+// Loaded responses are verified on their first lookup and then served like
+// cached ones, so a restarted process does not have to ask responders again
+export const configureSnapshot = (options: SnapshotOptions) => {
+    ocsp.configureSnapshot(
+        options.path,
+        options.interval === undefined ? 300 : options.interval
+    );
+};
+
+export const writeSnapshot = () => {
+    ocsp.writeSnapshot();
+};
+
+export const getSnapshotStats = (): SnapshotStats => ocsp.getSnapshotStats();
+
+export interface PoolOptions {
+    // connections per host:port:tls, in use or kept alive, 0 disables
+    // pooling. Lookups beyond it wait for a connection within their connect
+    // timeout.
+    maxPerHost: number;
+    // milliseconds after which an idle connection is closed
+    idleTimeout: number;
+}
+
+export interface PoolStats {
+    created: number;
+    reused: number;
+    // closed after idleTimeout
+    expired: number;
+    // closed by the responder while idle, found on checkout
+    unhealthy: number;
+    closed: number;
+    // lookups that found their host at maxPerHost and waited
+    waited: number;
+    // lookups that gave up waiting, failing with 'Timeout on connect'
+    exhausted: number;
+    idle: number;
+    active: number;
+}
+
+export const configurePool = (options: PoolOptions) => {
+    ocsp.configurePool(options.maxPerHost, options.idleTimeout);
+};
+
+export const getPoolStats = (): PoolStats => ocsp.getPoolStats();
+
+export interface BreakerOptions {
+    // consecutive failed exchanges opening a responder's circuit, 0
+    // disables the breaker
+    failures: number;
+    // moving error rate opening it as well, defaults to 0.5
+    errorRate?: number;
+    // milliseconds an open circuit fails lookups fast, defaults to 30000
+    cooldown?: number;
+    // exchanges let through at once to test a responder after cooldown
+    probes?: number;
+    // answer with cached responses past the cache margin but not their
+    // nextUpdate instead of failing, defaults to true
+    serveStale?: boolean;
+}
+
+export interface BreakerState {
+    // host:port:tls
+    responder: string;
+    state: 'closed' | 'open' | 'half-open';
+    consecutiveFailures: number;
+    // moving averages over recent exchanges, latency in milliseconds
+    errorRate: number;
+    latency: number;
+    requests: number;
+    failures: number;
+    // lookups failed fast or served stale while open
+    rejected: number;
+    transitions: number;
+    // milliseconds since the epoch of the last transition
+    since: number;
+}
+
+// Lookups of a responder whose circuit is open fail with
+// 'Responder circuit open' without waiting for a timeout
+export const configureBreaker = (options: BreakerOptions) => {
+    ocsp.configureBreaker(
+        options.failures,
+        options.errorRate === undefined ? 0.5 : options.errorRate,
+        options.cooldown === undefined ? 30000 : options.cooldown,
+        options.probes === undefined ? 1 : options.probes,
+        options.serveStale === undefined ? true : options.serveStale
+    );
+};
+
+export const getBreakerStates = (): BreakerState[] => ocsp.getBreakerStates();
+
+export interface EngineOptions {
+    // I/O threads each multiplexing many responder exchanges, instead of one
+    // libuv threadpool thread blocked per lookup. 0 goes back to the
+    // threadpool, at most 1024. Linux only, other platforms throw.
+    threads: number;
+    // exchanges in flight at once across all responders, 1024 unless set,
+    // 0 for no limit. Lookups past it wait under the WorkerOptions
+    // maxQueued and overflow limits.
+    maxInFlight?: number;
+}
+
+export const configureEngine = (options: EngineOptions) => {
+    ocsp.configureEngine(
+        options.threads,
+        options.maxInFlight === undefined ? 1024 : options.maxInFlight
+    );
+};
+
+export interface WorkerOptions {
+    // threads of the module's own running blocking lookups, 4 until
+    // configured, at most 1024. 0 goes back to the libuv threadpool shared
+    // with fs, dns and zlib.
+    threads: number;
+    // lookups running at once per responder host:port, so a slow responder
+    // cannot take every thread, or with the engine every connection. 0, the
+    // default, for no limit.
+    maxPerHost?: number;
+    // lookups waiting for a thread, or with the engine for their responder
+    // to go below maxPerHost or for room under its maxInFlight, 0, the
+    // default, for no limit. Once full, new
+    // lookups fail with 'Lookup queue full', or with overflow 'shed' the
+    // oldest low priority lookup fails with 'Lookup shed from queue' to
+    // make room.
+    maxQueued?: number;
+    overflow?: 'reject' | 'shed';
+}
+
+// Lookups run by the engine are counted with those run on threads
+export interface WorkerStats {
+    threads: number;
+    active: number;
+    // waiting for a thread, throttled ones for their responder to go below
+    // maxPerHost
+    queued: number;
+    throttled: number;
+    completed: number;
+    rejected: number;
+    shed: number;
+}
+
+export const configureWorkers = (options: WorkerOptions) => {
+    ocsp.configureWorkers(
+        options.threads,
+        options.maxPerHost === undefined ? 0 : options.maxPerHost,
+        options.maxQueued === undefined ? 0 : options.maxQueued,
+        options.overflow === 'shed'
+    );
+};
+
+export const getWorkerStats = (): WorkerStats => ocsp.getWorkerStats();
+
+export interface RequestDefaults {
+    // defaults to true
+    nonce?: boolean;
+    // defaults to false
+    get?: boolean;
+    // milliseconds, as in RequestOptions. timeout defaults to 5000, phases
+    // default to 0: only bounded by timeout.
+    timeout?: number;
+    dnsTimeout?: number;
+    connectTimeout?: number;
+    tlsTimeout?: number;
+    readTimeout?: number;
+}
+
+// Requests without a nonce can be answered from pre-produced responses and,
+// sent as GET, by HTTP caches on the way to the responder
+export const configureRequests = (options: RequestDefaults) => {
+    ocsp.configureRequests(
+        options.nonce === undefined ? true : options.nonce,
+        options.get === undefined ? false : options.get,
+        timeouts(options)
+    );
+};
+
+// Microseconds, values within about 3%
+export interface LatencySummary {
+    count: number;
+    mean: number;
+    max: number;
+    p50: number;
+    p90: number;
+    p99: number;
+    p999: number;
+}
+
+// Latency histograms of lookups made from JS, by responder host:port, then
+// by phase as in PhaseTimings. Phases no lookup went through are left out.
+// reset empties the histograms, so the next call covers the interval since.
+export const getLatencyStats = (
+    reset = false
+): { [responder: string]: { [phase: string]: LatencySummary } } =>
+    ocsp.getLatencyStats(reset);
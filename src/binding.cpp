@@ -1,19 +1,354 @@
+#include <atomic>
+#include <chrono>
+#include <climits>
+#include <cmath>
 #include <iostream>
+#include <memory>
+#include <unordered_map>
+#include <vector>
 #include <nan.h>
+#include "breaker.h"
+#include "cache.h"
+#include "engine.h"
+#include "issuers.h"
+#include "latency.h"
 #include "ocsp.h"
+#include "pool.h"
+#include "refresh.h"
+#include "shmcache.h"
+#include "signers.h"
+#include "snapshot.h"
+#include "store.h"
+#include "workers.h"
 
 using namespace std;
 using namespace v8;
 using namespace Nan;
+using std::chrono::steady_clock;
 
-class OCSPWorker : public AsyncWorker {
+// A caller of a lookup, and what it asked to get back besides the result
+struct Waiter {
+    Callback *callback;
+    bool timings;
+    bool trace;
+};
+
+// A lookup in flight, first waiter the one that started it and owns its
+// callback, the rest joined it later
+struct InFlight {
+    vector<Waiter> waiters;
+    // Hex CertID for traced waiters, set by the first of them
+    string certId;
+    // Raised once a waiter traces, the lookup then counts its exchange.
+    // Shared with the worker, which may outlive the entry.
+    std::shared_ptr<std::atomic<int>> traced;
+};
+
+// Lookups in flight keyed by LookupKey. Only touched from the main thread.
+static unordered_map<string, InFlight> in_flight;
+
+// Largest thread count and other numeric option accepted. Past them
+// casting the JS number is undefined, or the process would only exhaust
+// itself trying.
+#define MAX_THREADS 1024
+#define MAX_OPTION INT_MAX
+
+// Whether value is a number from min to max, NaN and infinities are not
+static bool InRange (double value, double min, double max) {
+    return value >= min && value <= max;
+}
+
+// host:port of a responder URL, what per-host worker limits count by
+static string Responder (const string &url) {
+    size_t start = url.find("://");
+    start = start == string::npos ? 0 : start + 3;
+    size_t end = url.find('/', start);
+    return url.substr(start, end == string::npos ? string::npos : end - start);
+}
+
+// Microseconds each phase that ran took
+static Local<Object> BuildTimings (const ocspCheck &result) {
+    Local<Object> phases = New<Object>();
+    for (int phase = 0; phase < PHASE_COUNT; phase++) {
+        if (result.timings[phase] > 0) {
+            Nan::Set(phases, New(phase_name(phase)).ToLocalChecked(), New<Number>((double)result.timings[phase]));
+        }
+    }
+    return phases;
+}
+
+static Local<Object> BuildResult (const ocspCheck &result, bool timings = false) {
+    Local<Object> value = New<Object>();
+    Nan::Set(value, New("status").ToLocalChecked(), New(result.status));
+    if (result.statusStr == NULL) {
+        Nan::Set(value, New("statusStr").ToLocalChecked(), Null());
+    } else {
+        Nan::Set(value, New("statusStr").ToLocalChecked(), New(result.statusStr).ToLocalChecked());
+    }
+    Nan::Set(value, New("reason").ToLocalChecked(), New(result.reason));
+    if (result.reasonStr == NULL) {
+        Nan::Set(value, New("reasonStr").ToLocalChecked(), Null());
+    } else {
+        Nan::Set(value, New("reasonStr").ToLocalChecked(), New(result.reasonStr).ToLocalChecked());
+    }
+    if (result.thisupd == 0) {
+        Nan::Set(value, New("thisUpdate").ToLocalChecked(), Null());
+    } else {
+        Nan::Set(value, New("thisUpdate").ToLocalChecked(), New<Number>((double)result.thisupd));
+    }
+    if (result.nextupd == 0) {
+        Nan::Set(value, New("nextUpdate").ToLocalChecked(), Null());
+    } else {
+        Nan::Set(value, New("nextUpdate").ToLocalChecked(), New<Number>((double)result.nextupd));
+    }
+    if (!(result.revoked == 0)) {
+        Nan::Set(value, New("revocationTime").ToLocalChecked(), New<Number>((double)result.revoked));
+    }
+    if (timings) {
+        Nan::Set(value, New("timings").ToLocalChecked(), BuildTimings(result));
+    }
+    return value;
+}
+
+// What a traced lookup of certId at url reports besides its result
+static Local<Object> BuildTrace (const ocspCheck &result, const string &certId, const string &url) {
+    static const char *outcomes[] = {"miss", "hit", "stale", "snapshot"};
+    Local<Object> value = New<Object>();
+    Nan::Set(value, New("certId").ToLocalChecked(), New(certId).ToLocalChecked());
+    Nan::Set(value, New("responder").ToLocalChecked(), New(Responder(url)).ToLocalChecked());
+    Nan::Set(value, New("cache").ToLocalChecked(), New(outcomes[result.cache]).ToLocalChecked());
+    Nan::Set(value, New("sent").ToLocalChecked(), New<Number>((double)result.sent));
+    Nan::Set(value, New("received").ToLocalChecked(), New<Number>((double)result.received));
+    Nan::Set(value, New("timings").ToLocalChecked(), BuildTimings(result));
+    return value;
+}
+
+// Calls back the lookup that ran and every lookup that joined it, traced
+// ones with the BuildTrace of their CertID as a third argument. Must be
+// run inside the main event loop.
+static void DeliverResult (const string &key, const ocspCheck &result,
+                           AsyncResource *resource, const string &url) {
+    Nan::HandleScope scope;
+
+    auto it = in_flight.find(key);
+    if (it == in_flight.end()) {
+        return;
+    }
+    InFlight lookup = std::move(it->second);
+    in_flight.erase(it);
+
+    Local<Value> error = Null();
+    if (!(result.errorStr == NULL)) {
+        error = Nan::New(result.errorStr).ToLocalChecked();
+    }
+
+    // Every caller gets its own result object, and a throwing callback
+    // must not keep the others from running
+    for (size_t i = 0; i < lookup.waiters.size(); i++) {
+        const Waiter &waiter = lookup.waiters[i];
+        Local<Value> argv[] = {
+            error,
+            BuildResult(result, waiter.timings),
+            waiter.trace ? Local<Value>(BuildTrace(result, lookup.certId, url)) : Local<Value>(Undefined())
+        };
+
+        Nan::TryCatch try_catch;
+        waiter.callback->Call(waiter.trace ? 3 : 2, argv, resource);
+        if (try_catch.HasCaught()) {
+            Nan::FatalException(try_catch);
+        }
+        if (i > 0) {
+            delete waiter.callback;
+        }
+    }
+}
+
+// Keys a lookup by what its responder is asked, the URL, header, CertID
+// and request options, so callers passing the same certificate as PEM or
+// DER join one lookup. request holds the inputs, parsed on the calling
+// thread, and raw their bytes to key by when they do not parse: such
+// lookups only fail alike. certId is filled for traced callers.
+static string LookupKey (ocspRequest *request, const char *cert, const char *issuer,
+                         const string &raw, const string &header, const string &url,
+                         int nonce, int useGet, const ocspTimeouts &timeouts,
+                         bool trace, string *certId) {
+    request->key_only = 1;
+    request->trace = trace ? 1 : 0;
+    int parsed = prepareOCSP(request, cert, issuer, "", NULL, -1);
+    freeOCSP(request);
+    *certId = request->cert_id;
+    return url + '\0' + header + '\0' + (parsed ? "id" + request->cache_key : "raw" + raw)
+        + '\0' + to_string(nonce) + to_string(useGet) + ',' + to_string(timeouts.total) + ','
+        + to_string(timeouts.dns) + ',' + to_string(timeouts.connect) + ','
+        + to_string(timeouts.tls) + ',' + to_string(timeouts.read);
+}
+
+// Starts tracking the lookup of key, or adds callback to the one already in
+// flight and returns false. traced is the flag the lookup started counts
+// its exchange by.
+static bool StartLookup (const string &key, Callback *callback, bool timings, bool trace,
+                         const string &certId, std::shared_ptr<std::atomic<int>> *traced) {
+    auto it = in_flight.find(key);
+    bool started = it == in_flight.end();
+    if (started) {
+        it = in_flight.emplace(key, InFlight()).first;
+        it->second.traced = std::make_shared<std::atomic<int>>(0);
+    }
+    InFlight &lookup = it->second;
+    lookup.waiters.push_back(Waiter { callback, timings, trace });
+    if (trace) {
+        if (lookup.certId.empty()) {
+            lookup.certId = certId;
+        }
+        lookup.traced->store(1);
+    }
+    *traced = lookup.traced;
+    return started;
+}
+
+// Per-call nonce and GET choice, -1 when undefined follows configureRequests
+static int RequestFlag (Local<Value> value) {
+    if (value->IsUndefined()) {
+        return -1;
+    }
+    return Nan::To<bool>(value).FromMaybe(false) ? 1 : 0;
+}
+
+// Per-call budgets [total, dns, connect, tls, read] in milliseconds,
+// undefined ones follow configureRequests. Returns false if one is negative
+// or too large.
+static bool RequestTimeouts (Local<Value> value, ocspTimeouts *timeouts) {
+    long *budgets[] = { &timeouts->total, &timeouts->dns, &timeouts->connect,
+                        &timeouts->tls, &timeouts->read };
+    if (!value->IsArray()) {
+        return true;
+    }
+    Local<Array> array = value.As<Array>();
+    for (uint32_t i = 0; i < 5; i++) {
+        Local<Value> budget = Nan::Get(array, i).ToLocalChecked();
+        if (budget->IsUndefined()) {
+            continue;
+        }
+        double ms = Nan::To<double>(budget).FromMaybe(-1);
+        if (!InRange(ms, 0, MAX_OPTION)) {
+            return false;
+        }
+        *budgets[i] = (long)ceil(ms);
+    }
+    return true;
+}
+
+// A worker the admission queue may turn away, it then calls back with
+// error as its result instead of running. Times how long it waited to run
+// and to call back.
+class LookupWorker : public AsyncWorker {
  public:
-  OCSPWorker(Callback *callback, string cert, string issuer, string header, string url)
-    : AsyncWorker(callback) {
+  explicit LookupWorker(Callback *callback) : AsyncWorker(callback) {
+        this->created = this->begun = this->ended = steady_clock::now();
+  }
+
+  void Execute () {
+        this->begun = steady_clock::now();
+        this->Run();
+        this->ended = steady_clock::now();
+  }
+
+  void TurnAway (const char *error) {
+        this->begun = this->ended = steady_clock::now();
+        this->Reject(error);
+  }
+
+  virtual void Run () = 0;
+
+  virtual void Reject (const char *error) = 0;
+
+ protected:
+  // Fills the phases timed around the worker and adds result to the
+  // histograms of the responder at url. Main thread only.
+  void Record (ocspCheck *result, const string &url) {
+        steady_clock::time_point now = steady_clock::now();
+        result->timings[PHASE_QUEUE] = latency_us(this->created, this->begun);
+        result->timings[PHASE_CALLBACK] = latency_us(this->ended, now);
+        result->timings[PHASE_TOTAL] = latency_us(this->created, now);
+        latency_record(Responder(url), *result);
+  }
+
+ private:
+    steady_clock::time_point created;
+    steady_clock::time_point begun;
+    steady_clock::time_point ended;
+};
+
+static void ExecuteWorker (void *data) {
+    ((LookupWorker *)data)->Execute();
+}
+
+static void CompleteWorker (void *data, int status) {
+    LookupWorker *worker = (LookupWorker *)data;
+    if (status == WORKER_REJECTED) {
+        worker->TurnAway("Lookup queue full");
+    } else if (status == WORKER_SHED) {
+        worker->TurnAway("Lookup shed from queue");
+    }
+    worker->WorkComplete();
+    worker->Destroy();
+}
+
+// Runs worker on the module's own threads, or on the libuv threadpool
+// when configureWorkers turned them off
+static void QueueWorker (LookupWorker *worker, const string &url, int priority) {
+    if (!workers_enabled()) {
+        AsyncQueueWorker(worker);
+        return;
+    }
+    workers_submit(Responder(url), priority, ExecuteWorker, CompleteWorker, worker);
+}
+
+// Per-call priority, lookups not flagged low go first
+static int RequestPriority (Local<Value> value) {
+    return Nan::To<bool>(value).FromMaybe(false) ? WORKER_LOW : WORKER_HIGH;
+}
+
+class OCSPWorker : public LookupWorker {
+ public:
+  OCSPWorker(Callback *callback, string cert, string issuer, string header, string url, string key,
+             int nonce, int useGet, const ocspTimeouts &timeouts,
+             std::shared_ptr<std::atomic<int>> traced)
+    : LookupWorker(callback) {
         this->cert = cert;
         this->issuer = issuer;
         this->header = header;
         this->url = url;
+        this->key = key;
+        this->nonce = nonce;
+        this->useGet = useGet;
+        this->timeouts = timeouts;
+        this->traced = traced;
+    }
+  // DER input, parsed straight from the buffers which are kept alive until
+  // the worker is destroyed. issuer is either a Buffer or a registered
+  // issuer handle.
+  OCSPWorker(Callback *callback, Local<Object> cert, Local<Value> issuer, string header, string url, string key,
+             int nonce, int useGet, const ocspTimeouts &timeouts,
+             std::shared_ptr<std::atomic<int>> traced)
+    : LookupWorker(callback) {
+        SaveToPersistent("cert", cert);
+        this->certDer = (const unsigned char *)node::Buffer::Data(cert);
+        this->certDerLen = node::Buffer::Length(cert);
+        if (issuer->IsString()) {
+            this->issuerHandle = *Nan::Utf8String(issuer);
+        } else {
+            SaveToPersistent("issuer", issuer);
+            this->issuerDer = (const unsigned char *)node::Buffer::Data(issuer);
+            this->issuerDerLen = node::Buffer::Length(issuer);
+        }
+        this->header = header;
+        this->url = url;
+        this->key = key;
+        this->nonce = nonce;
+        this->useGet = useGet;
+        this->timeouts = timeouts;
+        this->traced = traced;
     }
   ~OCSPWorker() {}
 
@@ -21,84 +356,997 @@ class OCSPWorker : public AsyncWorker {
   // It is not safe to access V8, or V8 data structures
   // here, so everything we need for input and output
   // should go on `this`.
-  void Execute () {
-        int timeout = 5;
-        this->result = verifyOCSP(this->cert.c_str(), this->issuer.c_str(), this->header.c_str(), this->url.c_str(), timeout);
+  void Run () {
+        ocspRequest request;
+        request.cert_der = this->certDer;
+        request.cert_der_len = this->certDerLen;
+        request.issuer_der = this->issuerDer;
+        request.issuer_der_len = this->issuerDerLen;
+        request.issuer_handle = this->issuerHandle;
+        request.nonce = this->nonce;
+        request.use_get = this->useGet;
+        request.timeouts = this->timeouts;
+        request.traced = this->traced.get();
+        this->result = verifyOCSPRequest(&request, this->cert.c_str(), this->issuer.c_str(), this->header.c_str(), this->url.c_str(), -1);
   }
 
   // Executed when the async work is complete
   // this function will be run inside the main event loop
   // so it is safe to use V8 again
   void HandleOKCallback () {
-    Nan::HandleScope scope;
+    Record(&this->result, this->url);
+    DeliverResult(this->key, this->result, async_resource, this->url);
+  }
 
-    Local<Object> value = New<Object>();
-    Nan::Set(value, New("status").ToLocalChecked(), New(this->result.status));
-    if (this->result.statusStr == NULL) {
-        Nan::Set(value, New("statusStr").ToLocalChecked(), Null());
-    } else {
-        Nan::Set(value, New("statusStr").ToLocalChecked(), New(this->result.statusStr).ToLocalChecked());
-    }
-    Nan::Set(value, New("reason").ToLocalChecked(), New(this->result.reason));
-    if (this->result.reasonStr == NULL) {
-        Nan::Set(value, New("reasonStr").ToLocalChecked(), Null());
-    } else {
-        Nan::Set(value, New("reasonStr").ToLocalChecked(), New(this->result.reasonStr).ToLocalChecked());
-    }
-    if (this->result.thisupdStr == NULL) {
-        Nan::Set(value, New("thisUpdate").ToLocalChecked(), Null());
-    } else {
-        Nan::Set(value, New("thisUpdate").ToLocalChecked(), New(this->result.thisupdStr).ToLocalChecked());
-    }
-    if (this->result.nextupdStr == NULL) {
-        Nan::Set(value, New("nextUpdate").ToLocalChecked(), Null());
-    } else {
-        Nan::Set(value, New("nextUpdate").ToLocalChecked(), New(this->result.nextupdStr).ToLocalChecked());
-    }
-    if (!(this->result.revokedStr == NULL)) {
-        Nan::Set(value, New("revocationTime").ToLocalChecked(), New(this->result.revokedStr).ToLocalChecked());
+  void Reject (const char *error) {
+        this->result.errorStr = error;
+  }
+
+  private:
+    string cert;
+    string issuer;
+    string header;
+    string url;
+    string key;
+    const unsigned char *certDer = NULL;
+    size_t certDerLen = 0;
+    const unsigned char *issuerDer = NULL;
+    size_t issuerDerLen = 0;
+    string issuerHandle;
+    int nonce;
+    int useGet;
+    ocspTimeouts timeouts;
+    std::shared_ptr<std::atomic<int>> traced;
+    ocspCheck result;
+};
+
+// Verifies a stapled response, its buffers are kept alive until the
+// worker is destroyed
+class OCSPStapleWorker : public LookupWorker {
+ public:
+  OCSPStapleWorker(Callback *callback, Local<Object> response, Local<Object> cert, Local<Value> issuer)
+    : LookupWorker(callback) {
+        SaveToPersistent("response", response);
+        SaveToPersistent("cert", cert);
+        this->responseDer = (const unsigned char *)node::Buffer::Data(response);
+        this->responseDerLen = node::Buffer::Length(response);
+        this->request.cert_der = (const unsigned char *)node::Buffer::Data(cert);
+        this->request.cert_der_len = node::Buffer::Length(cert);
+        if (issuer->IsString()) {
+            this->request.issuer_handle = *Nan::Utf8String(issuer);
+        } else {
+            SaveToPersistent("issuer", issuer);
+            this->request.issuer_der = (const unsigned char *)node::Buffer::Data(issuer);
+            this->request.issuer_der_len = node::Buffer::Length(issuer);
+        }
     }
+  ~OCSPStapleWorker() {}
+
+  void Run () {
+        this->result = verifyStapledOCSP(&this->request, this->responseDer, this->responseDerLen);
+  }
+
+  void Reject (const char *error) {
+        this->result.errorStr = error;
+  }
+
+  void HandleOKCallback () {
+    Nan::HandleScope scope;
 
     Local<Value> error = Null();
     if (!(this->result.errorStr == NULL)) {
         error = Nan::New(this->result.errorStr).ToLocalChecked();
     }
-
     Local<Value> argv[] = {
         error,
-        value
+        BuildResult(this->result)
     };
-
-    Nan::Call(callback->GetFunction(), Nan::GetCurrentContext()->Global(), 2, argv);
+    callback->Call(2, argv, async_resource);
   }
 
   private:
-    string cert;
-    string issuer;
+    const unsigned char *responseDer;
+    size_t responseDerLen;
+    ocspRequest request;
+    ocspCheck result;
+};
+
+// One certificate of a getRevocationStatusMany call, its buffers are kept
+// alive by the worker looking it up
+struct BatchEntry {
+    const unsigned char *certDer = NULL;
+    size_t certDerLen = 0;
+    const unsigned char *issuerDer = NULL;
+    size_t issuerDerLen = 0;
+    string issuerHandle;
     string header;
     string url;
     ocspCheck result;
+    // Set for traced calls
+    string certId;
+};
+
+// A getRevocationStatusMany call, shared by the workers of its chunks.
+// The last worker to complete calls back with every result.
+struct ManyRequest {
+    vector<BatchEntry> entries;
+    size_t pending = 0;
+    bool typed = false;
+    int nonce = -1;
+    int useGet = -1;
+    ocspTimeouts timeouts;
+    bool timings = false;
+    bool trace = false;
+    Callback *callback = NULL;
+};
+
+static Local<Value> BuildManyResults (const ManyRequest *many) {
+    size_t length = many->entries.size();
+
+    if (!many->typed) {
+        Local<Array> results = New<Array>((int)length);
+        for (size_t i = 0; i < length; i++) {
+            const ocspCheck &result = many->entries[i].result;
+            Local<Object> value = New<Object>();
+            if (result.errorStr == NULL) {
+                Nan::Set(value, New("error").ToLocalChecked(), Null());
+            } else {
+                Nan::Set(value, New("error").ToLocalChecked(), New(result.errorStr).ToLocalChecked());
+            }
+            Nan::Set(value, New("response").ToLocalChecked(), BuildResult(result, many->timings));
+            Nan::Set(results, (uint32_t)i, value);
+        }
+        return results;
+    }
+
+    // Three Int32Arrays indexed like the entries, error[i] is 0 or one
+    // plus the index of the message in errors
+    Isolate *isolate = Isolate::GetCurrent();
+    Local<Int32Array> status = Int32Array::New(ArrayBuffer::New(isolate, length * sizeof(int32_t)), 0, length);
+    Local<Int32Array> reason = Int32Array::New(ArrayBuffer::New(isolate, length * sizeof(int32_t)), 0, length);
+    Local<Int32Array> error = Int32Array::New(ArrayBuffer::New(isolate, length * sizeof(int32_t)), 0, length);
+    Nan::TypedArrayContents<int32_t> statusData(status);
+    Nan::TypedArrayContents<int32_t> reasonData(reason);
+    Nan::TypedArrayContents<int32_t> errorData(error);
+    Local<Array> errors = New<Array>();
+    unordered_map<string, int32_t> errorCodes;
+    for (size_t i = 0; i < length; i++) {
+        const ocspCheck &result = many->entries[i].result;
+        (*statusData)[i] = result.status;
+        (*reasonData)[i] = result.reason;
+        (*errorData)[i] = 0;
+        if (result.errorStr != NULL) {
+            auto it = errorCodes.find(result.errorStr);
+            if (it == errorCodes.end()) {
+                Nan::Set(errors, errors->Length(), New(result.errorStr).ToLocalChecked());
+                it = errorCodes.insert(make_pair(string(result.errorStr), (int32_t)errors->Length())).first;
+            }
+            (*errorData)[i] = it->second;
+        }
+    }
+
+    Local<Object> value = New<Object>();
+    Nan::Set(value, New("status").ToLocalChecked(), status);
+    Nan::Set(value, New("reason").ToLocalChecked(), reason);
+    Nan::Set(value, New("error").ToLocalChecked(), error);
+    Nan::Set(value, New("errors").ToLocalChecked(), errors);
+    return value;
+}
+
+// BuildTrace of each entry, indexed like them
+static Local<Array> BuildManyTraces (const ManyRequest *many) {
+    Local<Array> traces = New<Array>((int)many->entries.size());
+    for (size_t i = 0; i < many->entries.size(); i++) {
+        const BatchEntry &entry = many->entries[i];
+        Nan::Set(traces, (uint32_t)i, BuildTrace(entry.result, entry.certId, entry.url));
+    }
+    return traces;
+}
+
+// Looks up entries sharing one responder, at most one request's worth
+class OCSPChunkWorker : public LookupWorker {
+ public:
+  OCSPChunkWorker(ManyRequest *many, size_t maxPerRequest, string url)
+    : LookupWorker(NULL) {
+        this->many = many;
+        this->maxPerRequest = maxPerRequest;
+        this->url = url;
+    }
+  ~OCSPChunkWorker() {}
+
+  void Add (size_t index, Local<Object> cert, Local<Value> issuer) {
+        uint32_t slot = (uint32_t)this->indices.size();
+        SaveToPersistent(2 * slot, cert);
+        if (!issuer->IsString()) {
+            SaveToPersistent(2 * slot + 1, issuer);
+        }
+        this->indices.push_back(index);
+  }
+
+  size_t Size () const {
+        return this->indices.size();
+  }
+
+  const string &Url () const {
+        return this->url;
+  }
+
+  void Reject (const char *error) {
+        for (size_t k = 0; k < this->indices.size(); k++) {
+            this->many->entries[this->indices[k]].result.errorStr = error;
+        }
+  }
+
+  // Entries are only written by the worker owning their index
+  void Run () {
+        if (this->indices.empty()) {
+            return;
+        }
+        const BatchEntry &first = this->many->entries[this->indices[0]];
+        vector<ocspRequest> requests(this->indices.size());
+        for (size_t k = 0; k < this->indices.size(); k++) {
+            const BatchEntry &entry = this->many->entries[this->indices[k]];
+            requests[k].cert_der = entry.certDer;
+            requests[k].cert_der_len = entry.certDerLen;
+            requests[k].issuer_der = entry.issuerDer;
+            requests[k].issuer_der_len = entry.issuerDerLen;
+            requests[k].issuer_handle = entry.issuerHandle;
+            requests[k].nonce = this->many->nonce;
+            requests[k].use_get = this->many->useGet;
+            requests[k].timeouts = this->many->timeouts;
+            requests[k].trace = this->many->trace ? 1 : 0;
+        }
+        verifyOCSPBatch(requests.data(), requests.size(), this->maxPerRequest,
+                        first.header.c_str(), first.url.c_str(), -1);
+        for (size_t k = 0; k < this->indices.size(); k++) {
+            this->many->entries[this->indices[k]].result = requests[k].retval;
+            this->many->entries[this->indices[k]].certId = requests[k].cert_id;
+        }
+  }
+
+  // The callback phase of entries ends once their own chunk is done
+  void HandleOKCallback () {
+    Nan::HandleScope scope;
+
+    for (size_t k = 0; k < this->indices.size(); k++) {
+        BatchEntry &entry = this->many->entries[this->indices[k]];
+        Record(&entry.result, entry.url);
+    }
+    if (--this->many->pending > 0) {
+        return;
+    }
+    Local<Value> argv[] = {
+        Null(),
+        BuildManyResults(this->many),
+        this->many->trace ? Local<Value>(BuildManyTraces(this->many)) : Local<Value>(Undefined())
+    };
+    Nan::TryCatch try_catch;
+    this->many->callback->Call(this->many->trace ? 3 : 2, argv, async_resource);
+    if (try_catch.HasCaught()) {
+        Nan::FatalException(try_catch);
+    }
+    delete this->many->callback;
+    delete this->many;
+  }
+
+  private:
+    ManyRequest *many;
+    size_t maxPerRequest;
+    string url;
+    vector<size_t> indices;
 };
 
+// What the binding needs back from an engine job
+struct EngineLookup {
+    Callback *callback;
+    AsyncResource *resource;
+    string key;
+    std::shared_ptr<std::atomic<int>> traced;
+    // Keeps DER input alive while the engine reads it
+    Global<Object> cert;
+    Global<Object> issuer;
+};
+
+static void EngineDone (engineJob *job) {
+    EngineLookup *lookup = (EngineLookup *)job->data;
+
+    if (job->status == WORKER_REJECTED) {
+        job->result.errorStr = "Lookup queue full";
+    } else if (job->status == WORKER_SHED) {
+        job->result.errorStr = "Lookup shed from queue";
+    }
+
+    // The engine timed the queue and the exchange
+    steady_clock::time_point now = steady_clock::now();
+    job->result.timings[PHASE_CALLBACK] = latency_us(job->finished, now);
+    job->result.timings[PHASE_TOTAL] = latency_us(job->submitted, now);
+    latency_record(Responder(job->url), job->result);
+    DeliverResult(lookup->key, job->result, lookup->resource, job->url);
+    delete lookup->callback;
+    delete lookup->resource;
+    delete lookup;
+    delete job;
+}
+
 NAN_METHOD(GetRevocationStatusAsync) {
     Nan::MaybeLocal<String> maybeCert = Nan::To<String>(info[0]);
     Nan::MaybeLocal<String> maybeIssuer = Nan::To<String>(info[1]);
     Nan::MaybeLocal<String> maybeHeader = Nan::To<String>(info[2]);
     Nan::MaybeLocal<String> maybeUrl = Nan::To<String>(info[3]);
-    Callback *callback = new Nan::Callback(Nan::To<Function>(info[4]).ToLocalChecked());
     if (maybeCert.IsEmpty() || maybeIssuer.IsEmpty() || maybeHeader.IsEmpty() || maybeUrl.IsEmpty()) {
         return Nan::ThrowError(Nan::New("Missing args").ToLocalChecked());
     }
-    Local<String> cert_local = maybeCert.ToLocalChecked();
-    Local<String> issuer_local = maybeIssuer.ToLocalChecked();
-    Local<String> header_local = maybeHeader.ToLocalChecked();
-    Local<String> url_local = maybeUrl.ToLocalChecked();
-    AsyncQueueWorker(new OCSPWorker(callback, *Nan::Utf8String(cert_local), *Nan::Utf8String(issuer_local), *Nan::Utf8String(header_local), *Nan::Utf8String(url_local)));
+    string cert = *Nan::Utf8String(maybeCert.ToLocalChecked());
+    string issuer = *Nan::Utf8String(maybeIssuer.ToLocalChecked());
+    string header = *Nan::Utf8String(maybeHeader.ToLocalChecked());
+    string url = *Nan::Utf8String(maybeUrl.ToLocalChecked());
+    int nonce = RequestFlag(info[5]);
+    int useGet = RequestFlag(info[6]);
+    ocspTimeouts timeouts;
+    if (!RequestTimeouts(info[7], &timeouts)) {
+        return Nan::ThrowRangeError("Timeouts must be positive");
+    }
+    int priority = RequestPriority(info[8]);
+    bool timings = Nan::To<bool>(info[9]).FromMaybe(false);
+    bool trace = Nan::To<bool>(info[10]).FromMaybe(false);
+    // Only once every argument checked out, nothing frees it on a throw
+    Callback *callback = new Nan::Callback(Nan::To<Function>(info[4]).ToLocalChecked());
+
+    // A concurrent lookup of the same CertID just waits for the first one
+    ocspRequest request;
+    string certId;
+    string key = LookupKey(&request, cert.c_str(), issuer.c_str(), issuer + '\0' + cert,
+                           header, url, nonce, useGet, timeouts, trace, &certId);
+    std::shared_ptr<std::atomic<int>> traced;
+    if (!StartLookup(key, callback, timings, trace, certId, &traced)) {
+        return;
+    }
+
+    if (engine_enabled()) {
+        EngineLookup *lookup = new EngineLookup();
+        lookup->callback = callback;
+        lookup->resource = new AsyncResource("ocsp:getRevocationStatusAsync");
+        lookup->key = key;
+        lookup->traced = traced;
+
+        engineJob *job = new engineJob();
+        job->cert = cert;
+        job->issuer = issuer;
+        job->header = header;
+        job->url = url;
+        job->responder = Responder(url);
+        job->priority = priority;
+        job->nonce = nonce;
+        job->use_get = useGet;
+        job->timeouts = timeouts;
+        job->traced = traced.get();
+        job->data = lookup;
+        engine_submit(job);
+        return;
+    }
+    QueueWorker(new OCSPWorker(callback, cert, issuer, header, url, key, nonce, useGet, timeouts, traced), url, priority);
+}
+
+NAN_METHOD(GetRevocationStatusDerAsync) {
+    if (!node::Buffer::HasInstance(info[0])
+        || !(node::Buffer::HasInstance(info[1]) || info[1]->IsString())) {
+        return Nan::ThrowTypeError("Certificates must be Buffers");
+    }
+    Local<Object> cert = info[0].As<Object>();
+    Local<Value> issuer = info[1];
+    // A registered issuer handle, or the issuer DER
+    string issuerId = issuer->IsString()
+        ? string(*Nan::Utf8String(issuer))
+        : string(node::Buffer::Data(issuer), node::Buffer::Length(issuer));
+    Nan::MaybeLocal<String> maybeHeader = Nan::To<String>(info[2]);
+    Nan::MaybeLocal<String> maybeUrl = Nan::To<String>(info[3]);
+    if (maybeHeader.IsEmpty() || maybeUrl.IsEmpty()) {
+        return Nan::ThrowError(Nan::New("Missing args").ToLocalChecked());
+    }
+    string header = *Nan::Utf8String(maybeHeader.ToLocalChecked());
+    string url = *Nan::Utf8String(maybeUrl.ToLocalChecked());
+    int nonce = RequestFlag(info[5]);
+    int useGet = RequestFlag(info[6]);
+    ocspTimeouts timeouts;
+    if (!RequestTimeouts(info[7], &timeouts)) {
+        return Nan::ThrowRangeError("Timeouts must be positive");
+    }
+    int priority = RequestPriority(info[8]);
+    bool timings = Nan::To<bool>(info[9]).FromMaybe(false);
+    bool trace = Nan::To<bool>(info[10]).FromMaybe(false);
+    Callback *callback = new Nan::Callback(Nan::To<Function>(info[4]).ToLocalChecked());
+
+    ocspRequest request;
+    request.cert_der = (const unsigned char *)node::Buffer::Data(cert);
+    request.cert_der_len = node::Buffer::Length(cert);
+    if (issuer->IsString()) {
+        request.issuer_handle = issuerId;
+    } else {
+        request.issuer_der = (const unsigned char *)node::Buffer::Data(issuer);
+        request.issuer_der_len = node::Buffer::Length(issuer);
+    }
+    string certId;
+    string key = LookupKey(&request, "", "",
+                           string("der") + '\0' + issuerId + '\0'
+                           + string(node::Buffer::Data(cert), node::Buffer::Length(cert)),
+                           header, url, nonce, useGet, timeouts, trace, &certId);
+    std::shared_ptr<std::atomic<int>> traced;
+    if (!StartLookup(key, callback, timings, trace, certId, &traced)) {
+        return;
+    }
+
+    if (engine_enabled()) {
+        EngineLookup *lookup = new EngineLookup();
+        lookup->callback = callback;
+        lookup->resource = new AsyncResource("ocsp:getRevocationStatusAsync");
+        lookup->key = key;
+        lookup->traced = traced;
+        lookup->cert.Reset(cert);
+
+        engineJob *job = new engineJob();
+        job->cert_der = (const unsigned char *)node::Buffer::Data(cert);
+        job->cert_der_len = node::Buffer::Length(cert);
+        if (issuer->IsString()) {
+            job->issuer_handle = issuerId;
+        } else {
+            lookup->issuer.Reset(issuer.As<Object>());
+            job->issuer_der = (const unsigned char *)node::Buffer::Data(issuer);
+            job->issuer_der_len = node::Buffer::Length(issuer);
+        }
+        job->header = header;
+        job->url = url;
+        job->responder = Responder(url);
+        job->priority = priority;
+        job->nonce = nonce;
+        job->use_get = useGet;
+        job->timeouts = timeouts;
+        job->traced = traced.get();
+        job->data = lookup;
+        engine_submit(job);
+        return;
+    }
+    QueueWorker(new OCSPWorker(callback, cert, issuer, header, url, key, nonce, useGet, timeouts, traced), url, priority);
+}
+
+// Takes parallel arrays of certificates, issuers, headers and urls and
+// calls back once with every result
+NAN_METHOD(GetRevocationStatusMany) {
+    if (!info[0]->IsArray() || !info[1]->IsArray() || !info[2]->IsArray() || !info[3]->IsArray()
+        || !info[6]->IsFunction()) {
+        return Nan::ThrowError(Nan::New("Missing args").ToLocalChecked());
+    }
+    Local<Array> certs = info[0].As<Array>();
+    Local<Array> issuers = info[1].As<Array>();
+    Local<Array> headers = info[2].As<Array>();
+    Local<Array> urls = info[3].As<Array>();
+    double maxPerRequest = Nan::To<double>(info[4]).FromMaybe(0);
+    uint32_t length = certs->Length();
+    if (issuers->Length() != length || headers->Length() != length || urls->Length() != length) {
+        return Nan::ThrowError(Nan::New("Missing args").ToLocalChecked());
+    }
+    if (!InRange(maxPerRequest, 1, MAX_OPTION)) {
+        return Nan::ThrowRangeError("Certificates per request must be at least 1");
+    }
+
+    ManyRequest *many = new ManyRequest();
+    many->typed = Nan::To<bool>(info[5]).FromMaybe(false);
+    many->nonce = RequestFlag(info[7]);
+    many->useGet = RequestFlag(info[8]);
+    if (!RequestTimeouts(info[9], &many->timeouts)) {
+        delete many;
+        return Nan::ThrowRangeError("Timeouts must be positive");
+    }
+    int priority = RequestPriority(info[10]);
+    many->timings = Nan::To<bool>(info[11]).FromMaybe(false);
+    many->trace = Nan::To<bool>(info[12]).FromMaybe(false);
+    many->entries.resize(length);
+    for (uint32_t i = 0; i < length; i++) {
+        BatchEntry &entry = many->entries[i];
+        Local<Value> cert = Nan::Get(certs, i).ToLocalChecked();
+        Local<Value> issuer = Nan::Get(issuers, i).ToLocalChecked();
+        Nan::MaybeLocal<String> maybeHeader = Nan::To<String>(Nan::Get(headers, i).ToLocalChecked());
+        Nan::MaybeLocal<String> maybeUrl = Nan::To<String>(Nan::Get(urls, i).ToLocalChecked());
+        if (!node::Buffer::HasInstance(cert)
+            || !(node::Buffer::HasInstance(issuer) || issuer->IsString())) {
+            delete many;
+            return Nan::ThrowTypeError("Certificates must be Buffers");
+        }
+        if (maybeHeader.IsEmpty() || maybeUrl.IsEmpty()) {
+            delete many;
+            return Nan::ThrowError(Nan::New("Missing args").ToLocalChecked());
+        }
+        entry.certDer = (const unsigned char *)node::Buffer::Data(cert);
+        entry.certDerLen = node::Buffer::Length(cert);
+        if (issuer->IsString()) {
+            entry.issuerHandle = *Nan::Utf8String(issuer);
+        } else {
+            entry.issuerDer = (const unsigned char *)node::Buffer::Data(issuer);
+            entry.issuerDerLen = node::Buffer::Length(issuer);
+        }
+        entry.header = *Nan::Utf8String(maybeHeader.ToLocalChecked());
+        entry.url = *Nan::Utf8String(maybeUrl.ToLocalChecked());
+    }
+
+    // One worker per request's worth of entries sharing a responder, so
+    // distinct responders are queried in parallel
+    vector<OCSPChunkWorker*> workers;
+    unordered_map<string, OCSPChunkWorker*> filling;
+    for (uint32_t i = 0; i < length; i++) {
+        const BatchEntry &entry = many->entries[i];
+        string key = entry.url + '\0' + entry.header;
+        OCSPChunkWorker *&worker = filling[key];
+        if (worker == NULL) {
+            worker = new OCSPChunkWorker(many, (size_t)maxPerRequest, entry.url);
+            workers.push_back(worker);
+        }
+        worker->Add(i, Nan::Get(certs, i).ToLocalChecked().As<Object>(), Nan::Get(issuers, i).ToLocalChecked());
+        if (worker->Size() >= (size_t)maxPerRequest) {
+            worker = NULL;
+        }
+    }
+    // An empty call still calls back asynchronously
+    if (workers.empty()) {
+        workers.push_back(new OCSPChunkWorker(many, (size_t)maxPerRequest, string()));
+    }
+
+    many->callback = new Nan::Callback(info[6].As<Function>());
+    many->pending = workers.size();
+    for (size_t w = 0; w < workers.size(); w++) {
+        QueueWorker(workers[w], workers[w]->Url(), priority);
+    }
+}
+
+static bool StapleArgs (const Nan::FunctionCallbackInfo<Value> &info) {
+    return node::Buffer::HasInstance(info[0]) && node::Buffer::HasInstance(info[1])
+        && (node::Buffer::HasInstance(info[2]) || info[2]->IsString());
+}
+
+// Verifies a stapled response on the calling thread, throws on failure
+NAN_METHOD(VerifyStapledResponse) {
+    if (!StapleArgs(info)) {
+        return Nan::ThrowTypeError("Response and certificates must be Buffers");
+    }
+    ocspRequest request;
+    request.cert_der = (const unsigned char *)node::Buffer::Data(info[1]);
+    request.cert_der_len = node::Buffer::Length(info[1]);
+    if (info[2]->IsString()) {
+        request.issuer_handle = *Nan::Utf8String(info[2]);
+    } else {
+        request.issuer_der = (const unsigned char *)node::Buffer::Data(info[2]);
+        request.issuer_der_len = node::Buffer::Length(info[2]);
+    }
+    ocspCheck result = verifyStapledOCSP(&request, (const unsigned char *)node::Buffer::Data(info[0]),
+                                         node::Buffer::Length(info[0]));
+    if (result.errorStr != NULL) {
+        return Nan::ThrowError(Nan::New(result.errorStr).ToLocalChecked());
+    }
+    info.GetReturnValue().Set(BuildResult(result));
+}
+
+NAN_METHOD(VerifyStapledResponseAsync) {
+    if (!StapleArgs(info) || !info[3]->IsFunction()) {
+        return Nan::ThrowTypeError("Response and certificates must be Buffers");
+    }
+    Callback *callback = new Nan::Callback(info[3].As<Function>());
+    QueueWorker(new OCSPStapleWorker(callback, info[0].As<Object>(), info[1].As<Object>(), info[2]), string(), WORKER_HIGH);
+}
+
+// Answers from the response cache on the calling thread, returns
+// undefined on a miss without contacting the responder
+NAN_METHOD(PeekRevocationStatus) {
+    if (!node::Buffer::HasInstance(info[0])
+        || !(node::Buffer::HasInstance(info[1]) || info[1]->IsString())) {
+        return Nan::ThrowTypeError("Certificates must be Buffers");
+    }
+    ocspRequest request;
+    request.key_only = 1;
+    request.cert_der = (const unsigned char *)node::Buffer::Data(info[0]);
+    request.cert_der_len = node::Buffer::Length(info[0]);
+    if (info[1]->IsString()) {
+        request.issuer_handle = *Nan::Utf8String(info[1]);
+    } else {
+        request.issuer_der = (const unsigned char *)node::Buffer::Data(info[1]);
+        request.issuer_der_len = node::Buffer::Length(info[1]);
+    }
+    int parsed = prepareOCSP(&request, "", "", "", NULL, -1);
+    freeOCSP(&request);
+    if (!parsed) {
+        const char *error = request.retval.errorStr;
+        return Nan::ThrowError(Nan::New(error == NULL ? "Error Creating OCSP request" : error).ToLocalChecked());
+    }
+
+    ocspCheck result;
+    if (!cache_peek(request.cache_key, request.nsec, &result)) {
+        return;
+    }
+    info.GetReturnValue().Set(BuildResult(result));
+}
+
+NAN_METHOD(RegisterIssuer) {
+    string handle;
+    const char *error;
+    if (node::Buffer::HasInstance(info[0])) {
+        error = register_issuer((const unsigned char *)node::Buffer::Data(info[0]),
+                                node::Buffer::Length(info[0]), 0, &handle);
+    } else if (info[0]->IsString()) {
+        string pem = *Nan::Utf8String(info[0]);
+        error = register_issuer((const unsigned char *)pem.data(), pem.size(), 1, &handle);
+    } else {
+        return Nan::ThrowTypeError("Issuer must be a DER Buffer or a PEM string");
+    }
+    if (error != NULL) {
+        return Nan::ThrowError(Nan::New(error).ToLocalChecked());
+    }
+    info.GetReturnValue().Set(Nan::New(handle).ToLocalChecked());
+}
+
+NAN_METHOD(UnregisterIssuer) {
+    Nan::MaybeLocal<String> maybeHandle = Nan::To<String>(info[0]);
+    if (maybeHandle.IsEmpty()) {
+        return Nan::ThrowError(Nan::New("Missing args").ToLocalChecked());
+    }
+    string handle = *Nan::Utf8String(maybeHandle.ToLocalChecked());
+    info.GetReturnValue().Set(Nan::New<Boolean>(unregister_issuer(handle) == 1));
+}
+
+NAN_METHOD(ConfigureTrustStore) {
+    string CAfile, CApath, CApem;
+    double reload_interval = 60;
+    if (info[0]->IsString()) {
+        CAfile = *Nan::Utf8String(info[0]);
+    }
+    if (info[1]->IsString()) {
+        CApath = *Nan::Utf8String(info[1]);
+    }
+    if (info[2]->IsString()) {
+        CApem = *Nan::Utf8String(info[2]);
+    }
+    if (info[3]->IsNumber()) {
+        reload_interval = Nan::To<double>(info[3]).FromJust();
+    }
+    if (!InRange(reload_interval, 0, MAX_OPTION)) {
+        return Nan::ThrowRangeError("Trust store reload interval must be positive");
+    }
+    const char *error = configure_store(info[0]->IsString() ? CAfile.c_str() : NULL,
+                                        info[1]->IsString() ? CApath.c_str() : NULL,
+                                        info[2]->IsString() ? CApem.c_str() : NULL,
+                                        (long)reload_interval);
+    if (error != NULL) {
+        return Nan::ThrowError(Nan::New(error).ToLocalChecked());
+    }
+}
+
+NAN_METHOD(ConfigureCache) {
+    double max_entries = Nan::To<double>(info[0]).FromMaybe(0);
+    double margin = Nan::To<double>(info[1]).FromMaybe(0);
+    if (!InRange(max_entries, 0, MAX_OPTION) || !InRange(margin, 0, MAX_OPTION)) {
+        return Nan::ThrowRangeError("Cache size and margin must be positive");
+    }
+    configure_cache((size_t)max_entries, (long)margin);
+}
+
+NAN_METHOD(GetCacheStats) {
+    cacheStats stats = get_cache_stats();
+    Local<Object> value = New<Object>();
+    Nan::Set(value, New("hits").ToLocalChecked(), New<Number>((double)stats.hits));
+    Nan::Set(value, New("misses").ToLocalChecked(), New<Number>((double)stats.misses));
+    Nan::Set(value, New("evictions").ToLocalChecked(), New<Number>((double)stats.evictions));
+    Nan::Set(value, New("stale").ToLocalChecked(), New<Number>((double)stats.stale));
+    Nan::Set(value, New("peeks").ToLocalChecked(), New<Number>((double)stats.peeks));
+    Nan::Set(value, New("peekMisses").ToLocalChecked(), New<Number>((double)stats.peek_misses));
+    Nan::Set(value, New("size").ToLocalChecked(), New<Number>((double)stats.size));
+    info.GetReturnValue().Set(value);
+}
+
+NAN_METHOD(GetSignerStats) {
+    signerStats stats = get_signer_stats();
+    Local<Object> value = New<Object>();
+    Nan::Set(value, New("fast").ToLocalChecked(), New<Number>((double)stats.fast));
+    Nan::Set(value, New("full").ToLocalChecked(), New<Number>((double)stats.full));
+    Nan::Set(value, New("size").ToLocalChecked(), New<Number>((double)stats.size));
+    info.GetReturnValue().Set(value);
+}
+
+NAN_METHOD(ConfigureSharedCache) {
+    string name;
+    if (info[0]->IsString()) {
+        name = *Nan::Utf8String(info[0]);
+    }
+    double slots = Nan::To<double>(info[1]).FromMaybe(0);
+    if (!InRange(slots, 1, MAX_OPTION)) {
+        return Nan::ThrowRangeError("Shared cache needs at least one slot");
+    }
+    const char *error = configure_shm_cache(name.c_str(), (size_t)slots);
+    if (error != NULL) {
+        return Nan::ThrowError(Nan::New(error).ToLocalChecked());
+    }
+}
+
+NAN_METHOD(GetSharedCacheStats) {
+    shmStats stats = get_shm_cache_stats();
+    Local<Object> value = New<Object>();
+    Nan::Set(value, New("hits").ToLocalChecked(), New<Number>((double)stats.hits));
+    Nan::Set(value, New("misses").ToLocalChecked(), New<Number>((double)stats.misses));
+    Nan::Set(value, New("writes").ToLocalChecked(), New<Number>((double)stats.writes));
+    Nan::Set(value, New("evictions").ToLocalChecked(), New<Number>((double)stats.evictions));
+    Nan::Set(value, New("recovered").ToLocalChecked(), New<Number>((double)stats.recovered));
+    Nan::Set(value, New("slots").ToLocalChecked(), New<Number>((double)stats.slots));
+    info.GetReturnValue().Set(value);
+}
+
+NAN_METHOD(ConfigurePool) {
+    double max_per_host = Nan::To<double>(info[0]).FromMaybe(0);
+    double idle_timeout = Nan::To<double>(info[1]).FromMaybe(0);
+    if (!InRange(max_per_host, 0, MAX_OPTION) || !InRange(idle_timeout, 0, MAX_OPTION)) {
+        return Nan::ThrowRangeError("Pool size and idle timeout must be positive");
+    }
+    configure_pool((int)max_per_host, (long)idle_timeout);
+}
+
+NAN_METHOD(GetPoolStats) {
+    poolStats stats = get_pool_stats();
+    Local<Object> value = New<Object>();
+    Nan::Set(value, New("created").ToLocalChecked(), New<Number>((double)stats.created));
+    Nan::Set(value, New("reused").ToLocalChecked(), New<Number>((double)stats.reused));
+    Nan::Set(value, New("expired").ToLocalChecked(), New<Number>((double)stats.expired));
+    Nan::Set(value, New("unhealthy").ToLocalChecked(), New<Number>((double)stats.unhealthy));
+    Nan::Set(value, New("closed").ToLocalChecked(), New<Number>((double)stats.closed));
+    Nan::Set(value, New("waited").ToLocalChecked(), New<Number>((double)stats.waited));
+    Nan::Set(value, New("exhausted").ToLocalChecked(), New<Number>((double)stats.exhausted));
+    Nan::Set(value, New("idle").ToLocalChecked(), New<Number>((double)stats.idle));
+    Nan::Set(value, New("active").ToLocalChecked(), New<Number>((double)stats.active));
+    info.GetReturnValue().Set(value);
+}
+
+NAN_METHOD(ConfigureWorkers) {
+    double threads = Nan::To<double>(info[0]).FromMaybe(0);
+    double maxPerHost = Nan::To<double>(info[1]).FromMaybe(0);
+    double maxQueued = Nan::To<double>(info[2]).FromMaybe(0);
+    if (!(threads >= 0) || !InRange(maxPerHost, 0, MAX_OPTION) || !InRange(maxQueued, 0, MAX_OPTION)) {
+        return Nan::ThrowRangeError("Worker threads and limits must be positive");
+    }
+    if (!(threads <= MAX_THREADS)) {
+        return Nan::ThrowRangeError("Worker threads must be at most 1024");
+    }
+    configure_workers(Nan::GetCurrentEventLoop(), (size_t)threads, (size_t)maxPerHost,
+                      (size_t)maxQueued, Nan::To<bool>(info[3]).FromMaybe(false) ? 1 : 0);
+}
+
+NAN_METHOD(GetWorkerStats) {
+    workerStats stats = get_worker_stats();
+    // Lookups the engine took count alongside those run on threads
+    workerStats engine = get_engine_stats();
+    stats.active += engine.active;
+    stats.queued += engine.queued;
+    stats.throttled += engine.throttled;
+    stats.completed += engine.completed;
+    stats.rejected += engine.rejected;
+    stats.shed += engine.shed;
+    Local<Object> value = New<Object>();
+    Nan::Set(value, New("threads").ToLocalChecked(), New<Number>((double)stats.threads));
+    Nan::Set(value, New("active").ToLocalChecked(), New<Number>((double)stats.active));
+    Nan::Set(value, New("queued").ToLocalChecked(), New<Number>((double)stats.queued));
+    Nan::Set(value, New("throttled").ToLocalChecked(), New<Number>((double)stats.throttled));
+    Nan::Set(value, New("completed").ToLocalChecked(), New<Number>((double)stats.completed));
+    Nan::Set(value, New("rejected").ToLocalChecked(), New<Number>((double)stats.rejected));
+    Nan::Set(value, New("shed").ToLocalChecked(), New<Number>((double)stats.shed));
+    info.GetReturnValue().Set(value);
+}
+
+NAN_METHOD(ConfigureRefresh) {
+    double concurrency = Nan::To<double>(info[0]).FromMaybe(0);
+    double fraction = Nan::To<double>(info[1]).FromMaybe(0);
+    double jitter = Nan::To<double>(info[2]).FromMaybe(0);
+    double idle = Nan::To<double>(info[3]).FromMaybe(0);
+    if (!InRange(concurrency, 0, MAX_OPTION) || !InRange(idle, 0, MAX_OPTION)) {
+        return Nan::ThrowRangeError("Refresh concurrency and idle time must be positive");
+    }
+    if (!(fraction > 0) || !(jitter >= 0) || !(fraction + jitter < 1)) {
+        return Nan::ThrowRangeError("Refresh fraction and jitter must leave part of the validity window");
+    }
+    configure_refresh((size_t)concurrency, fraction, jitter, (long)idle);
+}
+
+NAN_METHOD(GetRefreshStats) {
+    refreshStats stats = get_refresh_stats();
+    Local<Object> value = New<Object>();
+    Nan::Set(value, New("refreshed").ToLocalChecked(), New<Number>((double)stats.refreshed));
+    Nan::Set(value, New("failed").ToLocalChecked(), New<Number>((double)stats.failed));
+    Nan::Set(value, New("expired").ToLocalChecked(), New<Number>((double)stats.expired));
+    Nan::Set(value, New("tracked").ToLocalChecked(), New<Number>((double)stats.tracked));
+    Nan::Set(value, New("active").ToLocalChecked(), New<Number>((double)stats.active));
+    info.GetReturnValue().Set(value);
+}
+
+NAN_METHOD(ConfigureSnapshot) {
+    string path;
+    if (info[0]->IsString()) {
+        path = *Nan::Utf8String(info[0]);
+    }
+    double interval = Nan::To<double>(info[1]).FromMaybe(0);
+    if (!InRange(interval, 0, MAX_OPTION)) {
+        return Nan::ThrowRangeError("Snapshot interval must be positive");
+    }
+    const char *error = configure_snapshot(path.c_str(), (long)interval);
+    if (error != NULL) {
+        return Nan::ThrowError(Nan::New(error).ToLocalChecked());
+    }
+}
+
+NAN_METHOD(WriteSnapshot) {
+    const char *error = write_snapshot();
+    if (error != NULL) {
+        return Nan::ThrowError(Nan::New(error).ToLocalChecked());
+    }
+}
+
+NAN_METHOD(GetSnapshotStats) {
+    snapshotStats stats = get_snapshot_stats();
+    Local<Object> value = New<Object>();
+    Nan::Set(value, New("loaded").ToLocalChecked(), New<Number>((double)stats.loaded));
+    Nan::Set(value, New("served").ToLocalChecked(), New<Number>((double)stats.served));
+    Nan::Set(value, New("rejected").ToLocalChecked(), New<Number>((double)stats.rejected));
+    Nan::Set(value, New("written").ToLocalChecked(), New<Number>((double)stats.written));
+    Nan::Set(value, New("pending").ToLocalChecked(), New<Number>((double)stats.pending));
+    info.GetReturnValue().Set(value);
+}
+
+NAN_METHOD(ConfigureBreaker) {
+    double failures = Nan::To<double>(info[0]).FromMaybe(0);
+    double errorRate = Nan::To<double>(info[1]).FromMaybe(0);
+    double cooldown = Nan::To<double>(info[2]).FromMaybe(0);
+    double probes = Nan::To<double>(info[3]).FromMaybe(0);
+    if (!InRange(failures, 0, MAX_OPTION) || !InRange(cooldown, 0, MAX_OPTION)
+        || !InRange(probes, 1, MAX_OPTION)) {
+        return Nan::ThrowRangeError("Breaker failures, cooldown and probes must be positive");
+    }
+    if (!(errorRate > 0 && errorRate <= 1)) {
+        return Nan::ThrowRangeError("Breaker error rate must be between 0 and 1");
+    }
+    configure_breaker((uint32_t)failures, errorRate, (long)cooldown, (uint32_t)probes,
+                      Nan::To<bool>(info[4]).FromMaybe(true) ? 1 : 0);
+}
+
+NAN_METHOD(GetBreakerStates) {
+    static const char *names[] = {"closed", "open", "half-open"};
+    vector<breakerState> states = get_breaker_states();
+    Local<Array> value = New<Array>((int)states.size());
+    for (size_t i = 0; i < states.size(); i++) {
+        const breakerState &state = states[i];
+        Local<Object> entry = New<Object>();
+        Nan::Set(entry, New("responder").ToLocalChecked(), New(state.responder).ToLocalChecked());
+        Nan::Set(entry, New("state").ToLocalChecked(), New(names[state.state]).ToLocalChecked());
+        Nan::Set(entry, New("consecutiveFailures").ToLocalChecked(), New<Number>((double)state.consecutive_failures));
+        Nan::Set(entry, New("errorRate").ToLocalChecked(), New<Number>(state.error_rate));
+        Nan::Set(entry, New("latency").ToLocalChecked(), New<Number>(state.latency));
+        Nan::Set(entry, New("requests").ToLocalChecked(), New<Number>((double)state.requests));
+        Nan::Set(entry, New("failures").ToLocalChecked(), New<Number>((double)state.failures));
+        Nan::Set(entry, New("rejected").ToLocalChecked(), New<Number>((double)state.rejected));
+        Nan::Set(entry, New("transitions").ToLocalChecked(), New<Number>((double)state.transitions));
+        Nan::Set(entry, New("since").ToLocalChecked(), New<Number>((double)state.since));
+        Nan::Set(value, (uint32_t)i, entry);
+    }
+    info.GetReturnValue().Set(value);
+}
+
+NAN_METHOD(ConfigureEngine) {
+    double threads = Nan::To<double>(info[0]).FromMaybe(0);
+    if (!(threads >= 0)) {
+        return Nan::ThrowRangeError("Engine threads must be positive");
+    }
+    if (!(threads <= MAX_THREADS)) {
+        return Nan::ThrowRangeError("Engine threads must be at most 1024");
+    }
+    double maxInFlight = Nan::To<double>(info[1]).FromMaybe(0);
+    if (!InRange(maxInFlight, 0, MAX_OPTION)) {
+        return Nan::ThrowRangeError("Engine in-flight limit must be positive");
+    }
+    const char *error = engine_start(Nan::GetCurrentEventLoop(), (int)threads,
+                                     (size_t)maxInFlight, EngineDone);
+    if (error != NULL) {
+        return Nan::ThrowError(Nan::New(error).ToLocalChecked());
+    }
+}
+
+NAN_METHOD(ConfigureRequests) {
+    // 5 seconds in all unless set, phases are only bounded by that
+    ocspTimeouts timeouts;
+    timeouts.total = 5000;
+    timeouts.dns = timeouts.connect = timeouts.tls = timeouts.read = 0;
+    if (!RequestTimeouts(info[2], &timeouts)) {
+        return Nan::ThrowRangeError("Timeouts must be positive");
+    }
+    configure_requests(Nan::To<bool>(info[0]).FromMaybe(true) ? 1 : 0,
+                       Nan::To<bool>(info[1]).FromMaybe(false) ? 1 : 0, timeouts);
+}
+
+NAN_METHOD(GetLatencyStats) {
+    vector<responderLatency> latencies = get_latency(Nan::To<bool>(info[0]).FromMaybe(false) ? 1 : 0);
+    Local<Object> value = New<Object>();
+    for (size_t i = 0; i < latencies.size(); i++) {
+        Local<Object> phases = New<Object>();
+        for (int phase = 0; phase < PHASE_COUNT; phase++) {
+            const latencySummary &summary = latencies[i].phases[phase];
+            if (summary.count == 0) {
+                continue;
+            }
+            Local<Object> entry = New<Object>();
+            Nan::Set(entry, New("count").ToLocalChecked(), New<Number>((double)summary.count));
+            Nan::Set(entry, New("mean").ToLocalChecked(), New<Number>(summary.mean));
+            Nan::Set(entry, New("max").ToLocalChecked(), New<Number>((double)summary.max));
+            Nan::Set(entry, New("p50").ToLocalChecked(), New<Number>((double)summary.p50));
+            Nan::Set(entry, New("p90").ToLocalChecked(), New<Number>((double)summary.p90));
+            Nan::Set(entry, New("p99").ToLocalChecked(), New<Number>((double)summary.p99));
+            Nan::Set(entry, New("p999").ToLocalChecked(), New<Number>((double)summary.p999));
+            Nan::Set(phases, New(phase_name(phase)).ToLocalChecked(), entry);
+        }
+        Nan::Set(value, New(latencies[i].responder).ToLocalChecked(), phases);
+    }
+    info.GetReturnValue().Set(value);
 }
 
 NAN_MODULE_INIT(Init) {
+  // Load the default CA file and directory once, lookups share the result
+  configure_store(NULL, NULL, NULL, 60);
+  // Blocking lookups stay off the libuv threadpool fs, dns and zlib use
+  configure_workers(Nan::GetCurrentEventLoop(), 4, 0, 0, 0);
+
   Nan::Set(target, Nan::New("getRevocationStatusAsync").ToLocalChecked(),
       Nan::GetFunction(Nan::New<FunctionTemplate>(GetRevocationStatusAsync)).ToLocalChecked());
+  Nan::Set(target, Nan::New("getRevocationStatusDerAsync").ToLocalChecked(),
+      Nan::GetFunction(Nan::New<FunctionTemplate>(GetRevocationStatusDerAsync)).ToLocalChecked());
+  Nan::Set(target, Nan::New("getRevocationStatusMany").ToLocalChecked(),
+      Nan::GetFunction(Nan::New<FunctionTemplate>(GetRevocationStatusMany)).ToLocalChecked());
+  Nan::Set(target, Nan::New("verifyStapledResponse").ToLocalChecked(),
+      Nan::GetFunction(Nan::New<FunctionTemplate>(VerifyStapledResponse)).ToLocalChecked());
+  Nan::Set(target, Nan::New("verifyStapledResponseAsync").ToLocalChecked(),
+      Nan::GetFunction(Nan::New<FunctionTemplate>(VerifyStapledResponseAsync)).ToLocalChecked());
+  Nan::Set(target, Nan::New("peekRevocationStatus").ToLocalChecked(),
+      Nan::GetFunction(Nan::New<FunctionTemplate>(PeekRevocationStatus)).ToLocalChecked());
+  Nan::Set(target, Nan::New("registerIssuer").ToLocalChecked(),
+      Nan::GetFunction(Nan::New<FunctionTemplate>(RegisterIssuer)).ToLocalChecked());
+  Nan::Set(target, Nan::New("unregisterIssuer").ToLocalChecked(),
+      Nan::GetFunction(Nan::New<FunctionTemplate>(UnregisterIssuer)).ToLocalChecked());
+  Nan::Set(target, Nan::New("configureTrustStore").ToLocalChecked(),
+      Nan::GetFunction(Nan::New<FunctionTemplate>(ConfigureTrustStore)).ToLocalChecked());
+  Nan::Set(target, Nan::New("configureCache").ToLocalChecked(),
+      Nan::GetFunction(Nan::New<FunctionTemplate>(ConfigureCache)).ToLocalChecked());
+  Nan::Set(target, Nan::New("getCacheStats").ToLocalChecked(),
+      Nan::GetFunction(Nan::New<FunctionTemplate>(GetCacheStats)).ToLocalChecked());
+  Nan::Set(target, Nan::New("getSignerStats").ToLocalChecked(),
+      Nan::GetFunction(Nan::New<FunctionTemplate>(GetSignerStats)).ToLocalChecked());
+  Nan::Set(target, Nan::New("configureSharedCache").ToLocalChecked(),
+      Nan::GetFunction(Nan::New<FunctionTemplate>(ConfigureSharedCache)).ToLocalChecked());
+  Nan::Set(target, Nan::New("getSharedCacheStats").ToLocalChecked(),
+      Nan::GetFunction(Nan::New<FunctionTemplate>(GetSharedCacheStats)).ToLocalChecked());
+  Nan::Set(target, Nan::New("configurePool").ToLocalChecked(),
+      Nan::GetFunction(Nan::New<FunctionTemplate>(ConfigurePool)).ToLocalChecked());
+  Nan::Set(target, Nan::New("getPoolStats").ToLocalChecked(),
+      Nan::GetFunction(Nan::New<FunctionTemplate>(GetPoolStats)).ToLocalChecked());
+  Nan::Set(target, Nan::New("configureWorkers").ToLocalChecked(),
+      Nan::GetFunction(Nan::New<FunctionTemplate>(ConfigureWorkers)).ToLocalChecked());
+  Nan::Set(target, Nan::New("getWorkerStats").ToLocalChecked(),
+      Nan::GetFunction(Nan::New<FunctionTemplate>(GetWorkerStats)).ToLocalChecked());
+  Nan::Set(target, Nan::New("configureRefresh").ToLocalChecked(),
+      Nan::GetFunction(Nan::New<FunctionTemplate>(ConfigureRefresh)).ToLocalChecked());
+  Nan::Set(target, Nan::New("getRefreshStats").ToLocalChecked(),
+      Nan::GetFunction(Nan::New<FunctionTemplate>(GetRefreshStats)).ToLocalChecked());
+  Nan::Set(target, Nan::New("configureSnapshot").ToLocalChecked(),
+      Nan::GetFunction(Nan::New<FunctionTemplate>(ConfigureSnapshot)).ToLocalChecked());
+  Nan::Set(target, Nan::New("writeSnapshot").ToLocalChecked(),
+      Nan::GetFunction(Nan::New<FunctionTemplate>(WriteSnapshot)).ToLocalChecked());
+  Nan::Set(target, Nan::New("getSnapshotStats").ToLocalChecked(),
+      Nan::GetFunction(Nan::New<FunctionTemplate>(GetSnapshotStats)).ToLocalChecked());
+  Nan::Set(target, Nan::New("configureBreaker").ToLocalChecked(),
+      Nan::GetFunction(Nan::New<FunctionTemplate>(ConfigureBreaker)).ToLocalChecked());
+  Nan::Set(target, Nan::New("getBreakerStates").ToLocalChecked(),
+      Nan::GetFunction(Nan::New<FunctionTemplate>(GetBreakerStates)).ToLocalChecked());
+  Nan::Set(target, Nan::New("configureEngine").ToLocalChecked(),
+      Nan::GetFunction(Nan::New<FunctionTemplate>(ConfigureEngine)).ToLocalChecked());
+  Nan::Set(target, Nan::New("configureRequests").ToLocalChecked(),
+      Nan::GetFunction(Nan::New<FunctionTemplate>(ConfigureRequests)).ToLocalChecked());
+  Nan::Set(target, Nan::New("getLatencyStats").ToLocalChecked(),
+      Nan::GetFunction(Nan::New<FunctionTemplate>(GetLatencyStats)).ToLocalChecked());
 }
 
 NODE_MODULE(ocsp, Init);
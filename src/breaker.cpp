@@ -0,0 +1,140 @@
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "breaker.h"
+
+using std::chrono::steady_clock;
+using std::chrono::system_clock;
+
+// Weight of the latest exchange in the moving averages
+#define BREAKER_ALPHA 0.2
+// Exchanges seen before the error rate alone may open a circuit
+#define BREAKER_MIN_REQUESTS 10
+
+struct responderHealth {
+    breakerState state;
+    steady_clock::time_point opened;
+    uint32_t probing = 0;
+};
+
+static std::mutex breaker_lock;
+static std::unordered_map<std::string, responderHealth> breakers;
+static uint32_t breaker_failures = 5;
+static double breaker_error_rate = 0.5;
+static long breaker_cooldown = 30000;
+static uint32_t breaker_probes = 1;
+static int breaker_stale = 1;
+
+static std::string responder_key(const char *host, const char *port, int use_ssl)
+{
+    std::string key(host);
+
+    key += ':';
+    if (port != NULL)
+        key += port;
+    key += use_ssl == 1 ? ":tls" : ":tcp";
+    return key;
+}
+
+// Caller holds breaker_lock
+static void transition(responderHealth *h, int state)
+{
+    h->state.state = state;
+    h->state.transitions++;
+    h->state.since = std::chrono::duration_cast<std::chrono::milliseconds>(
+        system_clock::now().time_since_epoch()).count();
+    if (state == BREAKER_OPEN)
+        h->opened = steady_clock::now();
+    if (state != BREAKER_HALF_OPEN)
+        h->probing = 0;
+}
+
+void configure_breaker(uint32_t failures, double error_rate, long cooldown, uint32_t probes,
+                       int serve_stale)
+{
+    std::lock_guard<std::mutex> guard(breaker_lock);
+    breaker_failures = failures;
+    breaker_error_rate = error_rate;
+    breaker_cooldown = cooldown;
+    breaker_probes = probes;
+    breaker_stale = serve_stale;
+    if (failures == 0)
+        breakers.clear();
+}
+
+int breaker_serves_stale()
+{
+    std::lock_guard<std::mutex> guard(breaker_lock);
+    return breaker_stale;
+}
+
+int breaker_allow(const char *host, const char *port, int use_ssl)
+{
+    std::lock_guard<std::mutex> guard(breaker_lock);
+
+    if (breaker_failures == 0)
+        return 1;
+    responderHealth &h = breakers[responder_key(host, port, use_ssl)];
+    if (h.state.responder.empty())
+        h.state.responder = responder_key(host, port, use_ssl);
+
+    if (h.state.state == BREAKER_OPEN
+        && steady_clock::now() - h.opened >= std::chrono::milliseconds(breaker_cooldown))
+        transition(&h, BREAKER_HALF_OPEN);
+    if (h.state.state == BREAKER_CLOSED)
+        return 1;
+    if (h.state.state == BREAKER_HALF_OPEN && h.probing < breaker_probes) {
+        h.probing++;
+        return 1;
+    }
+    h.state.rejected++;
+    return 0;
+}
+
+void breaker_report(const char *host, const char *port, int use_ssl, int ok, double latency)
+{
+    std::lock_guard<std::mutex> guard(breaker_lock);
+
+    if (breaker_failures == 0)
+        return;
+    auto it = breakers.find(responder_key(host, port, use_ssl));
+    if (it == breakers.end())
+        return;
+    responderHealth &h = it->second;
+
+    h.state.requests++;
+    h.state.latency += BREAKER_ALPHA * (latency - h.state.latency);
+    h.state.error_rate += BREAKER_ALPHA * ((ok ? 0.0 : 1.0) - h.state.error_rate);
+    if (ok) {
+        h.state.consecutive_failures = 0;
+        if (h.state.state == BREAKER_HALF_OPEN) {
+            h.state.error_rate = 0;
+            transition(&h, BREAKER_CLOSED);
+        }
+        return;
+    }
+
+    h.state.failures++;
+    h.state.consecutive_failures++;
+    if (h.state.state == BREAKER_HALF_OPEN) {
+        transition(&h, BREAKER_OPEN);
+    } else if (h.state.state == BREAKER_CLOSED
+               && (h.state.consecutive_failures >= breaker_failures
+                   || (h.state.requests >= BREAKER_MIN_REQUESTS
+                       && h.state.error_rate >= breaker_error_rate))) {
+        transition(&h, BREAKER_OPEN);
+    }
+}
+
+std::vector<breakerState> get_breaker_states()
+{
+    std::lock_guard<std::mutex> guard(breaker_lock);
+    std::vector<breakerState> states;
+
+    for (auto it = breakers.begin(); it != breakers.end(); ++it)
+        states.push_back(it->second.state);
+    return states;
+}
@@ -0,0 +1,51 @@
+#ifndef OCSP_BREAKER_H
+#define OCSP_BREAKER_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#define BREAKER_CLOSED 0
+#define BREAKER_OPEN 1
+#define BREAKER_HALF_OPEN 2
+
+struct breakerState {
+    // host:port:tls
+    std::string responder;
+    int state = BREAKER_CLOSED;
+    uint32_t consecutive_failures = 0;
+    // moving averages over recent exchanges
+    double error_rate = 0;
+    double latency = 0;
+    uint64_t requests = 0;
+    uint64_t failures = 0;
+    // lookups failed fast or served stale while open
+    uint64_t rejected = 0;
+    uint64_t transitions = 0;
+    // milliseconds since the epoch of the last transition
+    int64_t since = 0;
+};
+
+// Opens a responder's circuit after `failures` consecutive failed exchanges
+// (0 disables the breaker) or once the moving error rate reaches
+// error_rate. Open circuits fail lookups fast, or serve cached responses
+// still before their nextUpdate when serve_stale is set, for cooldown
+// milliseconds, then let `probes` exchanges through at once until one
+// succeeds and closes the circuit again or one fails and reopens it.
+void configure_breaker(uint32_t failures, double error_rate, long cooldown, uint32_t probes,
+                       int serve_stale);
+
+int breaker_serves_stale();
+
+// Returns 1 when an exchange with the responder may start, in which case
+// breaker_report must follow once it is over.
+int breaker_allow(const char *host, const char *port, int use_ssl);
+
+// Records how the exchange allowed by breaker_allow went, latency in
+// milliseconds.
+void breaker_report(const char *host, const char *port, int use_ssl, int ok, double latency);
+
+std::vector<breakerState> get_breaker_states();
+
+#endif
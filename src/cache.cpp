@@ -0,0 +1,368 @@
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <functional>
+#include <list>
+#include <mutex>
+#include <unordered_map>
+
+#include <openssl/err.h>
+
+#include "cache.h"
+#include "shmcache.h"
+
+struct cacheEntry {
+    std::string key;
+    std::string der;
+    int status;
+    int reason;
+    time_t thisupd;
+    time_t nextupd;
+    // 0 unless revoked
+    time_t revoked = 0;
+    time_t last_read;
+};
+
+// Most recently used entries are at the front of cache_lru
+static std::mutex cache_lock;
+static std::list<cacheEntry> cache_lru;
+static std::unordered_map<std::string, std::list<cacheEntry>::iterator> cache_index;
+static size_t cache_max_entries = 10000;
+static long cache_margin = 60;
+static cacheStats cache_stats;
+
+// Copies of the entries in the cache, at most one per slot, read without
+// locking by cache_peek. Each slot is a seqlock as in shmcache.cpp, with
+// writers serialised by cache_lock.
+#define PEEK_SLOTS 4096
+#define PEEK_KEY_MAX 128
+
+struct peekSlot {
+    std::atomic<uint32_t> seq;
+    // served by cache_peek, for cache_times
+    std::atomic<time_t> last_read;
+    size_t key_len;
+    char key[PEEK_KEY_MAX];
+    time_t thisupd;
+    // nextupd less the margin
+    time_t expires;
+    ocspCheck result;
+};
+
+static peekSlot peek_slots[PEEK_SLOTS];
+static std::atomic<uint64_t> peek_hits(0), peek_misses(0);
+
+static peekSlot *peek_slot(const std::string &key)
+{
+    return &peek_slots[std::hash<std::string>()(key) % PEEK_SLOTS];
+}
+
+// Full-width length, so no two CertIDs share a key however long their parts
+static void append_octets(std::string *key, const ASN1_STRING *str)
+{
+    uint32_t len = (uint32_t)ASN1_STRING_length(str);
+
+    key->append((const char *)&len, sizeof(len));
+    key->append((const char *)ASN1_STRING_get0_data(str), len);
+}
+
+static void fill(const cacheEntry &entry, ocspCheck *retval)
+{
+    retval->status = entry.status;
+    retval->statusStr = OCSP_cert_status_str(entry.status);
+    retval->reason = entry.reason;
+    retval->reasonStr = OCSP_crl_reason_str(entry.reason);
+    retval->thisupd = (int64_t)entry.thisupd * 1000;
+    retval->nextupd = (int64_t)entry.nextupd * 1000;
+    retval->revoked = (int64_t)entry.revoked * 1000;
+}
+
+// Publishes entry in its slot, or with NULL empties the slot if it holds
+// key. Caller holds cache_lock.
+static void peek_store(const std::string &key, const cacheEntry *entry)
+{
+    peekSlot *slot = peek_slot(key);
+    uint32_t seq = slot->seq.load(std::memory_order_relaxed);
+
+    if (entry == NULL
+        && (slot->key_len != key.size() || memcmp(slot->key, key.data(), key.size()) != 0))
+        return;
+    slot->seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    // Keys too long for a slot are never peeked
+    if (entry == NULL || key.size() > PEEK_KEY_MAX) {
+        slot->key_len = 0;
+    } else {
+        slot->key_len = key.size();
+        memcpy(slot->key, key.data(), key.size());
+        slot->thisupd = entry->thisupd;
+        slot->expires = entry->nextupd - cache_margin;
+        slot->result = ocspCheck();
+        fill(*entry, &slot->result);
+        slot->last_read.store(0, std::memory_order_relaxed);
+    }
+    slot->seq.store(seq + 2, std::memory_order_release);
+}
+
+// Caller holds cache_lock
+static void evict_to(size_t max_entries)
+{
+    while (cache_lru.size() > max_entries) {
+        peek_store(cache_lru.back().key, NULL);
+        cache_index.erase(cache_lru.back().key);
+        cache_lru.pop_back();
+        cache_stats.evictions++;
+    }
+}
+
+// Caller holds cache_lock
+static void insert(cacheEntry &&entry)
+{
+    auto it = cache_index.find(entry.key);
+    if (it != cache_index.end()) {
+        // A refreshed response is as hot as the one it replaces
+        entry.last_read = it->second->last_read;
+        cache_lru.erase(it->second);
+        cache_index.erase(it);
+    }
+    cache_lru.push_front(std::move(entry));
+    cache_index[cache_lru.front().key] = cache_lru.begin();
+    peek_store(cache_lru.front().key, &cache_lru.front());
+}
+
+// Looks key up in the cache shared with other processes, copying a fresh
+// record into this process' cache
+static int shared_lookup(const std::string &key, long nsec, time_t now, ocspCheck *retval)
+{
+    shmRecord record;
+    cacheEntry entry;
+
+    if (!shm_cache_get(key, &record))
+        return 0;
+
+    std::lock_guard<std::mutex> guard(cache_lock);
+    if (record.thisupd > now + nsec || now >= record.nextupd - cache_margin)
+        return 0;
+    entry.key = key;
+    entry.der = std::move(record.der);
+    entry.status = record.status;
+    entry.reason = record.reason;
+    entry.thisupd = record.thisupd;
+    entry.nextupd = record.nextupd;
+    entry.revoked = record.revoked;
+    entry.last_read = now;
+    fill(entry, retval);
+    cache_stats.hits++;
+    cache_stats.misses--;
+    if (cache_max_entries > 0) {
+        insert(std::move(entry));
+        evict_to(cache_max_entries);
+    }
+    return 1;
+}
+
+void configure_cache(size_t max_entries, long margin)
+{
+    std::lock_guard<std::mutex> guard(cache_lock);
+    cache_max_entries = max_entries;
+    cache_margin = margin;
+    evict_to(max_entries);
+    // Slots hold their expiry with the margin applied
+    for (auto it = cache_lru.begin(); it != cache_lru.end(); ++it)
+        peek_store(it->key, &*it);
+}
+
+cacheStats get_cache_stats()
+{
+    std::lock_guard<std::mutex> guard(cache_lock);
+    cacheStats stats = cache_stats;
+    stats.peeks = peek_hits;
+    stats.peek_misses = peek_misses;
+    stats.size = cache_lru.size();
+    return stats;
+}
+
+int certid_key(OCSP_CERTID *id, std::string *key)
+{
+    ASN1_OCTET_STRING *name_hash = NULL, *key_hash = NULL;
+    ASN1_OBJECT *md = NULL;
+    ASN1_INTEGER *serial = NULL;
+    int nid;
+
+    if (id == NULL || !OCSP_id_get0_info(&name_hash, &md, &key_hash, &serial, id))
+        return 0;
+    nid = OBJ_obj2nid(md);
+    key->assign((const char *)&nid, sizeof(nid));
+    append_octets(key, name_hash);
+    append_octets(key, key_hash);
+    append_octets(key, serial);
+    return 1;
+}
+
+int cache_lookup(const std::string &key, long nsec, ocspCheck *retval)
+{
+    time_t now = time(NULL);
+
+    {
+        std::lock_guard<std::mutex> guard(cache_lock);
+
+        auto it = cache_index.find(key);
+        if (it != cache_index.end()) {
+            const cacheEntry &entry = *it->second;
+            if (entry.thisupd <= now + nsec && now < entry.nextupd - cache_margin) {
+                cache_lru.splice(cache_lru.begin(), cache_lru, it->second);
+                it->second->last_read = now;
+                cache_stats.hits++;
+                fill(entry, retval);
+                return 1;
+            }
+            // Kept for cache_lookup_stale until it expires for good
+            if (now >= entry.nextupd) {
+                peek_store(key, NULL);
+                cache_lru.erase(it->second);
+                cache_index.erase(it);
+            }
+        }
+        cache_stats.misses++;
+    }
+
+    return shm_cache_enabled() && shared_lookup(key, nsec, now, retval);
+}
+
+int cache_peek(const std::string &key, long nsec, ocspCheck *retval)
+{
+    peekSlot *slot = peek_slot(key);
+    time_t now = time(NULL), thisupd, expires;
+    uint32_t seq;
+    int tries;
+
+    if (key.size() > PEEK_KEY_MAX) {
+        peek_misses++;
+        return 0;
+    }
+    // A writer holds the slot only for a few copies, give up rather than
+    // wait on one stalled mid-write
+    for (tries = 0; tries < 4; tries++) {
+        seq = slot->seq.load(std::memory_order_acquire);
+        if (seq & 1)
+            continue;
+        // Fields read mid-write may be garbage, the seq check below
+        // throws them away
+        if (slot->key_len != key.size() || memcmp(slot->key, key.data(), key.size()) != 0) {
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot->seq.load(std::memory_order_relaxed) == seq)
+                break;
+            continue;
+        }
+        thisupd = slot->thisupd;
+        expires = slot->expires;
+        *retval = slot->result;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot->seq.load(std::memory_order_relaxed) != seq)
+            continue;
+        if (thisupd > now + nsec || now >= expires)
+            break;
+        slot->last_read.store(now, std::memory_order_relaxed);
+        peek_hits++;
+        return 1;
+    }
+    peek_misses++;
+    return 0;
+}
+
+int cache_lookup_stale(const std::string &key, ocspCheck *retval)
+{
+    time_t now = time(NULL);
+    std::lock_guard<std::mutex> guard(cache_lock);
+
+    auto it = cache_index.find(key);
+    if (it == cache_index.end() || now >= it->second->nextupd)
+        return 0;
+    cache_stats.stale++;
+    fill(*it->second, retval);
+    return 1;
+}
+
+int cache_times(const std::string &key, time_t *thisupd, time_t *expires, time_t *last_read)
+{
+    std::lock_guard<std::mutex> guard(cache_lock);
+
+    auto it = cache_index.find(key);
+    if (it == cache_index.end() || time(NULL) >= it->second->nextupd - cache_margin)
+        return 0;
+    *thisupd = it->second->thisupd;
+    *expires = it->second->nextupd - cache_margin;
+    *last_read = it->second->last_read;
+    // Peeks do not touch the entry, only its slot
+    peekSlot *slot = peek_slot(key);
+    if (slot->key_len == key.size() && memcmp(slot->key, key.data(), key.size()) == 0)
+        *last_read = std::max(*last_read, slot->last_read.load(std::memory_order_relaxed));
+    return 1;
+}
+
+void cache_entries(std::vector<std::pair<std::string, std::string>> *entries)
+{
+    time_t now = time(NULL);
+    std::lock_guard<std::mutex> guard(cache_lock);
+
+    for (auto it = cache_lru.begin(); it != cache_lru.end(); ++it) {
+        if (now < it->nextupd - cache_margin)
+            entries->push_back(std::make_pair(it->key, it->der));
+    }
+}
+
+void cache_add(const std::string &key, OCSP_RESPONSE *resp, OCSP_BASICRESP *bs,
+               OCSP_CERTID *id, const ocspCheck *result, long nsec, long maxage)
+{
+    cacheEntry entry;
+    ASN1_GENERALIZEDTIME *rev = NULL, *thisupd, *nextupd;
+    unsigned char *p;
+    int status, reason, len;
+
+    {
+        std::lock_guard<std::mutex> guard(cache_lock);
+        if (cache_max_entries == 0 && !shm_cache_enabled())
+            return;
+    }
+
+    if (!OCSP_resp_find_status(bs, id, &status, &reason, &rev, &thisupd, &nextupd)
+        || nextupd == NULL)
+        return;
+    if (!OCSP_check_validity(thisupd, nextupd, nsec, maxage)) {
+        ERR_clear_error();
+        return;
+    }
+    if (!asn1_time_to_epoch(thisupd, &entry.thisupd)
+        || !asn1_time_to_epoch(nextupd, &entry.nextupd)
+        || (rev != NULL && !asn1_time_to_epoch(rev, &entry.revoked)))
+        return;
+
+    len = i2d_OCSP_RESPONSE(resp, NULL);
+    if (len <= 0)
+        return;
+    entry.der.resize(len);
+    p = (unsigned char *)&entry.der[0];
+    i2d_OCSP_RESPONSE(resp, &p);
+
+    entry.key = key;
+    entry.status = result->status;
+    entry.reason = result->reason;
+
+    if (shm_cache_enabled()) {
+        shmRecord record;
+        record.status = entry.status;
+        record.reason = entry.reason;
+        record.thisupd = entry.thisupd;
+        record.nextupd = entry.nextupd;
+        record.revoked = entry.revoked;
+        record.der = entry.der;
+        shm_cache_put(key, record);
+    }
+
+    std::lock_guard<std::mutex> guard(cache_lock);
+    entry.last_read = time(NULL);
+    if (cache_max_entries == 0 || entry.last_read >= entry.nextupd - cache_margin)
+        return;
+    insert(std::move(entry));
+    evict_to(cache_max_entries);
+}
@@ -0,0 +1,61 @@
+#ifndef OCSP_CACHE_H
+#define OCSP_CACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <openssl/ocsp.h>
+
+#include "helper.h"
+
+struct cacheStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    // served by cache_lookup_stale
+    uint64_t stale = 0;
+    // served and missed by cache_peek
+    uint64_t peeks = 0;
+    uint64_t peek_misses = 0;
+    size_t size = 0;
+};
+
+// Keeps at most max_entries verified responses (0 disables the cache) and
+// stops serving each one margin seconds before its nextUpdate.
+void configure_cache(size_t max_entries, long margin);
+
+cacheStats get_cache_stats();
+
+// Serialises the issuer name hash, issuer key hash and serial of id.
+int certid_key(OCSP_CERTID *id, std::string *key);
+
+// Fills retval from a fresh cached response, returns 0 on a miss.
+// thisUpdate may be up to nsec seconds in the future, as in OCSP_check_validity.
+int cache_lookup(const std::string &key, long nsec, ocspCheck *retval);
+
+// cache_lookup without taking a lock or asking the shared cache, for
+// callers on the main thread. Only sees the most recently cached response
+// of keys not colliding with another one, misses are answered by
+// cache_lookup.
+int cache_peek(const std::string &key, long nsec, ocspCheck *retval);
+
+// cache_lookup for a response that is no longer served because it is
+// within the margin of its nextUpdate, but has not reached it.
+int cache_lookup_stale(const std::string &key, ocspCheck *retval);
+
+// Reports when the response cached for key was produced, when it stops
+// being served and when it was last served. Returns 0 when none is served.
+int cache_times(const std::string &key, time_t *thisupd, time_t *expires, time_t *last_read);
+
+// Appends the key and DER response of every entry still served.
+void cache_entries(std::vector<std::pair<std::string, std::string>> *entries);
+
+// Remembers the verified response for id, if it carries a nextUpdate and
+// passes OCSP_check_validity(nsec, maxage).
+void cache_add(const std::string &key, OCSP_RESPONSE *resp, OCSP_BASICRESP *bs,
+               OCSP_CERTID *id, const ocspCheck *result, long nsec, long maxage);
+
+#endif
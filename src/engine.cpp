@@ -0,0 +1,934 @@
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "engine.h"
+
+#if defined(__linux__)
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <openssl/err.h>
+
+#include "breaker.h"
+#include "latency.h"
+#include "ocsp.h"
+#include "pool.h"
+#include "workers.h"
+
+using std::chrono::steady_clock;
+
+#define DNS_TTL std::chrono::seconds(60)
+// Threads running getaddrinfo, so one slow name does not hold up others
+#define RESOLVER_THREADS 4
+// How often exchanges waiting for a pooled connection try again
+#define POOL_POLL_MS 5
+
+enum exchangeState {
+    EXCHANGE_NEW,
+    // for a connection to the responder to come back to its pool
+    EXCHANGE_WAITING,
+    EXCHANGE_RESOLVING,
+    EXCHANGE_CONNECTING,
+    EXCHANGE_HANDSHAKE,
+    EXCHANGE_SENDING
+};
+
+struct ioThread;
+struct exchange;
+
+typedef std::multimap<steady_clock::time_point, exchange *> timerMap;
+
+// A lookup in flight on one I/O thread. It follows the same steps as
+// verifyOCSP, with query_responder's select() loop replaced by epoll and
+// the deadline of each phase by a timer.
+struct exchange {
+    engineJob *job = NULL;
+    ioThread *owner = NULL;
+    exchangeState state = EXCHANGE_NEW;
+    ocspRequest request;
+    // Every address the host resolved to, tried in turn until one connects
+    std::vector<std::string> addresses;
+    size_t address_index = 0;
+    // End of the connect budget the attempts share
+    steady_clock::time_point connect_end;
+    BIO *cbio = NULL;
+    OCSP_REQ_CTX *ctx = NULL;
+    OCSP_RESPONSE *resp = NULL;
+    int fd = -1;
+    int registered = 0;
+    int pooled = 0;
+    // Holds a connection slot of the pool, given back with cbio
+    int slot = 0;
+    int reused = 0;
+    int armed = 0;
+    timerMap::iterator timer;
+    steady_clock::time_point total_end = steady_clock::time_point::max();
+    // Set once breaker_allow let the exchange start
+    int allowed = 0;
+    steady_clock::time_point started;
+    // When the current state was entered
+    steady_clock::time_point entered;
+};
+
+struct ioThread {
+    int epfd = -1;
+    int wakefd = -1;
+    // New jobs and exchanges coming back from the resolver
+    std::mutex lock;
+    std::vector<exchange *> incoming;
+    timerMap timers;
+    // Exchanges in EXCHANGE_WAITING, tried again on every turn of the loop
+    std::vector<exchange *> waiting;
+};
+
+struct dnsEntry {
+    std::vector<std::string> addresses;
+    steady_clock::time_point expires;
+};
+
+// One getaddrinfo call per host:port, every exchange waiting for the
+// name gets its result
+struct dnsQuery {
+    std::string host;
+    std::string port;
+    std::vector<exchange *> waiters;
+};
+
+// Main thread only
+static std::vector<ioThread *> io_threads;
+static size_t next_thread = 0;
+static int engine_on = 0;
+static size_t engine_pending = 0;
+static uv_async_t engine_async;
+static engine_done_cb engine_done = NULL;
+// Jobs for a responder at the max_per_host of configure_workers wait here
+// until one of its exchanges finishes, indexed by priority
+static std::deque<engineJob *> engine_queue[2];
+static std::unordered_map<std::string, size_t> engine_running;
+static size_t engine_active = 0;
+static size_t engine_max_in_flight = 0;
+static uint64_t engine_completed = 0;
+static uint64_t engine_rejected = 0;
+static uint64_t engine_shed = 0;
+
+static std::mutex done_lock;
+static std::vector<engineJob *> done_jobs;
+
+// getaddrinfo blocks, so it runs on threads of its own and results are
+// cached
+static std::mutex resolver_lock;
+// Never destroyed: destroying a condition variable the detached resolvers
+// still wait on blocks process exit
+static std::condition_variable *resolver_cv = NULL;
+// Keys of resolver_queries not taken by a resolver yet
+static std::deque<std::string> resolver_queue;
+static std::unordered_map<std::string, dnsQuery> resolver_queries;
+
+// Verifying a response, and the trust store reload it may trigger, take
+// far longer than an I/O turn, so they run on verifier threads while the
+// I/O threads go on multiplexing
+static std::mutex verifier_lock;
+static std::condition_variable *verifier_cv = NULL;
+static std::deque<exchange *> verifier_queue;
+static std::mutex dns_lock;
+static std::unordered_map<std::string, dnsEntry> dns_cache;
+
+static void drive(exchange *x);
+static void fail(exchange *x, const char *error);
+
+static void wake(ioThread *t)
+{
+    uint64_t one = 1;
+    ssize_t rv = write(t->wakefd, &one, sizeof(one));
+    (void)rv;
+}
+
+static void post(ioThread *t, exchange *x)
+{
+    {
+        std::lock_guard<std::mutex> guard(t->lock);
+        t->incoming.push_back(x);
+    }
+    wake(t);
+}
+
+static void unwatch(exchange *x)
+{
+    if (x->registered) {
+        epoll_ctl(x->owner->epfd, EPOLL_CTL_DEL, x->fd, NULL);
+        x->registered = 0;
+    }
+}
+
+static int watch(exchange *x, uint32_t events)
+{
+    struct epoll_event ev;
+
+    ev.events = events;
+    ev.data.ptr = x;
+    if (epoll_ctl(x->owner->epfd, x->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, x->fd, &ev) != 0)
+        return 0;
+    x->registered = 1;
+    return 1;
+}
+
+static void disarm(exchange *x)
+{
+    if (x->armed) {
+        x->owner->timers.erase(x->timer);
+        x->armed = 0;
+    }
+}
+
+static int timed_phase(exchangeState state)
+{
+    switch (state) {
+    case EXCHANGE_RESOLVING:
+        return PHASE_DNS;
+    case EXCHANGE_WAITING:
+    case EXCHANGE_CONNECTING:
+        return PHASE_CONNECT;
+    case EXCHANGE_HANDSHAKE:
+        return PHASE_TLS;
+    case EXCHANGE_SENDING:
+        return PHASE_READ;
+    default:
+        return -1;
+    }
+}
+
+// Records how long x spent in its current state
+static void time_state(exchange *x, steady_clock::time_point now)
+{
+    int phase = timed_phase(x->state);
+
+    if (phase != -1)
+        x->request.retval.timings[phase] = latency_us(x->entered, now);
+    x->entered = now;
+}
+
+// Moves x to the next phase, timing it out once its budget or the total
+// budget runs out
+static void enter(exchange *x, exchangeState state, long budget)
+{
+    steady_clock::time_point now = steady_clock::now(), end = x->total_end;
+
+    if (budget > 0)
+        end = std::min(end, now + std::chrono::milliseconds(budget));
+    time_state(x, now);
+    x->state = state;
+    disarm(x);
+    if (end != steady_clock::time_point::max()) {
+        x->timer = x->owner->timers.insert(std::make_pair(end, x));
+        x->armed = 1;
+    }
+}
+
+// Drops the connection, keeping it for reuse when the exchange completed
+static void release_connection(exchange *x, int reusable)
+{
+    unwatch(x);
+    OCSP_REQ_CTX_free(x->ctx);
+    x->ctx = NULL;
+    if (x->slot)
+        pool_checkin(x->request.host, x->request.port, x->request.use_ssl, x->cbio, reusable);
+    else
+        BIO_free_all(x->cbio);
+    x->slot = 0;
+    x->cbio = NULL;
+    x->fd = -1;
+}
+
+// Hands the result of x back to the loop and frees x
+static void finish(exchange *x)
+{
+    engineJob *job = x->job;
+
+    freeOCSP(&x->request);
+    ERR_clear_error();
+
+    job->result = x->request.retval;
+    job->cert_id = x->request.cert_id;
+    job->finished = steady_clock::now();
+    {
+        std::lock_guard<std::mutex> guard(done_lock);
+        done_jobs.push_back(job);
+    }
+    uv_async_send(&engine_async);
+
+    // The resolver still holds the exchange, it is freed when it comes back
+    if (x->state == EXCHANGE_RESOLVING)
+        x->job = NULL;
+    else
+        delete x;
+}
+
+static void complete(exchange *x)
+{
+    disarm(x);
+    if (x->state == EXCHANGE_WAITING) {
+        std::vector<exchange *> &waiting = x->owner->waiting;
+        waiting.erase(std::remove(waiting.begin(), waiting.end(), x), waiting.end());
+    }
+    if (x->resp != NULL)
+        time_state(x, steady_clock::now());
+    if (x->allowed)
+        breaker_report(x->request.host, x->request.port, x->request.use_ssl, x->resp != NULL,
+                       std::chrono::duration<double, std::milli>(
+                           steady_clock::now() - x->started).count());
+    if (x->resp != NULL && is_traced(&x->request))
+        count_exchange(&x->request, x->resp, &x->request.retval);
+    release_connection(x, x->resp != NULL);
+    if (x->resp != NULL) {
+        ERR_clear_error();
+        {
+            std::lock_guard<std::mutex> guard(verifier_lock);
+            verifier_queue.push_back(x);
+        }
+        verifier_cv->notify_one();
+        return;
+    }
+    serve_stale(&x->request);
+    finish(x);
+}
+
+static void run_verifier()
+{
+    for (;;) {
+        exchange *x;
+
+        {
+            std::unique_lock<std::mutex> guard(verifier_lock);
+            verifier_cv->wait(guard, [] { return !verifier_queue.empty(); });
+            x = verifier_queue.front();
+            verifier_queue.pop_front();
+        }
+        finishOCSP(&x->request, x->resp);
+        OCSP_RESPONSE_free(x->resp);
+        x->resp = NULL;
+        finish(x);
+    }
+}
+
+static void send_request(exchange *x)
+{
+    if (x->fd < 0 && BIO_get_fd(x->cbio, &x->fd) < 0) {
+        fail(x, "Can't get connection fd");
+        return;
+    }
+    // Pooled connections may have been opened in blocking mode
+    BIO_socket_nbio(x->fd, 1);
+
+    x->ctx = new_request_ctx(x->cbio, x->request.host, request_path(&x->request),
+                             x->request.headers, request_body(&x->request), x->pooled);
+    if (x->ctx == NULL) {
+        fail(x, NULL);
+        return;
+    }
+    enter(x, EXCHANGE_SENDING, x->request.timeouts.read);
+    drive(x);
+}
+
+static std::string dns_key(exchange *x)
+{
+    return std::string(x->request.host) + ':' + x->request.port;
+}
+
+// Connects to the current address with an equal share of what is left of
+// the connect budget for each address not tried yet
+static void open_connection(exchange *x)
+{
+    std::string host = x->addresses[x->address_index];
+    steady_clock::time_point now = steady_clock::now(), end;
+    long budget = 0;
+
+    if (x->address_index == 0)
+        x->connect_end = x->request.timeouts.connect > 0
+            ? now + std::chrono::milliseconds(x->request.timeouts.connect)
+            : steady_clock::time_point::max();
+    end = std::min(x->connect_end, x->total_end);
+    if (end != steady_clock::time_point::max())
+        budget = std::max<long>(1, (long)(std::chrono::duration_cast<std::chrono::milliseconds>(
+            end - now).count() / (long)(x->addresses.size() - x->address_index)));
+
+    // BIO_new_connect takes host:port, IPv6 literals need brackets
+    if (host.find(':') != std::string::npos)
+        host = "[" + host + "]";
+    x->cbio = new_responder_bio(&x->request.retval, host.c_str(), x->request.port,
+                                x->request.use_ssl);
+    if (x->cbio == NULL) {
+        fail(x, x->request.retval.errorStr);
+        return;
+    }
+    if (x->pooled)
+        pool_opened();
+    BIO_set_nbio(x->cbio, 1);
+    enter(x, EXCHANGE_CONNECTING, budget);
+    drive(x);
+}
+
+// Moves on to the next address after a failed connect, as BIO_do_connect
+// does for blocking connections. Returns 0 when none or no budget is left.
+static int next_address(exchange *x)
+{
+    if (x->state != EXCHANGE_CONNECTING || x->address_index + 1 >= x->addresses.size()
+        || steady_clock::now() >= std::min(x->connect_end, x->total_end))
+        return 0;
+    // Keeps the pool slot for the next attempt
+    unwatch(x);
+    BIO_free_all(x->cbio);
+    x->cbio = NULL;
+    x->fd = -1;
+    ERR_clear_error();
+    x->address_index++;
+    open_connection(x);
+    return 1;
+}
+
+// Moves the address that connected to the front of the cached list, so a
+// bad first record costs one failed connect per TTL rather than per lookup
+static void promote_address(exchange *x)
+{
+    std::lock_guard<std::mutex> guard(dns_lock);
+    auto it = dns_cache.find(dns_key(x));
+
+    if (it == dns_cache.end())
+        return;
+    std::vector<std::string> &addresses = it->second.addresses;
+    auto found = std::find(addresses.begin(), addresses.end(), x->addresses[x->address_index]);
+    if (found != addresses.end())
+        std::rotate(addresses.begin(), found, found + 1);
+}
+
+static void connect_responder(exchange *x)
+{
+    std::string key;
+
+    // The I/O thread cannot block, so a host at its connection limit is
+    // polled until the connect budget runs out
+    if (x->pooled) {
+        if (!pool_checkout(x->request.host, x->request.port, x->request.use_ssl,
+                           steady_clock::time_point::min(), &x->cbio, &x->reused)) {
+            if (x->state != EXCHANGE_WAITING) {
+                pool_waited(0);
+                enter(x, EXCHANGE_WAITING, x->request.timeouts.connect);
+            }
+            x->owner->waiting.push_back(x);
+            return;
+        }
+        x->slot = 1;
+        if (x->cbio != NULL) {
+            send_request(x);
+            return;
+        }
+    }
+
+    key = dns_key(x);
+    x->addresses.clear();
+    x->address_index = 0;
+    {
+        std::lock_guard<std::mutex> guard(dns_lock);
+        auto it = dns_cache.find(key);
+        if (it != dns_cache.end() && it->second.expires > steady_clock::now()) {
+            x->addresses = it->second.addresses;
+        }
+    }
+    if (!x->addresses.empty()) {
+        open_connection(x);
+        return;
+    }
+
+    enter(x, EXCHANGE_RESOLVING, x->request.timeouts.dns);
+    {
+        std::lock_guard<std::mutex> guard(resolver_lock);
+        auto it = resolver_queries.find(key);
+        if (it != resolver_queries.end()) {
+            it->second.waiters.push_back(x);
+            return;
+        }
+        dnsQuery &query = resolver_queries[key];
+        query.host = x->request.host;
+        query.port = x->request.port;
+        query.waiters.push_back(x);
+        resolver_queue.push_back(key);
+    }
+    resolver_cv->notify_one();
+}
+
+static void start(exchange *x)
+{
+    engineJob *job = x->job;
+
+    x->request.retval.timings[PHASE_QUEUE] = latency_us(job->submitted, steady_clock::now());
+    x->request.cert_der = job->cert_der;
+    x->request.cert_der_len = job->cert_der_len;
+    x->request.issuer_der = job->issuer_der;
+    x->request.issuer_der_len = job->issuer_der_len;
+    x->request.issuer_handle = job->issuer_handle;
+    x->request.nonce = job->nonce;
+    x->request.use_get = job->use_get;
+    x->request.timeouts = job->timeouts;
+    x->request.trace = job->trace;
+    x->request.traced = job->traced;
+    if (!prepareOCSP(&x->request, job->cert.c_str(), job->issuer.c_str(),
+                     job->header.c_str(), job->url.c_str(), -1)) {
+        complete(x);
+        return;
+    }
+    if (!breaker_allow(x->request.host, x->request.port, x->request.use_ssl)) {
+        x->request.retval.errorStr = "Responder circuit open";
+        complete(x);
+        return;
+    }
+    x->allowed = 1;
+    x->started = steady_clock::now();
+    // Retries on a new connection share the deadline
+    if (x->request.timeouts.total > 0)
+        x->total_end = x->started + std::chrono::milliseconds(x->request.timeouts.total);
+    x->pooled = pool_enabled();
+    connect_responder(x);
+}
+
+// Mirrors process_responder: a reused connection may have been closed by
+// the responder, so anything but a timeout is retried on a new one.
+static void fail(exchange *x, const char *error)
+{
+    x->request.retval.errorStr = error;
+    release_connection(x, 0);
+    if (x->reused && !is_timeout(error)) {
+        x->reused = 0;
+        x->request.retval.errorStr = NULL;
+        connect_responder(x);
+        return;
+    }
+    // Timeouts keep naming the phase that ran out
+    if (!is_timeout(error))
+        x->request.retval.errorStr = "Error querying OCSP responder";
+    complete(x);
+}
+
+// Advances a connecting or sending exchange until it would block
+static void drive(exchange *x)
+{
+    int rv;
+
+    // TCP and TLS are set up one after the other so each has its own budget
+    if (x->state == EXCHANGE_CONNECTING || x->state == EXCHANGE_HANDSHAKE) {
+        BIO *bio = x->state == EXCHANGE_CONNECTING
+            ? BIO_find_type(x->cbio, BIO_TYPE_CONNECT) : x->cbio;
+        rv = x->state == EXCHANGE_CONNECTING ? BIO_do_connect(bio) : BIO_do_handshake(bio);
+        if (rv > 0) {
+            if (x->state == EXCHANGE_CONNECTING && x->address_index > 0)
+                promote_address(x);
+            if (x->state == EXCHANGE_CONNECTING && bio != x->cbio) {
+                enter(x, EXCHANGE_HANDSHAKE, x->request.timeouts.tls);
+                drive(x);
+            } else {
+                send_request(x);
+            }
+            return;
+        }
+        if (!BIO_should_retry(bio)) {
+            if (!next_address(x))
+                fail(x, "Error connecting BIO");
+            return;
+        }
+        if (x->fd < 0 && BIO_get_fd(x->cbio, &x->fd) < 0) {
+            fail(x, "Can't get connection fd");
+            return;
+        }
+        // A pending connect() reports completion as writable
+        if (!watch(x, BIO_should_read(bio) ? EPOLLIN : EPOLLOUT))
+            fail(x, "Select error");
+        return;
+    }
+
+    rv = OCSP_sendreq_nbio(&x->resp, x->ctx);
+    if (rv == 1) {
+        complete(x);
+        return;
+    }
+    if (rv == 0) {
+        fail(x, NULL);
+        return;
+    }
+    if (BIO_should_read(x->cbio)) {
+        if (!watch(x, EPOLLIN))
+            fail(x, "Select error");
+    } else if (BIO_should_write(x->cbio)) {
+        if (!watch(x, EPOLLOUT))
+            fail(x, "Select error");
+    } else {
+        fail(x, "Unexpected retry condition");
+    }
+}
+
+static void take_incoming(ioThread *t)
+{
+    std::vector<exchange *> incoming;
+    uint64_t count;
+    ssize_t rv = read(t->wakefd, &count, sizeof(count));
+    (void)rv;
+
+    {
+        std::lock_guard<std::mutex> guard(t->lock);
+        incoming.swap(t->incoming);
+    }
+    for (size_t i = 0; i < incoming.size(); i++) {
+        exchange *x = incoming[i];
+        if (x->state == EXCHANGE_NEW) {
+            start(x);
+        } else if (x->job == NULL) {
+            // Timed out while resolving
+            delete x;
+        } else if (x->addresses.empty()) {
+            x->state = EXCHANGE_CONNECTING;
+            fail(x, "Error connecting BIO");
+        } else {
+            open_connection(x);
+        }
+    }
+}
+
+static const char *timeout_error(exchangeState state)
+{
+    switch (state) {
+    case EXCHANGE_RESOLVING:
+        return "Timeout on DNS";
+    case EXCHANGE_HANDSHAKE:
+        return "Timeout on TLS";
+    case EXCHANGE_SENDING:
+        return "Timeout on read";
+    default:
+        return "Timeout on connect";
+    }
+}
+
+static void expire_timers(ioThread *t)
+{
+    steady_clock::time_point now = steady_clock::now();
+
+    while (!t->timers.empty() && t->timers.begin()->first <= now) {
+        exchange *x = t->timers.begin()->second;
+        disarm(x);
+        if (x->state == EXCHANGE_WAITING)
+            pool_waited(1);
+        if (!next_address(x))
+            fail(x, timeout_error(x->state));
+    }
+}
+
+static void retry_waiting(ioThread *t)
+{
+    std::vector<exchange *> waiting;
+
+    waiting.swap(t->waiting);
+    for (size_t i = 0; i < waiting.size(); i++)
+        connect_responder(waiting[i]);
+}
+
+static int next_timeout(ioThread *t)
+{
+    steady_clock::duration left;
+    int ms;
+
+    if (t->timers.empty())
+        return t->waiting.empty() ? -1 : POOL_POLL_MS;
+    left = t->timers.begin()->first - steady_clock::now();
+    if (left <= steady_clock::duration::zero())
+        return 0;
+    ms = (int)std::chrono::duration_cast<std::chrono::milliseconds>(left).count() + 1;
+    return t->waiting.empty() ? ms : std::min(ms, POOL_POLL_MS);
+}
+
+static void run_io_thread(ioThread *t)
+{
+    struct epoll_event events[64];
+    int i, n;
+
+    for (;;) {
+        n = epoll_wait(t->epfd, events, 64, next_timeout(t));
+        for (i = 0; i < n; i++) {
+            if (events[i].data.ptr == NULL)
+                take_incoming(t);
+            else
+                drive((exchange *)events[i].data.ptr);
+        }
+        expire_timers(t);
+        retry_waiting(t);
+    }
+}
+
+static void run_resolver()
+{
+    for (;;) {
+        std::string key, host, port;
+        BIO_ADDRINFO *res = NULL;
+        const BIO_ADDRINFO *ai;
+        std::vector<std::string> addresses;
+        std::vector<exchange *> waiters;
+
+        {
+            std::unique_lock<std::mutex> guard(resolver_lock);
+            resolver_cv->wait(guard, [] { return !resolver_queue.empty(); });
+            key = resolver_queue.front();
+            resolver_queue.pop_front();
+            const dnsQuery &query = resolver_queries[key];
+            host = query.host;
+            port = query.port;
+        }
+
+        if (BIO_lookup(host.c_str(), port.c_str(), BIO_LOOKUP_CLIENT,
+                       AF_UNSPEC, SOCK_STREAM, &res)) {
+            for (ai = res; ai != NULL; ai = BIO_ADDRINFO_next(ai)) {
+                char *numeric = BIO_ADDR_hostname_string(BIO_ADDRINFO_address(ai), 1);
+                if (numeric != NULL)
+                    addresses.push_back(numeric);
+                OPENSSL_free(numeric);
+            }
+            if (!addresses.empty()) {
+                dnsEntry entry = { addresses, steady_clock::now() + DNS_TTL };
+                std::lock_guard<std::mutex> guard(dns_lock);
+                dns_cache[key] = entry;
+            }
+            BIO_ADDRINFO_free(res);
+        }
+        ERR_clear_error();
+
+        // Exchanges asking for the name from now on start a new query
+        {
+            std::lock_guard<std::mutex> guard(resolver_lock);
+            waiters.swap(resolver_queries[key].waiters);
+            resolver_queries.erase(key);
+        }
+        for (size_t i = 0; i < waiters.size(); i++) {
+            waiters[i]->addresses = addresses;
+            post(waiters[i]->owner, waiters[i]);
+        }
+    }
+}
+
+// Main thread only
+static size_t queued()
+{
+    return engine_queue[WORKER_HIGH].size() + engine_queue[WORKER_LOW].size();
+}
+
+// Main thread only
+static int host_busy(const engineJob *job)
+{
+    size_t max_per_host, max_queued;
+    int shed;
+
+    get_worker_limits(&max_per_host, &max_queued, &shed);
+    if (max_per_host == 0 || job->responder.empty())
+        return 0;
+    auto it = engine_running.find(job->responder);
+    return it != engine_running.end() && it->second >= max_per_host;
+}
+
+// Main thread only
+static int throttled(const engineJob *job)
+{
+    if (engine_max_in_flight > 0 && engine_active >= engine_max_in_flight)
+        return 1;
+    return host_busy(job);
+}
+
+// Hands job over to an I/O thread. Main thread only.
+static void dispatch(engineJob *job)
+{
+    exchange *x = new exchange();
+
+    if (!job->responder.empty())
+        engine_running[job->responder]++;
+    engine_active++;
+    x->job = job;
+    x->owner = io_threads[next_thread++ % io_threads.size()];
+    post(x->owner, x);
+}
+
+// Completes a job that never ran, on the loop as if it had
+static void turn_away(engineJob *job, int status)
+{
+    job->status = status;
+    job->finished = steady_clock::now();
+    {
+        std::lock_guard<std::mutex> guard(done_lock);
+        done_jobs.push_back(job);
+    }
+    uv_async_send(&engine_async);
+}
+
+static void drain_done(uv_async_t *)
+{
+    std::vector<engineJob *> jobs;
+
+    {
+        std::lock_guard<std::mutex> guard(done_lock);
+        jobs.swap(done_jobs);
+    }
+    // Done with their responder before completion runs, which may submit
+    // more lookups
+    for (size_t i = 0; i < jobs.size(); i++) {
+        const std::string &responder = jobs[i]->responder;
+        if (jobs[i]->status != WORKER_DONE)
+            continue;
+        engine_active--;
+        engine_completed++;
+        if (!responder.empty() && --engine_running[responder] == 0)
+            engine_running.erase(responder);
+    }
+    for (size_t i = 0; i < jobs.size(); i++) {
+        // Only pending lookups keep the process alive
+        if (--engine_pending == 0)
+            uv_unref((uv_handle_t *)&engine_async);
+        engine_done(jobs[i]);
+    }
+    // Waiting jobs whose responder went below the limit go in order, high
+    // priority ones first, as long as there is room in flight
+    for (int priority = WORKER_HIGH; priority <= WORKER_LOW; priority++) {
+        std::deque<engineJob *> *queue = &engine_queue[priority];
+        for (auto it = queue->begin(); it != queue->end();) {
+            if (throttled(*it)) {
+                ++it;
+                continue;
+            }
+            engineJob *job = *it;
+            it = queue->erase(it);
+            dispatch(job);
+        }
+    }
+}
+
+const char *engine_start(uv_loop_t *loop, int threads, size_t max_in_flight,
+                         engine_done_cb done)
+{
+    int i;
+
+    engine_max_in_flight = max_in_flight;
+    if (threads <= 0) {
+        engine_on = 0;
+        return NULL;
+    }
+    if (!io_threads.empty()) {
+        engine_on = 1;
+        return NULL;
+    }
+
+    for (i = 0; i < threads; i++) {
+        ioThread *t = new ioThread();
+        struct epoll_event ev;
+
+        t->epfd = epoll_create1(EPOLL_CLOEXEC);
+        t->wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        ev.events = EPOLLIN;
+        ev.data.ptr = NULL;
+        if (t->epfd < 0 || t->wakefd < 0
+            || epoll_ctl(t->epfd, EPOLL_CTL_ADD, t->wakefd, &ev) != 0) {
+            if (t->epfd >= 0)
+                close(t->epfd);
+            if (t->wakefd >= 0)
+                close(t->wakefd);
+            delete t;
+            // Threads already running stay idle, nothing is routed to them
+            return "Error creating event engine";
+        }
+        io_threads.push_back(t);
+    }
+
+    engine_done = done;
+    resolver_cv = new std::condition_variable();
+    verifier_cv = new std::condition_variable();
+    uv_async_init(loop, &engine_async, drain_done);
+    uv_unref((uv_handle_t *)&engine_async);
+    for (i = 0; i < threads; i++) {
+        std::thread(run_io_thread, io_threads[i]).detach();
+        std::thread(run_verifier).detach();
+    }
+    for (i = 0; i < RESOLVER_THREADS; i++)
+        std::thread(run_resolver).detach();
+    engine_on = 1;
+    return NULL;
+}
+
+int engine_enabled()
+{
+    return engine_on;
+}
+
+void engine_submit(engineJob *job)
+{
+    job->submitted = steady_clock::now();
+    if (engine_pending++ == 0)
+        uv_ref((uv_handle_t *)&engine_async);
+    if (!throttled(job)) {
+        dispatch(job);
+        return;
+    }
+
+    size_t max_per_host, max_queued;
+    int shed;
+    get_worker_limits(&max_per_host, &max_queued, &shed);
+    if (max_queued > 0 && queued() >= max_queued) {
+        if (!shed || engine_queue[WORKER_LOW].empty()) {
+            engine_rejected++;
+            turn_away(job, WORKER_REJECTED);
+            return;
+        }
+        engine_shed++;
+        turn_away(engine_queue[WORKER_LOW].front(), WORKER_SHED);
+        engine_queue[WORKER_LOW].pop_front();
+    }
+    engine_queue[job->priority].push_back(job);
+}
+
+workerStats get_engine_stats()
+{
+    workerStats stats;
+
+    stats.active = engine_active;
+    stats.queued = queued();
+    stats.throttled = 0;
+    for (int priority = WORKER_HIGH; priority <= WORKER_LOW; priority++) {
+        for (size_t i = 0; i < engine_queue[priority].size(); i++)
+            stats.throttled += host_busy(engine_queue[priority][i]);
+    }
+    stats.completed = engine_completed;
+    stats.rejected = engine_rejected;
+    stats.shed = engine_shed;
+    return stats;
+}
+
+#else
+
+const char *engine_start(uv_loop_t *, int threads, size_t, engine_done_cb)
+{
+    return threads > 0 ? "Event engine requires epoll" : NULL;
+}
+
+int engine_enabled()
+{
+    return 0;
+}
+
+void engine_submit(engineJob *)
+{
+}
+
+workerStats get_engine_stats()
+{
+    return workerStats();
+}
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef OCSP_ENGINE_H
+#define OCSP_ENGINE_H
+
+#include <atomic>
+#include <chrono>
+#include <string>
+
+#include <uv.h>
+
+#include "helper.h"
+#include "ocsp.h"
+#include "workers.h"
+
+// One lookup run by the event engine
+struct engineJob {
+    std::string cert;
+    std::string issuer;
+    std::string header;
+    std::string url;
+    // host:port of the responder, lookups to one responder run at most
+    // max_per_host of configure_workers at a time. Empty for no limit.
+    std::string responder;
+    // WORKER_HIGH or WORKER_LOW, for the order jobs waiting for their
+    // responder go in and which of them a full queue sheds
+    int priority = WORKER_HIGH;
+    // Set by the engine, WORKER_REJECTED or WORKER_SHED when the job was
+    // turned away without running
+    int status = WORKER_DONE;
+    // Used instead of cert and issuer when set, must outlive the job
+    const unsigned char *cert_der = NULL;
+    long cert_der_len = 0;
+    const unsigned char *issuer_der = NULL;
+    long issuer_der_len = 0;
+    // Registered issuer used instead of issuer when set
+    std::string issuer_handle;
+    // As in ocspRequest
+    int nonce = -1;
+    int use_get = -1;
+    ocspTimeouts timeouts;
+    // As in ocspRequest, cert_id is set once the job is done. traced must
+    // outlive the job.
+    int trace = 0;
+    const std::atomic<int> *traced = NULL;
+    ocspCheck result;
+    std::string cert_id;
+    // When the engine took the job and handed it back, for timing the
+    // phases around it
+    std::chrono::steady_clock::time_point submitted;
+    std::chrono::steady_clock::time_point finished;
+    // Owned by the submitter, untouched by the engine
+    void *data = NULL;
+};
+
+// Called on the loop passed to engine_start for every finished job.
+typedef void (*engine_done_cb)(engineJob *job);
+
+// Starts `threads` I/O threads, each multiplexing many responder exchanges
+// with epoll, as many threads verifying the responses they read, and
+// routes engine_submit to them. At most max_in_flight jobs (0: no limit)
+// run at once; the rest wait under the worker queue limits. Later calls
+// only toggle routing and set the limit: threads == 0 disables the engine.
+// Returns NULL on success or an error string. Main thread only.
+const char *engine_start(uv_loop_t *loop, int threads, size_t max_in_flight,
+                         engine_done_cb done);
+
+int engine_enabled();
+
+// Hands job over to an I/O thread, done is called with it once finished.
+// A job whose responder is at its limit waits for one of its exchanges to
+// finish first, and is turned away once max_queued jobs wait, as in
+// configure_workers. Main thread only.
+void engine_submit(engineJob *job);
+
+// Jobs run and waiting, as in get_worker_stats without threads. Main
+// thread only.
+workerStats get_engine_stats();
+
+#endif
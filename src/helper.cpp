@@ -58,3 +58,17 @@ X509_STORE *setup_verify(ocspCheck *retval, const char *CAfile, const char *CApa
     X509_STORE_free(store);
     return NULL;
 }
+
+int asn1_time_to_epoch(const ASN1_TIME *t, time_t *epoch)
+{
+    struct tm tm;
+
+    if (t == NULL || !ASN1_TIME_to_tm(t, &tm))
+        return 0;
+# if defined(_WIN32)
+    *epoch = _mkgmtime(&tm);
+# else
+    *epoch = timegm(&tm);
+# endif
+    return 1;
+}
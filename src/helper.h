@@ -1,14 +1,56 @@
+#ifndef OCSP_HELPER_H
+#define OCSP_HELPER_H
+
+#include <cstdint>
+#include <ctime>
+
+#include <openssl/x509.h>
+
+// Phases of a lookup timed in ocspCheck::timings: waiting for a worker,
+// the responder exchange, verifying the response, waiting for the
+// callback to run, and the whole lookup
+#define PHASE_QUEUE 0
+#define PHASE_DNS 1
+#define PHASE_CONNECT 2
+#define PHASE_TLS 3
+#define PHASE_READ 4
+#define PHASE_VERIFY 5
+#define PHASE_CALLBACK 6
+#define PHASE_TOTAL 7
+#define PHASE_COUNT 8
+
+// Where the result of a lookup came from, ocspCheck::cache: the responder,
+// the response cache, a stale response served while the responder's circuit
+// is open, or a response saved by an earlier process
+#define CACHE_MISS 0
+#define CACHE_HIT 1
+#define CACHE_STALE 2
+#define CACHE_SNAPSHOT 3
+
 struct ocspCheck {
     const char* statusStr = NULL;
     int status = -1;
     const char* reasonStr = NULL;
     int reason = -1;
-    char* thisupdStr = NULL;
-    char* nextupdStr = NULL;
-    char* revokedStr = NULL;
+    // Milliseconds since the epoch, 0 when absent
+    int64_t thisupd = 0;
+    int64_t nextupd = 0;
+    int64_t revoked = 0;
+    // Microseconds spent in each phase, 0 for phases that did not run
+    int64_t timings[PHASE_COUNT] = {};
+    int cache = CACHE_MISS;
+    // DER bytes of the request sent and the response read, only counted
+    // for traced requests
+    long sent = 0;
+    long received = 0;
     const char* errorStr = NULL;
 };
 
 // https://github.com/openssl/openssl/blob/OpenSSL_1_1_1/apps/apps.h#L473-L474
 X509_STORE *setup_verify(ocspCheck *retval, const char *CAfile, const char *CApath,
                          int noCAfile, int noCApath);
+
+// Converts an ASN1_TIME to seconds since the epoch, returns 0 on error
+int asn1_time_to_epoch(const ASN1_TIME *t, time_t *epoch);
+
+#endif
@@ -0,0 +1,183 @@
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <openssl/pem.h>
+
+#include "issuers.h"
+
+// DER of the CertID fields before the serial number: the hash algorithm
+// and the issuer name and key hashes
+struct issuerEntry {
+    X509 *cert;
+    std::string sha1_prefix;
+    std::string sha256_prefix;
+};
+
+static std::mutex issuers_lock;
+static std::unordered_map<std::string, issuerEntry> issuers;
+
+static int certid_prefix(const EVP_MD *md, X509 *issuer, std::string *prefix)
+{
+    ASN1_INTEGER *serial = ASN1_INTEGER_new();
+    OCSP_CERTID *id = NULL;
+    unsigned char *der = NULL;
+    const unsigned char *p;
+    long len;
+    int der_len, tag, xclass, serial_len, ret = 0;
+
+    if (serial == NULL)
+        goto end;
+    id = OCSP_cert_id_new(md, X509_get_subject_name(issuer),
+                          X509_get0_pubkey_bitstr(issuer), serial);
+    if (id == NULL || (der_len = i2d_OCSP_CERTID(id, &der)) <= 0)
+        goto end;
+    serial_len = i2d_ASN1_INTEGER(serial, NULL);
+
+    // The serial number is the last field of the SEQUENCE
+    p = der;
+    if (ASN1_get_object(&p, &len, &tag, &xclass, der_len) & 0x80 || len < serial_len)
+        goto end;
+    prefix->assign((const char *)p, len - serial_len);
+    ret = 1;
+
+ end:
+    OPENSSL_free(der);
+    OCSP_CERTID_free(id);
+    ASN1_INTEGER_free(serial);
+    return ret;
+}
+
+// Writes a DER length, returns the number of bytes used
+static size_t put_length(unsigned char *out, size_t len)
+{
+    if (len < 0x80) {
+        out[0] = (unsigned char)len;
+        return 1;
+    }
+    if (len <= 0xff) {
+        out[0] = 0x81;
+        out[1] = (unsigned char)len;
+        return 2;
+    }
+    out[0] = 0x82;
+    out[1] = (unsigned char)(len >> 8);
+    out[2] = (unsigned char)len;
+    return 3;
+}
+
+const char *register_issuer(const unsigned char *data, long len, int pem,
+                            std::string *handle)
+{
+    static const char hex[] = "0123456789abcdef";
+    unsigned char fingerprint[EVP_MAX_MD_SIZE];
+    unsigned int fingerprint_len, i;
+    issuerEntry entry;
+    X509 *issuer;
+
+    if (pem) {
+        BIO *bio = BIO_new_mem_buf(data, (int)len);
+        issuer = bio != NULL ? PEM_read_bio_X509_AUX(bio, NULL, NULL, NULL) : NULL;
+        BIO_free(bio);
+    } else {
+        issuer = d2i_X509(NULL, &data, len);
+    }
+    if (issuer == NULL)
+        return "Unable to load issuer certificate";
+
+    if (!X509_digest(issuer, EVP_sha256(), fingerprint, &fingerprint_len)) {
+        X509_free(issuer);
+        return "Unable to load issuer certificate";
+    }
+    handle->clear();
+    for (i = 0; i < fingerprint_len; i++) {
+        *handle += hex[fingerprint[i] >> 4];
+        *handle += hex[fingerprint[i] & 0xf];
+    }
+
+    {
+        std::lock_guard<std::mutex> guard(issuers_lock);
+        if (issuers.count(*handle) > 0) {
+            X509_free(issuer);
+            return NULL;
+        }
+    }
+
+    entry.cert = issuer;
+    if (!certid_prefix(EVP_sha1(), issuer, &entry.sha1_prefix)
+        || !certid_prefix(EVP_sha256(), issuer, &entry.sha256_prefix)) {
+        X509_free(issuer);
+        return "Error Creating OCSP request";
+    }
+
+    std::lock_guard<std::mutex> guard(issuers_lock);
+    // Lost a race with another registration of the same issuer
+    if (!issuers.insert(std::make_pair(*handle, entry)).second)
+        X509_free(issuer);
+    return NULL;
+}
+
+int unregister_issuer(const std::string &handle)
+{
+    issuerEntry entry;
+
+    {
+        std::lock_guard<std::mutex> guard(issuers_lock);
+        auto it = issuers.find(handle);
+        if (it == issuers.end())
+            return 0;
+        entry = it->second;
+        issuers.erase(it);
+    }
+    X509_free(entry.cert);
+    return 1;
+}
+
+X509 *get_issuer(const std::string &handle)
+{
+    std::lock_guard<std::mutex> guard(issuers_lock);
+    auto it = issuers.find(handle);
+
+    if (it == issuers.end())
+        return NULL;
+    X509_up_ref(it->second.cert);
+    return it->second.cert;
+}
+
+OCSP_CERTID *issuer_cert_id(const std::string &handle, const EVP_MD *md, X509 *cert)
+{
+    const ASN1_INTEGER *serial = X509_get0_serialNumber(cert);
+    std::string der;
+    unsigned char header[4], *p;
+    const unsigned char *in;
+    int serial_len = i2d_ASN1_INTEGER((ASN1_INTEGER *)serial, NULL);
+    size_t header_len;
+
+    if (serial_len <= 0)
+        return NULL;
+
+    {
+        std::lock_guard<std::mutex> guard(issuers_lock);
+        auto it = issuers.find(handle);
+        if (it == issuers.end())
+            return NULL;
+        if (EVP_MD_type(md) == NID_sha1)
+            der = it->second.sha1_prefix;
+        else if (EVP_MD_type(md) == NID_sha256)
+            der = it->second.sha256_prefix;
+        else
+            return OCSP_cert_to_id(md, cert, it->second.cert);
+    }
+
+    // Only the serial number is encoded per request, the CertID is then
+    // decoded in one pass instead of hashing the issuer again
+    header[0] = V_ASN1_SEQUENCE | V_ASN1_CONSTRUCTED;
+    header_len = 1 + put_length(header + 1, der.size() + serial_len);
+    der.insert(0, (const char *)header, header_len);
+    der.resize(der.size() + serial_len);
+    p = (unsigned char *)&der[der.size() - serial_len];
+    i2d_ASN1_INTEGER((ASN1_INTEGER *)serial, &p);
+
+    in = (const unsigned char *)der.data();
+    return d2i_OCSP_CERTID(NULL, &in, (long)der.size());
+}
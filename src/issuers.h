@@ -0,0 +1,27 @@
+#ifndef OCSP_ISSUERS_H
+#define OCSP_ISSUERS_H
+
+#include <string>
+
+#include <openssl/ocsp.h>
+
+// Parses an issuer certificate once and keeps it with its encoded hashes,
+// so requests for its certificates only need the leaf serial. data is PEM
+// when pem is set, DER otherwise. *handle is set to the hex SHA-256
+// fingerprint of the certificate. Returns NULL on success, or an error
+// string. Registering the same certificate again is a no-op.
+const char *register_issuer(const unsigned char *data, long len, int pem,
+                            std::string *handle);
+
+// Returns 1 when handle was registered.
+int unregister_issuer(const std::string &handle);
+
+// Returns a reference to the registered issuer the caller releases with
+// X509_free, or NULL when handle is unknown.
+X509 *get_issuer(const std::string &handle);
+
+// Builds the CertID of cert from the issuer's precomputed name and key
+// hashes. Returns NULL when handle is unknown.
+OCSP_CERTID *issuer_cert_id(const std::string &handle, const EVP_MD *md, X509 *cert);
+
+#endif
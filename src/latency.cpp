@@ -0,0 +1,179 @@
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include "latency.h"
+
+using std::chrono::steady_clock;
+
+// Log-linear buckets as in HdrHistogram: values below 64 us are counted
+// exactly, larger ones in one of 32 buckets per power of two, so within
+// about 3%. Values from 2^28 us, about 4.5 minutes, share the last bucket.
+#define HIST_SUB_BITS 5
+#define HIST_SUB_COUNT (1 << HIST_SUB_BITS)
+#define HIST_MAX_BITS 28
+#define HIST_BUCKETS ((HIST_MAX_BITS - HIST_SUB_BITS + 1) * HIST_SUB_COUNT)
+
+struct histogram {
+    std::atomic<uint64_t> counts[HIST_BUCKETS];
+    std::atomic<uint64_t> sum;
+    std::atomic<int64_t> max;
+};
+
+struct responderHistograms {
+    histogram phases[PHASE_COUNT];
+};
+
+static const char *const phase_names[PHASE_COUNT] = {
+    "queue", "dns", "connect", "tls", "read", "verify", "callback", "total"
+};
+
+typedef std::unordered_map<std::string, responderHistograms *> latencyMap;
+
+// Recorders find a responder's histograms in the published map without a
+// lock. Adding a responder, under latency_lock, publishes a copy with it;
+// maps replaced are kept since recorders may still be reading them, and
+// neither they nor the histograms are ever freed.
+static std::mutex latency_lock;
+static std::atomic<const latencyMap *> latency_responders(new latencyMap());
+static std::vector<std::unique_ptr<const latencyMap>> latency_retired;
+
+static size_t bucket_index(int64_t value)
+{
+    uint64_t v = (uint64_t)value;
+    int magnitude;
+
+    if (v < 2 * HIST_SUB_COUNT)
+        return (size_t)v;
+    if (v >= (uint64_t)1 << HIST_MAX_BITS)
+        v = ((uint64_t)1 << HIST_MAX_BITS) - 1;
+    // Highest bit set, at least HIST_SUB_BITS + 1 here
+    magnitude = HIST_SUB_BITS + 1;
+    while (v >> (magnitude + 1))
+        magnitude++;
+    return (size_t)(magnitude - HIST_SUB_BITS) * HIST_SUB_COUNT
+        + (size_t)(v >> (magnitude - HIST_SUB_BITS));
+}
+
+// Largest value counted in bucket index
+static int64_t bucket_value(size_t index)
+{
+    int shift;
+
+    if (index < 2 * HIST_SUB_COUNT)
+        return (int64_t)index;
+    shift = (int)(index / HIST_SUB_COUNT) - 1;
+    return (((int64_t)(index % HIST_SUB_COUNT + HIST_SUB_COUNT) + 1) << shift) - 1;
+}
+
+static void record(histogram *h, int64_t value)
+{
+    int64_t max = h->max.load(std::memory_order_relaxed);
+
+    h->counts[bucket_index(value)].fetch_add(1, std::memory_order_relaxed);
+    h->sum.fetch_add((uint64_t)value, std::memory_order_relaxed);
+    while (value > max && !h->max.compare_exchange_weak(max, value, std::memory_order_relaxed))
+        ;
+}
+
+// Value below which a fraction q of counts falls, counts summing to total
+static int64_t percentile(const uint64_t *counts, uint64_t total, double q, int64_t max)
+{
+    uint64_t rank = std::max<uint64_t>(1, (uint64_t)ceil(q * (double)total));
+    uint64_t seen = 0;
+
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen >= rank)
+            return std::min(bucket_value(i), max);
+    }
+    return max;
+}
+
+static void summarise(histogram *h, int reset, latencySummary *summary)
+{
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total = 0, sum;
+
+    // Values recorded meanwhile land in this summary or the next one
+    for (size_t i = 0; i < HIST_BUCKETS; i++) {
+        counts[i] = reset ? h->counts[i].exchange(0, std::memory_order_relaxed)
+                          : h->counts[i].load(std::memory_order_relaxed);
+        total += counts[i];
+    }
+    sum = reset ? h->sum.exchange(0, std::memory_order_relaxed)
+                : h->sum.load(std::memory_order_relaxed);
+    summary->max = reset ? h->max.exchange(0, std::memory_order_relaxed)
+                         : h->max.load(std::memory_order_relaxed);
+    summary->count = total;
+    if (total == 0)
+        return;
+    summary->mean = (double)sum / (double)total;
+    summary->p50 = percentile(counts, total, 0.5, summary->max);
+    summary->p90 = percentile(counts, total, 0.9, summary->max);
+    summary->p99 = percentile(counts, total, 0.99, summary->max);
+    summary->p999 = percentile(counts, total, 0.999, summary->max);
+}
+
+const char *phase_name(int phase)
+{
+    return phase_names[phase];
+}
+
+int64_t latency_us(steady_clock::time_point start, steady_clock::time_point end)
+{
+    int64_t us = std::chrono::duration_cast<std::chrono::microseconds>(end - start).count();
+
+    return std::max<int64_t>(us, 1);
+}
+
+// Histograms of a responder not seen yet
+static responderHistograms *add_responder(const std::string &responder)
+{
+    std::lock_guard<std::mutex> guard(latency_lock);
+    const latencyMap *current = latency_responders.load(std::memory_order_acquire);
+
+    // Another recorder may have added it meanwhile
+    auto it = current->find(responder);
+    if (it != current->end())
+        return it->second;
+    latencyMap *next = new latencyMap(*current);
+    responderHistograms *histograms = new responderHistograms();
+    (*next)[responder] = histograms;
+    latency_responders.store(next, std::memory_order_release);
+    latency_retired.emplace_back(current);
+    return histograms;
+}
+
+void latency_record(const std::string &responder, const ocspCheck &result)
+{
+    const latencyMap *responders = latency_responders.load(std::memory_order_acquire);
+    responderHistograms *histograms;
+    int phase;
+
+    auto it = responders->find(responder);
+    histograms = it != responders->end() ? it->second : add_responder(responder);
+    for (phase = 0; phase < PHASE_COUNT; phase++) {
+        if (result.timings[phase] > 0)
+            record(&histograms->phases[phase], result.timings[phase]);
+    }
+}
+
+std::vector<responderLatency> get_latency(int reset)
+{
+    std::vector<responderLatency> latencies;
+    const latencyMap *responders = latency_responders.load(std::memory_order_acquire);
+
+    for (auto it = responders->begin(); it != responders->end(); ++it) {
+        responderLatency latency;
+        latency.responder = it->first;
+        for (int phase = 0; phase < PHASE_COUNT; phase++)
+            summarise(&it->second->phases[phase], reset, &latency.phases[phase]);
+        latencies.push_back(latency);
+    }
+    return latencies;
+}
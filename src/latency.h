@@ -0,0 +1,45 @@
+#ifndef OCSP_LATENCY_H
+#define OCSP_LATENCY_H
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "helper.h"
+
+// Microseconds
+struct latencySummary {
+    uint64_t count = 0;
+    double mean = 0;
+    int64_t max = 0;
+    int64_t p50 = 0;
+    int64_t p90 = 0;
+    int64_t p99 = 0;
+    int64_t p999 = 0;
+};
+
+struct responderLatency {
+    // host:port
+    std::string responder;
+    latencySummary phases[PHASE_COUNT];
+};
+
+// Name of a PHASE_* index, as reported to JS
+const char *phase_name(int phase);
+
+// Microseconds from start to end, at least 1 so phases that ran are told
+// apart from those that did not
+int64_t latency_us(std::chrono::steady_clock::time_point start,
+                   std::chrono::steady_clock::time_point end);
+
+// Adds the phases of result that ran to the histograms of responder.
+// Lock-free but for the first lookup of a responder, which adds its
+// histograms.
+void latency_record(const std::string &responder, const ocspCheck &result);
+
+// Summarises the histograms of every responder seen, emptying them when
+// reset is set.
+std::vector<responderLatency> get_latency(int reset);
+
+#endif
@@ -8,13 +8,34 @@
  */
 
 // g++ ocsp.cpp -I/usr/local/opt/openssl/include -L/usr/local/opt/openssl/lib/ -lcrypto
+#include <arpa/inet.h>
 #include <sys/select.h>
+#include <sys/socket.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstring>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #include <openssl/ocsp.h>
 
+#include "breaker.h"
+#include "cache.h"
+#include "issuers.h"
+#include "latency.h"
 #include "ocsp.h"
+#include "pool.h"
+#include "refresh.h"
+#include "signers.h"
+#include "snapshot.h"
+#include "store.h"
 
 # include <openssl/e_os2.h>
 # include <openssl/crypto.h>
@@ -25,54 +46,412 @@
 # include <openssl/x509v3.h>
 # include <openssl/rand.h>
 
-/* Maximum leeway in validity period: default 5 minutes */
-# define MAX_VALIDITY_PERIOD    (5 * 60)
+using std::chrono::steady_clock;
 
 static int add_ocsp_cert(ocspCheck *retval, OCSP_REQUEST **req, X509 *cert,
                          const EVP_MD *cert_id_md, X509 *issuer,
+                         const std::string &issuer_handle,
                          STACK_OF(OCSP_CERTID) *ids);
 static void print_ocsp_summary(ocspCheck *retval, BIO *out, OCSP_BASICRESP *bs, OCSP_REQUEST *req,
                               STACK_OF(OPENSSL_STRING) *names,
                               STACK_OF(OCSP_CERTID) *ids, long nsec,
-                              long maxage);
+                              long maxage, int strict);
 
 static OCSP_RESPONSE *query_responder(ocspCheck *retval, BIO *cbio, const char *host,
                                       const char *path,
                                       const STACK_OF(CONF_VALUE) *headers,
-                                      OCSP_REQUEST *req, int req_timeout);
+                                      OCSP_REQUEST *req, const ocspTimeouts *timeouts,
+                                      steady_clock::time_point connect_end,
+                                      steady_clock::time_point total_end,
+                                      int keep_alive, int *connected);
+
+static std::atomic<int> request_nonce(1);
+static std::atomic<int> request_get(0);
+
+// 5 seconds in all, phases are only bounded by that
+static ocspTimeouts default_timeouts() {
+    ocspTimeouts t;
+
+    t.total = 5000;
+    t.dns = t.connect = t.tls = t.read = 0;
+    return t;
+}
+
+static std::mutex timeouts_lock;
+static ocspTimeouts request_timeouts = default_timeouts();
+
+// GET paths of nonce-less requests, which only depend on the CertID and
+// the responder URL. Cleared when full rather than tracking use.
+#define GET_PATHS_MAX 10000
+static std::mutex get_paths_lock;
+static std::unordered_map<std::string, std::string> get_paths;
+
+void configure_requests(int nonce, int use_get, const ocspTimeouts &timeouts) {
+    request_nonce = nonce;
+    request_get = use_get;
+    std::lock_guard<std::mutex> guard(timeouts_lock);
+    request_timeouts = timeouts;
+}
+
+int is_timeout(const char *error) {
+    return error != NULL && strncmp(error, "Timeout on ", 11) == 0;
+}
+
+static void resolve_timeouts(ocspTimeouts *t) {
+    std::lock_guard<std::mutex> guard(timeouts_lock);
+
+    if (t->total == -1)
+        t->total = request_timeouts.total;
+    if (t->dns == -1)
+        t->dns = request_timeouts.dns;
+    if (t->connect == -1)
+        t->connect = request_timeouts.connect;
+    if (t->tls == -1)
+        t->tls = request_timeouts.tls;
+    if (t->read == -1)
+        t->read = request_timeouts.read;
+}
+
+// RFC 5019: {path}/{url-encoding of the base64 DER request}. Returns an
+// empty string, meaning POST, when the whole URL exceeds 255 bytes.
+static std::string get_path(const ocspRequest *r) {
+    unsigned char *der = NULL, *b64 = NULL;
+    std::string path(r->path);
+    size_t url_len;
+    int i, len;
+
+    len = i2d_OCSP_REQUEST(r->req, &der);
+    if (len <= 0)
+        return std::string();
+    b64 = (unsigned char *)OPENSSL_malloc(4 * ((len + 2) / 3) + 1);
+    if (b64 == NULL) {
+        OPENSSL_free(der);
+        return std::string();
+    }
+    len = EVP_EncodeBlock(b64, der, len);
+
+    if (path.empty() || path[path.size() - 1] != '/')
+        path += '/';
+    for (i = 0; i < len; i++) {
+        if (b64[i] == '+')
+            path += "%2B";
+        else if (b64[i] == '/')
+            path += "%2F";
+        else if (b64[i] == '=')
+            path += "%3D";
+        else
+            path += (char)b64[i];
+    }
+    OPENSSL_free(der);
+    OPENSSL_free(b64);
+
+    url_len = strlen(r->use_ssl == 1 ? "https://" : "http://") + strlen(r->host)
+        + 1 + strlen(r->port) + path.size();
+    if (url_len > 255)
+        return std::string();
+    return path;
+}
+
+// Encodes r->req as a GET path, reusing the encoding of an earlier identical
+// nonce-less request
+static void set_get_path(ocspRequest *r) {
+    std::string key;
+
+    if (r->nonce || r->cache_key.empty()) {
+        r->get_path = get_path(r);
+        return;
+    }
+
+    key = r->cache_key + '\0' + r->host + '\0' + r->port + '\0' + r->path
+        + (r->use_ssl == 1 ? ":tls" : ":tcp");
+    {
+        std::lock_guard<std::mutex> guard(get_paths_lock);
+        auto it = get_paths.find(key);
+        if (it != get_paths.end()) {
+            r->get_path = it->second;
+            return;
+        }
+    }
+    r->get_path = get_path(r);
+    std::lock_guard<std::mutex> guard(get_paths_lock);
+    if (get_paths.size() >= GET_PATHS_MAX)
+        get_paths.clear();
+    get_paths[key] = r->get_path;
+}
+
+int serve_stale(ocspRequest *r) {
+    if (r->retval.errorStr == NULL || strcmp(r->retval.errorStr, "Responder circuit open") != 0
+        || r->cache_key.empty() || !breaker_serves_stale())
+        return 0;
+    if (!cache_lookup_stale(r->cache_key, &r->retval))
+        return 0;
+    r->retval.errorStr = NULL;
+    r->retval.cache = CACHE_STALE;
+    return 1;
+}
+
+int is_traced(const ocspRequest *r) {
+    return r->trace || (r->traced != NULL && r->traced->load());
+}
+
+void count_exchange(const ocspRequest *r, OCSP_RESPONSE *resp, ocspCheck *retval) {
+    retval->sent = r->get_path.empty() ? i2d_OCSP_REQUEST(r->req, NULL) : (long)r->get_path.size();
+    retval->received = i2d_OCSP_RESPONSE(resp, NULL);
+}
+
+// Hex of the DER of id, empty if it does not encode
+static std::string certid_hex(OCSP_CERTID *id) {
+    static const char hex[] = "0123456789abcdef";
+    unsigned char *der = NULL;
+    std::string out;
+    int i, len;
+
+    len = i2d_OCSP_CERTID(id, &der);
+    if (len <= 0)
+        return out;
+    out.reserve(2 * (size_t)len);
+    for (i = 0; i < len; i++) {
+        out += hex[der[i] >> 4];
+        out += hex[der[i] & 0xf];
+    }
+    OPENSSL_free(der);
+    return out;
+}
+
+ocspCheck verifyOCSPRequest(ocspRequest *request, const char* cert_local, const char* issuer_local, const char* header_local, const char* url_local, int timeout) {
+    OCSP_RESPONSE *resp = NULL;
+
+    if (prepareOCSP(request, cert_local, issuer_local, header_local, url_local, timeout)) {
+        resp = process_responder(&request->retval, request_body(request), request->host,
+                                 request_path(request), request->port, request->use_ssl,
+                                 request->headers, &request->timeouts);
+        if (resp != NULL && is_traced(request))
+            count_exchange(request, resp, &request->retval);
+        if (resp != NULL)
+            finishOCSP(request, resp);
+        else
+            serve_stale(request);
+    }
+
+    OCSP_RESPONSE_free(resp);
+    freeOCSP(request);
+    return request->retval;
+}
 
 ocspCheck verifyOCSP(const char* cert_local, const char* issuer_local, const char* header_local, const char* url_local, int timeout) {
-    ocspCheck retval;
+    ocspRequest request;
+
+    return verifyOCSPRequest(&request, cert_local, issuer_local, header_local, url_local, timeout);
+}
+
+ocspCheck verifyOCSPDer(const unsigned char *cert_der, long cert_len, const unsigned char *issuer_der, long issuer_len, const char* header_local, const char* url_local, int timeout) {
+    ocspRequest request;
+
+    request.cert_der = cert_der;
+    request.cert_der_len = cert_len;
+    request.issuer_der = issuer_der;
+    request.issuer_der_len = issuer_len;
+    return verifyOCSPRequest(&request, "", "", header_local, url_local, timeout);
+}
+
+ocspCheck verifyOCSPWithIssuer(const unsigned char *cert_der, long cert_len, const std::string &issuer_handle, const char* header_local, const char* url_local, int timeout) {
+    ocspRequest request;
+
+    request.cert_der = cert_der;
+    request.cert_der_len = cert_len;
+    request.issuer_handle = issuer_handle;
+    return verifyOCSPRequest(&request, "", "", header_local, url_local, timeout);
+}
+
+ocspCheck verifyStapledOCSP(ocspRequest *r, const unsigned char *resp_der, long resp_len) {
+    OCSP_RESPONSE *resp = NULL;
+    const unsigned char *der = resp_der;
+
+    // A stapled response is all there is, a stale one cannot be refreshed.
+    // The cache is not read, the staple given is what has to be checked.
+    r->strict = 1;
+    r->refresh = 1;
+    if (prepareOCSP(r, "", "", "", NULL, -1)) {
+        resp = d2i_OCSP_RESPONSE(NULL, &der, resp_len);
+        if (resp == NULL)
+            r->retval.errorStr = "Error parsing response";
+        else
+            finishOCSP(r, resp);
+    }
+
+    OCSP_RESPONSE_free(resp);
+    freeOCSP(r);
+    return r->retval;
+}
+
+// Sends r on its own, as verifyOCSP does after prepareOCSP
+static void exchange_single(ocspRequest *r) {
+    OCSP_RESPONSE *resp;
+
+    resp = process_responder(&r->retval, request_body(r), r->host, request_path(r), r->port,
+                             r->use_ssl, r->headers, &r->timeouts);
+    if (resp != NULL && is_traced(r))
+        count_exchange(r, resp, &r->retval);
+    if (resp != NULL)
+        finishOCSP(r, resp);
+    else
+        serve_stale(r);
+    OCSP_RESPONSE_free(resp);
+}
+
+// Sends the CertIDs of entries in one request. Returns 0 when the responder
+// did not answer for all of them, so they have to be asked one by one.
+static int exchange_batch(ocspRequest **entries, size_t n) {
+    ocspRequest batch;
+    OCSP_RESPONSE *resp = NULL;
+    size_t k;
+    int j, ret = 1;
+
+    batch.req = OCSP_REQUEST_new();
+    batch.issuers = sk_X509_new_null();
+    if (batch.req == NULL || batch.issuers == NULL)
+        goto err;
+    for (k = 0; k < n; k++) {
+        OCSP_CERTID *id = OCSP_CERTID_dup(sk_OCSP_CERTID_value(entries[k]->ids, 0));
+        if (id == NULL || !OCSP_request_add0_id(batch.req, id)) {
+            OCSP_CERTID_free(id);
+            goto err;
+        }
+        // Any of the issuers may have signed the response
+        for (j = 0; j < sk_X509_num(entries[k]->issuers); j++) {
+            X509 *issuer = sk_X509_value(entries[k]->issuers, j);
+            if (!X509_up_ref(issuer))
+                goto err;
+            if (!sk_X509_push(batch.issuers, issuer)) {
+                X509_free(issuer);
+                goto err;
+            }
+        }
+    }
+    if (entries[0]->nonce)
+        OCSP_request_add1_nonce(batch.req, NULL, -1);
+    batch.host = OPENSSL_strdup(entries[0]->host);
+    batch.port = OPENSSL_strdup(entries[0]->port);
+    batch.path = OPENSSL_strdup(entries[0]->path);
+    batch.use_ssl = entries[0]->use_ssl;
+    if (batch.host == NULL || batch.port == NULL || batch.path == NULL)
+        goto err;
+    if (entries[0]->use_get)
+        batch.get_path = get_path(&batch);
+
+    resp = process_responder(&batch.retval, request_body(&batch), batch.host,
+                             request_path(&batch), batch.port, batch.use_ssl,
+                             entries[0]->headers, &entries[0]->timeouts);
+    // Every entry waited for the whole exchange, and shares its bytes
+    for (k = 0; k < n; k++) {
+        for (j = PHASE_DNS; j <= PHASE_READ; j++)
+            entries[k]->retval.timings[j] = batch.retval.timings[j];
+        if (resp != NULL && entries[k]->trace)
+            count_exchange(&batch, resp, &entries[k]->retval);
+    }
+    if (resp == NULL) {
+        // Asking again one by one would only hit the same network error
+        for (k = 0; k < n; k++) {
+            entries[k]->retval.errorStr = batch.retval.errorStr;
+            serve_stale(entries[k]);
+        }
+        goto end;
+    }
+    // Responders that only take single requests answer malformedRequest,
+    // unauthorized or the like
+    if (OCSP_response_status(resp) != OCSP_RESPONSE_STATUS_SUCCESSFUL)
+        goto err;
+
+    finishOCSPBatch(&batch, entries, n, resp);
+    for (k = 0; k < n; k++) {
+        if (entries[k]->retval.errorStr != NULL
+            && strcmp(entries[k]->retval.errorStr, "No Status found") == 0)
+            ret = 0;
+    }
+    goto end;
+
+ err:
+    ret = 0;
+ end:
+    OCSP_RESPONSE_free(resp);
+    freeOCSP(&batch);
+    return ret;
+}
+
+void verifyOCSPBatch(ocspRequest *requests, size_t n, size_t max_per_request,
+                     const char* header_local, const char* url_local, int timeout) {
+    std::vector<ocspRequest *> pending;
+    size_t i, k;
+
+    for (i = 0; i < n; i++) {
+        if (prepareOCSP(&requests[i], "", "", header_local, url_local, timeout))
+            pending.push_back(&requests[i]);
+    }
+
+    if (max_per_request == 0)
+        max_per_request = 1;
+    for (i = 0; i < pending.size(); i += max_per_request) {
+        size_t count = std::min(max_per_request, pending.size() - i);
+
+        if (count > 1 && exchange_batch(&pending[i], count))
+            continue;
+        for (k = i; k < i + count; k++) {
+            // Entries answered by the batch keep their result
+            if (count > 1 && pending[k]->retval.errorStr == NULL && pending[k]->retval.status != -1)
+                continue;
+            pending[k]->retval = ocspCheck();
+            exchange_single(pending[k]);
+        }
+    }
+
+    for (i = 0; i < n; i++)
+        freeOCSP(&requests[i]);
+}
+
+// Answers r from a response saved by an earlier process, which is only
+// trusted once it verifies now as if freshly fetched
+static int serve_snapshot(ocspRequest *r) {
+    OCSP_RESPONSE *resp;
+    std::string der;
+    const unsigned char *p;
+    int strict = r->strict;
+
+    if (!snapshot_take(r->cache_key, &der))
+        return 0;
+    p = (const unsigned char *)der.data();
+    resp = d2i_OCSP_RESPONSE(NULL, &p, (long)der.size());
+    if (resp == NULL) {
+        snapshot_verified(0);
+        return 0;
+    }
+    r->strict = 1;
+    finishOCSP(r, resp);
+    r->strict = strict;
+    OCSP_RESPONSE_free(resp);
+
+    snapshot_verified(r->retval.errorStr == NULL);
+    if (r->retval.errorStr != NULL) {
+        r->retval = ocspCheck();
+        return 0;
+    }
+    return 1;
+}
+
+int prepareOCSP(ocspRequest *r, const char* cert_local, const char* issuer_local, const char* header_local, const char* url_local, int timeout) {
     BIO *bio_issuer_synthetics = NULL, *bio_cert_synthetics = NULL;
 
-    BIO *out = NULL;
     const EVP_MD *cert_id_md = NULL;
     int trailing_md = 0;
-    OCSP_BASICRESP *bs = NULL;
-    OCSP_REQUEST *req = NULL;
-    OCSP_RESPONSE *resp = NULL;
-    STACK_OF(CONF_VALUE) *headers = NULL;
-    STACK_OF(OCSP_CERTID) *ids = NULL;
-    STACK_OF(OPENSSL_STRING) *reqnames = NULL;
-    STACK_OF(X509) *sign_other = NULL, *verify_other = NULL;
-    STACK_OF(X509) *issuers = NULL;
-    X509 *issuer = NULL, *cert = NULL;
-    X509_STORE *store = NULL;
-    X509_VERIFY_PARAM *vpm = NULL;
-    const char *CAfile = NULL, *CApath = NULL;
-    char *header, *value;
-    char *host = NULL, *port = NULL, *path = (char *)"/";
-    char *thost = NULL, *tport = NULL, *tpath = NULL;
-    int noCAfile = 0, noCApath = 0;
-    int add_nonce = 1, noverify = 0, use_ssl = -1;
-    int i, ignore_err = 0;
-    int req_text = 0, resp_text = 0, ret = 1;
-    int req_timeout = timeout;  // previous default was -1 i.e. no timeout
-    long nsec = MAX_VALIDITY_PERIOD, maxage = -1;
-    unsigned long verify_flags = 0;
+    X509 *issuer = NULL;
+    char *header = NULL, *value;
+    int add_nonce = 1, ret = 0;
 
-    ids = sk_OCSP_CERTID_new_null();
-    if (ids == NULL)
+    if (timeout != -1)
+        r->timeouts.total = timeout;
+    r->url = url_local;
+    r->header = header_local;
+    r->ids = sk_OCSP_CERTID_new_null();
+    if (r->ids == NULL)
         goto end;
 
 //     prog = opt_init(argc, argv, ocsp_options);
@@ -96,18 +475,17 @@ ocspCheck verifyOCSP(const char* cert_local, const char* issuer_local, const cha
 // #endif
 //             break;
 //         case OPT_URL:
-            OPENSSL_free(thost);
-            OPENSSL_free(tport);
-            OPENSSL_free(tpath);
-            thost = tport = tpath = NULL;
-            if (!OCSP_parse_url(url_local, &host, &port, &path, &use_ssl)) {
+            OPENSSL_free(r->host);
+            OPENSSL_free(r->port);
+            OPENSSL_free(r->path);
+            r->host = r->port = r->path = NULL;
+            // Responses obtained elsewhere, e.g. stapled, have no responder
+            if (url_local != NULL
+                && !OCSP_parse_url(url_local, &r->host, &r->port, &r->path, &r->use_ssl)) {
                 // BIO_printf(bio_err, "%s Error parsing URL\n", "prog"); // BIO_printf(bio_err, "%s Error parsing URL\n", prog);
-                retval.errorStr = "Error parsing URL";
+                r->retval.errorStr = "Error parsing URL";
                 goto end;
             }
-            thost = host;
-            tport = port;
-            tpath = path;
 //             break;
 //         case OPT_HOST:
 //             host = opt_arg();
@@ -224,31 +602,48 @@ ocspCheck verifyOCSP(const char* cert_local, const char* issuer_local, const cha
 //             path = opt_arg();
 //             break;
 //         case OPT_ISSUER:
-            bio_issuer_synthetics = BIO_new(BIO_s_mem());
-            BIO_puts(bio_issuer_synthetics, issuer_local);
-            issuer = PEM_read_bio_X509_AUX(bio_issuer_synthetics, NULL, NULL, NULL);
+            if (!r->issuer_handle.empty()) {
+                issuer = get_issuer(r->issuer_handle);
+                if (issuer == NULL) {
+                    r->retval.errorStr = "Unknown issuer";
+                    goto end;
+                }
+            } else if (r->issuer_der != NULL) {
+                const unsigned char *der = r->issuer_der;
+                issuer = d2i_X509(NULL, &der, r->issuer_der_len);
+            } else {
+                bio_issuer_synthetics = BIO_new(BIO_s_mem());
+                BIO_puts(bio_issuer_synthetics, issuer_local);
+                issuer = PEM_read_bio_X509_AUX(bio_issuer_synthetics, NULL, NULL, NULL);
+            }
             if (issuer == NULL) {
-                retval.errorStr = "Unable to load issuer certificate";
+                r->retval.errorStr = "Unable to load issuer certificate";
                 goto end;
             }
-            if (issuers == NULL) {
-                if ((issuers = sk_X509_new_null()) == NULL)
+            if (r->issuers == NULL) {
+                if ((r->issuers = sk_X509_new_null()) == NULL)
                     goto end;
             }
-            sk_X509_push(issuers, issuer);
+            sk_X509_push(r->issuers, issuer);
 //             break;
 //         case OPT_CERT:
-            X509_free(cert);
-            bio_cert_synthetics = BIO_new(BIO_s_mem());
-            BIO_puts(bio_cert_synthetics, cert_local);
-            cert = PEM_read_bio_X509_AUX(bio_cert_synthetics, NULL, NULL, NULL);
-            if (cert == NULL) {
-                retval.errorStr = "Unable to load certificate";
+            X509_free(r->cert);
+            if (r->cert_der != NULL) {
+                const unsigned char *der = r->cert_der;
+                r->cert = d2i_X509(NULL, &der, r->cert_der_len);
+            } else {
+                bio_cert_synthetics = BIO_new(BIO_s_mem());
+                BIO_puts(bio_cert_synthetics, cert_local);
+                r->cert = PEM_read_bio_X509_AUX(bio_cert_synthetics, NULL, NULL, NULL);
+            }
+            if (r->cert == NULL) {
+                r->retval.errorStr = "Unable to load certificate";
                 goto end;
             }
             if (cert_id_md == NULL)
                 cert_id_md = EVP_sha1();
-            if (!add_ocsp_cert(&retval, &req, cert, cert_id_md, issuer, ids)) {
+            if (!add_ocsp_cert(&r->retval, &r->req, r->cert, cert_id_md, issuer,
+                               r->issuer_handle, r->ids)) {
                 goto end;
             }
             // if (!sk_OPENSSL_STRING_push(reqnames, opt_arg()))
@@ -301,18 +696,21 @@ ocspCheck verifyOCSP(const char* cert_local, const char* issuer_local, const cha
 //                 goto end;
 //             break;
 //         case OPT_HEADER:
-            header = new char[strlen(header_local)];
-            strcpy(header, header_local);
-            // header = header_local;
-            value = strchr(header, '=');
-            if (value == NULL) {
-                // BIO_printf(bio_err, "Missing = in header key=value\n");
-                retval.errorStr = "Missing = in header key=value";
-                goto end;  // goto opthelp;
+            if (url_local != NULL) {
+                header = OPENSSL_strdup(header_local);
+                if (header == NULL)
+                    goto end;
+                // header = header_local;
+                value = strchr(header, '=');
+                if (value == NULL) {
+                    // BIO_printf(bio_err, "Missing = in header key=value\n");
+                    r->retval.errorStr = "Missing = in header key=value";
+                    goto end;  // goto opthelp;
+                }
+                *value++ = '\0';
+                if (!X509V3_add_value(header, value, &r->headers))
+                    goto end;
             }
-            *value++ = '\0';
-            if (!X509V3_add_value(header, value, &headers))
-                goto end;
 //             break;
 //         case OPT_MD:
 //             if (trailing_md) {
@@ -333,23 +731,98 @@ ocspCheck verifyOCSP(const char* cert_local, const char* issuer_local, const cha
 //         }
 //     }
 
-    out = BIO_new_fp(stdout, BIO_NOCLOSE | BIO_FP_TEXT);  // out = bio_open_default(outfile, 'w', FORMAT_TEXT);
-    if (out == NULL)
+    if (r->trace)
+        r->cert_id = certid_hex(sk_OCSP_CERTID_value(r->ids, 0));
+
+    if (r->key_only) {
+        ret = certid_key(sk_OCSP_CERTID_value(r->ids, 0), &r->cache_key);
         goto end;
+    }
 
-    if (req != NULL && add_nonce)
-        OCSP_request_add1_nonce(req, NULL, -1);
+    if (certid_key(sk_OCSP_CERTID_value(r->ids, 0), &r->cache_key) && !r->refresh) {
+        if (cache_lookup(r->cache_key, r->nsec, &r->retval))
+            r->retval.cache = CACHE_HIT;
+        else if (serve_snapshot(r))
+            r->retval.cache = CACHE_SNAPSHOT;
+        if (r->retval.cache != CACHE_MISS)
+            goto end;
+    }
 
-    if (req_text && req != NULL)
-        OCSP_REQUEST_print(out, req, 0);
+    if (r->nonce == -1)
+        r->nonce = request_nonce;
+    if (r->use_get == -1)
+        r->use_get = request_get;
+    add_nonce = r->nonce;
+    resolve_timeouts(&r->timeouts);
 
-    if (host != NULL) {
-        resp = process_responder(&retval, req, host, path,
-                                 port, use_ssl, headers, req_timeout);
-        if (resp == NULL)
-            goto end;
+    // A response not fetched for this request cannot echo its nonce
+    if (r->req != NULL && add_nonce && url_local != NULL)
+        OCSP_request_add1_nonce(r->req, NULL, -1);
+
+    if (r->req != NULL && r->use_get && r->host != NULL)
+        set_get_path(r);
+
+    ret = url_local == NULL || r->host != NULL;
+
+ end:
+    BIO_free(bio_issuer_synthetics);
+    BIO_free(bio_cert_synthetics);
+    // X509V3_add_value keeps copies
+    OPENSSL_free(header);
+    return ret;
+}
+
+void finishOCSP(ocspRequest *r, OCSP_RESPONSE *resp) {
+    finishOCSPBatch(r, &r, 1, resp);
+}
+
+// OCSP_basic_verify, falling back to trusting the issuers. A signer that
+// passed for the same CAs and store before only has its signature checked.
+static int basic_verify(OCSP_BASICRESP *bs, STACK_OF(X509) *verify_other,
+                        STACK_OF(X509) *issuers, X509_STORE *store,
+                        unsigned long verify_flags) {
+    X509 *signer = NULL;
+    std::string key;
+    int i;
+
+    if (!OCSP_resp_get0_signer(bs, &signer, issuers) || !signer_key(bs, signer, &key))
+        key.clear();
+    if (!key.empty() && signer_verified(store, key)) {
+        signer_count(1);
+        return OCSP_basic_verify(bs, issuers, store, OCSP_NOVERIFY);
     }
 
+    signer_count(0);
+    i = OCSP_basic_verify(bs, verify_other, store, verify_flags);
+    if (i <= 0 && issuers) {
+        i = OCSP_basic_verify(bs, issuers, store, OCSP_TRUSTOTHER);
+        if (i > 0) {
+            // ERR_clear_error();
+        }
+
+    }
+    if (i > 0 && !key.empty())
+        signer_remember(store, key, signer);
+    return i;
+}
+
+void finishOCSPBatch(ocspRequest *r, ocspRequest **entries, size_t n, OCSP_RESPONSE *resp) {
+    BIO *out = NULL;
+    size_t k;
+    OCSP_BASICRESP *bs = NULL;
+    STACK_OF(OPENSSL_STRING) *reqnames = NULL;
+    STACK_OF(X509) *verify_other = NULL;
+    X509_STORE *store = NULL;
+    int noverify = 0;
+    int i, ignore_err = 0;
+    int resp_text = 0, ret = 1;
+    unsigned long verify_flags = 0;
+    steady_clock::time_point begun = steady_clock::now();
+
+    out = BIO_new_fp(stdout, BIO_NOCLOSE | BIO_FP_TEXT);  // out = bio_open_default(outfile, 'w', FORMAT_TEXT);
+    if (out == NULL)
+        goto end;
+
     i = OCSP_response_status(resp);
     if (i != OCSP_RESPONSE_STATUS_SUCCESSFUL) {
         BIO_printf(out, "Responder Error: %s (%d)\n",
@@ -362,7 +835,7 @@ ocspCheck verifyOCSP(const char* cert_local, const char* issuer_local, const cha
         OCSP_RESPONSE_print(out, resp, 0);
 
     if (store == NULL) {
-        store = setup_verify(&retval, CAfile, CApath, noCAfile, noCApath);
+        store = get_shared_store(&r->retval);
         if (!store)
             goto end;
     }
@@ -370,70 +843,89 @@ ocspCheck verifyOCSP(const char* cert_local, const char* issuer_local, const cha
     bs = OCSP_response_get1_basic(resp);
     if (bs == NULL) {
         // BIO_printf(bio_err, "Error parsing response\n");
-        retval.errorStr = "Error parsing response";
+        r->retval.errorStr = "Error parsing response";
         goto end;
     }
 
     ret = 0;
 
     if (!noverify) {
-        if (req != NULL && ((i = OCSP_check_nonce(req, bs)) <= 0)) {
+        if (r->req != NULL && ((i = OCSP_check_nonce(r->req, bs)) <= 0)) {
             if (i == -1) {
                 // BIO_printf(bio_err, "WARNING: no nonce in response\n");
                 // retval.errorStr = "WARNING: no nonce in response";
             } else {
                 // BIO_printf(bio_err, "Nonce Verify error\n");
-                retval.errorStr = "Nonce Verify error";
+                r->retval.errorStr = "Nonce Verify error";
                 ret = 1;
                 goto end;
             }
         }
 
-        i = OCSP_basic_verify(bs, verify_other, store, verify_flags);
-        if (i <= 0 && issuers) {
-            i = OCSP_basic_verify(bs, issuers, store, OCSP_TRUSTOTHER);
-            if (i > 0) {
-                // ERR_clear_error();
-            }
-
-        }
+        i = basic_verify(bs, verify_other, r->issuers, store, verify_flags);
         if (i <= 0) {
             // BIO_printf(bio_err, "Response Verify Failure\n");
             // ERR_print_errors(bio_err);
             ret = 1;
+            if (r->strict) {
+                r->retval.errorStr = "Response Verify Failure";
+                goto end;
+            }
         } else {
             // BIO_printf(bio_err, "Response verify OK\n");
         }
     }
 
-    print_ocsp_summary(&retval, out, bs, req, reqnames, ids, nsec, maxage);
+    for (k = 0; k < n; k++) {
+        ocspRequest *e = entries[k];
+
+        print_ocsp_summary(&e->retval, out, bs, r->req, reqnames, e->ids, e->nsec, e->maxage,
+                           e->strict);
+
+        // Only responses that passed both nonce and signature checks are reused
+        if (!noverify && ret == 0 && e->retval.errorStr == NULL && !e->cache_key.empty()) {
+            cache_add(e->cache_key, resp, bs, sk_OCSP_CERTID_value(e->ids, 0), &e->retval, e->nsec, e->maxage);
+            if (e->url != NULL)
+                refresh_track(e);
+        }
+    }
 
  end:
+    // Errors about the response as a whole apply to every entry
+    for (k = 0; k < n && r->retval.errorStr != NULL; k++) {
+        if (entries[k]->retval.errorStr == NULL)
+            entries[k]->retval.errorStr = r->retval.errorStr;
+    }
+    for (k = 0; k < n; k++)
+        entries[k]->retval.timings[PHASE_VERIFY] = latency_us(begun, steady_clock::now());
     // ERR_print_errors(bio_err);
     X509_STORE_free(store);
-    X509_VERIFY_PARAM_free(vpm);
-    X509_free(cert);
-    sk_X509_pop_free(issuers, X509_free);
     BIO_free_all(out);
-    OCSP_REQUEST_free(req);
-    OCSP_RESPONSE_free(resp);
     OCSP_BASICRESP_free(bs);
     sk_OPENSSL_STRING_free(reqnames);
-    sk_OCSP_CERTID_free(ids);
-    sk_X509_pop_free(sign_other, X509_free);
     sk_X509_pop_free(verify_other, X509_free);
-    sk_CONF_VALUE_pop_free(headers, X509V3_conf_free);
-    OPENSSL_free(thost);
-    OPENSSL_free(tport);
-    OPENSSL_free(tpath);
+}
 
-    BIO_free(bio_issuer_synthetics);
-    BIO_free(bio_cert_synthetics);
-    return retval;
+void freeOCSP(ocspRequest *r) {
+    X509_free(r->cert);
+    sk_X509_pop_free(r->issuers, X509_free);
+    OCSP_REQUEST_free(r->req);
+    sk_OCSP_CERTID_free(r->ids);
+    sk_CONF_VALUE_pop_free(r->headers, X509V3_conf_free);
+    OPENSSL_free(r->host);
+    OPENSSL_free(r->port);
+    OPENSSL_free(r->path);
+    r->cert = NULL;
+    r->issuers = NULL;
+    r->req = NULL;
+    r->ids = NULL;
+    r->headers = NULL;
+    r->host = r->port = r->path = NULL;
 }
 
 static int add_ocsp_cert(ocspCheck *retval, OCSP_REQUEST **req, X509 *cert,
                          const EVP_MD *cert_id_md, X509 *issuer,
+                         const std::string &issuer_handle,
                          STACK_OF(OCSP_CERTID) *ids)
 {
     OCSP_CERTID *id;
@@ -447,7 +939,11 @@ static int add_ocsp_cert(ocspCheck *retval, OCSP_REQUEST **req, X509 *cert,
         *req = OCSP_REQUEST_new();
     if (*req == NULL)
         goto err;
-    id = OCSP_cert_to_id(cert_id_md, cert, issuer);
+    // Registered issuers have their name and key hashes precomputed
+    if (!issuer_handle.empty())
+        id = issuer_cert_id(issuer_handle, cert_id_md, cert);
+    else
+        id = OCSP_cert_to_id(cert_id_md, cert, issuer);
     if (id == NULL || !sk_OCSP_CERTID_push(ids, id))
         goto err;
     if (!OCSP_request_add0_id(*req, id))
@@ -460,15 +956,24 @@ static int add_ocsp_cert(ocspCheck *retval, OCSP_REQUEST **req, X509 *cert,
     return 0;
 }
 
+// Milliseconds since the epoch, 0 for a time that is absent or invalid
+static int64_t epoch_ms(const ASN1_GENERALIZEDTIME *t)
+{
+    time_t epoch;
+
+    if (!asn1_time_to_epoch(t, &epoch))
+        return 0;
+    return (int64_t)epoch * 1000;
+}
+
 static void print_ocsp_summary(ocspCheck *retval, BIO *out, OCSP_BASICRESP *bs, OCSP_REQUEST *req,
                               STACK_OF(OPENSSL_STRING) *names,
                               STACK_OF(OCSP_CERTID) *ids, long nsec,
-                              long maxage)
+                              long maxage, int strict)
 {
-    BIO *thisupd_bio = NULL, *nextupd_bio = NULL, *revoked_bio = NULL;
     OCSP_CERTID *id;
     const char *name;
-    int i, status, reason;
+    int i, status, reason = -1;
     ASN1_GENERALIZEDTIME *rev, *thisupd, *nextupd;
 
     if (bs == NULL || req == NULL || !sk_OPENSSL_STRING_num(names)
@@ -483,7 +988,8 @@ static void print_ocsp_summary(ocspCheck *retval, BIO *out, OCSP_BASICRESP *bs,
         if (!OCSP_resp_find_status(bs, id, &status, &reason,
                                    &rev, &thisupd, &nextupd)) {
             // BIO_puts(out, "ERROR: No Status found.\n");
-            continue;
+            retval->errorStr = "No Status found";
+            return;
         }
 
         /*
@@ -493,22 +999,22 @@ static void print_ocsp_summary(ocspCheck *retval, BIO *out, OCSP_BASICRESP *bs,
         if (!OCSP_check_validity(thisupd, nextupd, nsec, maxage)) {
             // BIO_puts(out, "WARNING: Status times invalid.\n");
             // ERR_print_errors(out);
+            if (strict) {
+                retval->errorStr = "Status times invalid";
+                return;
+            }
         }
         // BIO_printf(out, "%s\n", OCSP_cert_status_str(status));
 
         // BIO_puts(out, "\tThis Update: ");
         // ASN1_GENERALIZEDTIME_print(out, thisupd);
         // BIO_puts(out, "\n");
-        thisupd_bio = BIO_new(BIO_s_mem());
-        ASN1_GENERALIZEDTIME_print(thisupd_bio, thisupd);
-
-        if (nextupd) {
-            // BIO_puts(out, "\tNext Update: ");
-            // ASN1_GENERALIZEDTIME_print(out, nextupd);
-            // BIO_puts(out, "\n");
-            nextupd_bio = BIO_new(BIO_s_mem());
-            ASN1_GENERALIZEDTIME_print(nextupd_bio, nextupd);
-        }
+        retval->thisupd = epoch_ms(thisupd);
+
+        // BIO_puts(out, "\tNext Update: ");
+        // ASN1_GENERALIZEDTIME_print(out, nextupd);
+        // BIO_puts(out, "\n");
+        retval->nextupd = epoch_ms(nextupd);
 
         if (status != V_OCSP_CERTSTATUS_REVOKED)
             continue;
@@ -519,115 +1025,190 @@ static void print_ocsp_summary(ocspCheck *retval, BIO *out, OCSP_BASICRESP *bs,
         // BIO_puts(out, "\tRevocation Time: ");
         // ASN1_GENERALIZEDTIME_print(out, rev);
         // BIO_puts(out, "\n");
-        revoked_bio = BIO_new(BIO_s_mem());
-        ASN1_GENERALIZEDTIME_print(revoked_bio, rev);
+        retval->revoked = epoch_ms(rev);
     }
     retval->reason = reason;
     retval->reasonStr = OCSP_crl_reason_str(reason);
     retval->status = status;
     retval->statusStr = OCSP_cert_status_str(status);
-    const int bufsize = 64; // large enough buffer to get all bio at once
-    if (!(thisupd_bio == NULL)) {
-        retval->thisupdStr = new char[bufsize];
-        BIO_gets(thisupd_bio, retval->thisupdStr, bufsize);
-        BIO_free(thisupd_bio);
-    }
-    if (!(nextupd_bio == NULL)) {
-        retval->nextupdStr = new char[bufsize];
-        BIO_gets(nextupd_bio, retval->nextupdStr, bufsize);
-        BIO_free(nextupd_bio);
+}
+
+OCSP_REQ_CTX *new_request_ctx(BIO *cbio, const char *host, const char *path,
+                              const STACK_OF(CONF_VALUE) *headers,
+                              OCSP_REQUEST *req, int keep_alive)
+{
+    int i;
+    int add_host = 1;
+    int add_connection = keep_alive;
+    OCSP_REQ_CTX *ctx = NULL;
+
+    if (req != NULL)
+        ctx = OCSP_sendreq_new(cbio, path, NULL, -1);
+    else
+        ctx = OCSP_REQ_CTX_new(cbio, 0);
+    if (ctx == NULL)
+        return NULL;
+    if (req == NULL && !OCSP_REQ_CTX_http(ctx, "GET", path))
+        goto err;
+
+    for (i = 0; i < sk_CONF_VALUE_num(headers); i++) {
+        CONF_VALUE *hdr = sk_CONF_VALUE_value(headers, i);
+        if (add_host == 1 && strcasecmp("host", hdr->name) == 0)
+            add_host = 0;
+        if (add_connection == 1 && strcasecmp("connection", hdr->name) == 0)
+            add_connection = 0;
+        if (!OCSP_REQ_CTX_add1_header(ctx, hdr->name, hdr->value))
+            goto err;
     }
-    if (!(revoked_bio == NULL)) {
-        retval->revokedStr = new char[bufsize];
-        BIO_gets(revoked_bio, retval->revokedStr, bufsize);
-        BIO_free(revoked_bio);
+
+    if (add_host == 1 && OCSP_REQ_CTX_add1_header(ctx, "Host", host) == 0)
+        goto err;
+
+    // OCSP_REQ_CTX speaks HTTP/1.0, which closes the connection unless asked not to
+    if (add_connection == 1 && OCSP_REQ_CTX_add1_header(ctx, "Connection", "keep-alive") == 0)
+        goto err;
+
+    // A GET request ends with its headers
+    if (req != NULL && !OCSP_REQ_CTX_set1_req(ctx, req))
+        goto err;
+
+    return ctx;
+
+ err:
+    OCSP_REQ_CTX_free(ctx);
+    return NULL;
+}
+
+// End of a phase starting now with a budget of ms, never later than the
+// end of the total budget
+static steady_clock::time_point phase_end(long ms, steady_clock::time_point total_end)
+{
+    if (ms <= 0)
+        return total_end;
+    return std::min(total_end, steady_clock::now() + std::chrono::milliseconds(ms));
+}
+
+// Waits until bio can go on, or until end. Returns what select() did.
+static int wait_bio(BIO *bio, int fd, steady_clock::time_point end)
+{
+    fd_set confds;
+    struct timeval tv, *tvp = NULL;
+
+    if (end != steady_clock::time_point::max()) {
+        long long left = std::chrono::duration_cast<std::chrono::microseconds>(
+            end - steady_clock::now()).count();
+        if (left <= 0)
+            return 0;
+        tv.tv_sec = (long)(left / 1000000);
+        tv.tv_usec = (long)(left % 1000000);
+        tvp = &tv;
     }
+    FD_ZERO(&confds);
+    openssl_fdset(fd, &confds);
+    // A pending connect() reports completion as writable
+    if (BIO_should_read(bio))
+        return select(fd + 1, &confds, NULL, NULL, tvp);  // used to be (void *)&confds
+    return select(fd + 1, NULL, &confds, NULL, tvp);  // used to be (void *)&confds
 }
 
 static OCSP_RESPONSE *query_responder(ocspCheck *retval, BIO *cbio, const char *host,
                                       const char *path,
                                       const STACK_OF(CONF_VALUE) *headers,
-                                      OCSP_REQUEST *req, int req_timeout)
+                                      OCSP_REQUEST *req, const ocspTimeouts *timeouts,
+                                      steady_clock::time_point connect_end,
+                                      steady_clock::time_point total_end,
+                                      int keep_alive, int *connected)
 {
     int fd;
     int rv;
-    int i;
-    int add_host = 1;
     OCSP_REQ_CTX *ctx = NULL;
     OCSP_RESPONSE *rsp = NULL;
-    fd_set confds;
-    struct timeval tv;
-
-    if (req_timeout != -1)
-        BIO_set_nbio(cbio, 1);
+    BIO *conn = BIO_find_type(cbio, BIO_TYPE_CONNECT);
+    steady_clock::time_point begun, end;
 
-    rv = BIO_do_connect(cbio);
+    BIO_set_nbio(cbio, 1);
 
-    if ((rv <= 0) && ((req_timeout == -1) || !BIO_should_retry(cbio))) {
-        // BIO_puts(bio_err, "Error connecting BIO\n");
-        retval->errorStr = "Error connecting BIO";
-        return NULL;
+    // TCP and TLS are set up one after the other so each has its own budget
+    begun = steady_clock::now();
+    end = connect_end;
+    for (;;) {
+        rv = BIO_do_connect(conn != NULL ? conn : cbio);
+        if (rv > 0)
+            break;
+        if (!BIO_should_retry(conn != NULL ? conn : cbio)) {
+            // BIO_puts(bio_err, "Error connecting BIO\n");
+            retval->errorStr = "Error connecting BIO";
+            return NULL;
+        }
+        if (BIO_get_fd(cbio, &fd) < 0) {
+            // BIO_puts(bio_err, "Can't get connection fd\n");
+            retval->errorStr = "Can't get connection fd";
+            return NULL;
+        }
+        rv = wait_bio(conn != NULL ? conn : cbio, fd, end);
+        if (rv == 0) {
+            // BIO_puts(bio_err, "Timeout on connect\n");
+            retval->errorStr = "Timeout on connect";
+            return NULL;
+        }
+        if (rv == -1) {
+            retval->errorStr = "Select error";
+            return NULL;
+        }
     }
 
+    retval->timings[PHASE_CONNECT] = latency_us(begun, steady_clock::now());
+    *connected = 1;
+
     if (BIO_get_fd(cbio, &fd) < 0) {
         // BIO_puts(bio_err, "Can't get connection fd\n");
         retval->errorStr = "Can't get connection fd";
-        goto err;
+        return NULL;
     }
 
-    if (req_timeout != -1 && rv <= 0) {
-        FD_ZERO(&confds);
-        openssl_fdset(fd, &confds);
-        tv.tv_usec = 0;
-        tv.tv_sec = req_timeout;
-        rv = select(fd + 1, NULL, &confds, NULL, &tv);  // used to be (void *)&confds
-        if (rv == 0) {
-            // BIO_puts(bio_err, "Timeout on connect\n");
-            retval->errorStr = "Timeout on connect";
-            return NULL;
+    if (conn != NULL && conn != cbio) {
+        begun = steady_clock::now();
+        end = phase_end(timeouts->tls, total_end);
+        for (;;) {
+            rv = BIO_do_handshake(cbio);
+            if (rv > 0)
+                break;
+            if (!BIO_should_retry(cbio)) {
+                retval->errorStr = "Error connecting BIO";
+                return NULL;
+            }
+            rv = wait_bio(cbio, fd, end);
+            if (rv == 0) {
+                retval->errorStr = "Timeout on TLS";
+                return NULL;
+            }
+            if (rv == -1) {
+                retval->errorStr = "Select error";
+                return NULL;
+            }
         }
+        retval->timings[PHASE_TLS] = latency_us(begun, steady_clock::now());
     }
 
-    ctx = OCSP_sendreq_new(cbio, path, NULL, -1);
+    ctx = new_request_ctx(cbio, host, path, headers, req, keep_alive);
     if (ctx == NULL)
         return NULL;
 
-    for (i = 0; i < sk_CONF_VALUE_num(headers); i++) {
-        CONF_VALUE *hdr = sk_CONF_VALUE_value(headers, i);
-        if (add_host == 1 && strcasecmp("host", hdr->name) == 0)
-            add_host = 0;
-        if (!OCSP_REQ_CTX_add1_header(ctx, hdr->name, hdr->value))
-            goto err;
-    }
-
-    if (add_host == 1 && OCSP_REQ_CTX_add1_header(ctx, "Host", host) == 0)
-        goto err;
-
-    if (!OCSP_REQ_CTX_set1_req(ctx, req))
-        goto err;
-
+    begun = steady_clock::now();
+    end = phase_end(timeouts->read, total_end);
     for (;;) {
         rv = OCSP_sendreq_nbio(&rsp, ctx);
         if (rv != -1)
             break;
-        if (req_timeout == -1)
-            continue;
-        FD_ZERO(&confds);
-        openssl_fdset(fd, &confds);
-        tv.tv_usec = 0;
-        tv.tv_sec = req_timeout;
-        if (BIO_should_read(cbio)) {
-            rv = select(fd + 1, &confds, NULL, NULL, &tv);  // used to be (void *)&confds
-        } else if (BIO_should_write(cbio)) {
-            rv = select(fd + 1, NULL, &confds, NULL, &tv);  // used to be (void *)&confds
-        } else {
+        if (!BIO_should_read(cbio) && !BIO_should_write(cbio)) {
             // BIO_puts(bio_err, "Unexpected retry condition\n");
             retval->errorStr = "Unexpected retry condition";
             goto err;
         }
+        rv = wait_bio(cbio, fd, end);
         if (rv == 0) {
             // BIO_puts(bio_err, "Timeout on request\n");
-            retval->errorStr = "Timeout on request";
+            retval->errorStr = "Timeout on read";
             break;
         }
         if (rv == -1) {
@@ -637,20 +1218,108 @@ static OCSP_RESPONSE *query_responder(ocspCheck *retval, BIO *cbio, const char *
         }
 
     }
+    if (rsp != NULL)
+        retval->timings[PHASE_READ] = latency_us(begun, steady_clock::now());
  err:
     OCSP_REQ_CTX_free(ctx);
     return rsp;
 }
 
-OCSP_RESPONSE *process_responder(ocspCheck *retval, OCSP_REQUEST *req,
-                                 const char *host, const char *path,
-                                 const char *port, int use_ssl,
-                                 STACK_OF(CONF_VALUE) *headers,
-                                 int req_timeout)
+// Numeric addresses of host, empty if it does not resolve
+static std::vector<std::string> lookup_addresses(const char *host, const char *port)
+{
+    std::vector<std::string> addresses;
+    BIO_ADDRINFO *res = NULL;
+    const BIO_ADDRINFO *ai;
+
+    if (BIO_lookup(host, port, BIO_LOOKUP_CLIENT, AF_UNSPEC, SOCK_STREAM, &res)) {
+        for (ai = res; ai != NULL; ai = BIO_ADDRINFO_next(ai)) {
+            char *numeric = BIO_ADDR_hostname_string(BIO_ADDRINFO_address(ai), 1);
+            if (numeric == NULL)
+                continue;
+            // BIO_new_connect takes host:port, IPv6 literals need brackets
+            if (strchr(numeric, ':') != NULL)
+                addresses.push_back(std::string("[") + numeric + "]");
+            else
+                addresses.push_back(numeric);
+            OPENSSL_free(numeric);
+        }
+    }
+    BIO_ADDRINFO_free(res);
+    return addresses;
+}
+
+// A lookup given its own thread, as getaddrinfo cannot be interrupted, so
+// its caller can give up on it at the deadline. The thread may outlive
+// the caller.
+struct dnsLookup {
+    std::mutex lock;
+    std::condition_variable done_cv;
+    int done = 0;
+    std::vector<std::string> addresses;
+};
+
+// Resolves host on its own so the lookup has its own budget, waiting at
+// most until end. Literal addresses need no lookup and are not handed to a
+// thread. Every address is kept so a connect that fails can move on to the
+// next.
+static int resolve_responder(ocspCheck *retval, const char *host, const char *port,
+                             steady_clock::time_point end,
+                             std::vector<std::string> *addresses)
+{
+    unsigned char literal[sizeof(struct in6_addr)];
+
+    addresses->clear();
+    if (end == steady_clock::time_point::max() || inet_pton(AF_INET, host, literal) == 1
+        || inet_pton(AF_INET6, host, literal) == 1) {
+        *addresses = lookup_addresses(host, port);
+    } else {
+        std::shared_ptr<dnsLookup> lookup = std::make_shared<dnsLookup>();
+        std::string name = host;
+        std::string service = port != NULL ? port : "";
+        std::thread([lookup, name, service]() {
+            std::vector<std::string> found =
+                lookup_addresses(name.c_str(), service.empty() ? NULL : service.c_str());
+            ERR_clear_error();
+            std::lock_guard<std::mutex> guard(lookup->lock);
+            lookup->addresses.swap(found);
+            lookup->done = 1;
+            lookup->done_cv.notify_one();
+        }).detach();
+
+        std::unique_lock<std::mutex> guard(lookup->lock);
+        if (!lookup->done_cv.wait_until(guard, end, [&lookup]() { return lookup->done != 0; })) {
+            retval->errorStr = "Timeout on DNS";
+            return 0;
+        }
+        addresses->swap(lookup->addresses);
+    }
+    if (addresses->empty()) {
+        retval->errorStr = "Error connecting BIO";
+        return 0;
+    }
+    if (steady_clock::now() >= end) {
+        retval->errorStr = "Timeout on DNS";
+        return 0;
+    }
+    return 1;
+}
+
+// End of one of left connect attempts sharing what remains before end
+static steady_clock::time_point attempt_end(steady_clock::time_point end, size_t left)
+{
+    steady_clock::time_point now = steady_clock::now();
+
+    if (end == steady_clock::time_point::max() || end <= now || left <= 1)
+        return end;
+    return now + (end - now) / (long)left;
+}
+
+BIO *new_responder_bio(ocspCheck *retval, const char *host,
+                       const char *port, int use_ssl)
 {
     BIO *cbio = NULL;
     SSL_CTX *ctx = NULL;
-    OCSP_RESPONSE *resp = NULL;
 
     cbio = BIO_new_connect(host);
     if (cbio == NULL) {
@@ -666,6 +1335,8 @@ OCSP_RESPONSE *process_responder(ocspCheck *retval, OCSP_REQUEST *req,
         if (ctx == NULL) {
             // BIO_printf(bio_err, "Error creating SSL context.\n");
             retval->errorStr = "Error creating SSL context.";
+            BIO_free_all(cbio);
+            cbio = NULL;
             goto end;
         }
         SSL_CTX_set_mode(ctx, SSL_MODE_AUTO_RETRY);
@@ -673,13 +1344,117 @@ OCSP_RESPONSE *process_responder(ocspCheck *retval, OCSP_REQUEST *req,
         cbio = BIO_push(sbio, cbio);
     }
 
-    resp = query_responder(retval, cbio, host, path, headers, req, req_timeout);
-    if (resp == NULL) {
+ end:
+    // the SSL object keeps its own reference to ctx
+    SSL_CTX_free(ctx);
+    return cbio;
+}
+
+OCSP_RESPONSE *process_responder(ocspCheck *retval, OCSP_REQUEST *req,
+                                 const char *host, const char *path,
+                                 const char *port, int use_ssl,
+                                 STACK_OF(CONF_VALUE) *headers,
+                                 const ocspTimeouts *timeouts)
+{
+    BIO *cbio = NULL;
+    OCSP_RESPONSE *resp = NULL;
+    int pooled = pool_enabled();
+    int reused = 0, slot = 0;
+    steady_clock::time_point started, total_end, connect_end;
+    std::vector<std::string> addresses;
+    size_t next = 0;
+    int connected;
+
+    if (!breaker_allow(host, port, use_ssl)) {
+        retval->errorStr = "Responder circuit open";
+        return NULL;
+    }
+    started = steady_clock::now();
+    // Retries on a new connection share the deadline
+    total_end = timeouts->total > 0
+        ? started + std::chrono::milliseconds(timeouts->total)
+        : steady_clock::time_point::max();
+
+ again:
+    // Waiting for a connection to the host to come back counts as connecting
+    if (pooled) {
+        if (!pool_checkout(host, port, use_ssl, phase_end(timeouts->connect, total_end),
+                           &cbio, &reused)) {
+            retval->errorStr = "Timeout on connect";
+            goto failed;
+        }
+        slot = 1;
+    }
+    if (cbio == NULL) {
+        steady_clock::time_point begun = steady_clock::now();
+        if (!resolve_responder(retval, host, port, phase_end(timeouts->dns, total_end), &addresses))
+            goto failed;
+        retval->timings[PHASE_DNS] = latency_us(begun, steady_clock::now());
+        next = 0;
+    }
+    connect_end = phase_end(timeouts->connect, total_end);
+
+ connect:
+    if (cbio == NULL) {
+        cbio = new_responder_bio(retval, addresses[next].c_str(), port, use_ssl);
+        if (cbio == NULL)
+            goto end;
+        if (pooled)
+            pool_opened();
+    }
+
+    // The connect budget is split between the addresses left to try
+    connected = 0;
+    resp = query_responder(retval, cbio, host, path, headers, req, timeouts,
+                           reused ? connect_end : attempt_end(connect_end, addresses.size() - next),
+                           total_end, pooled, &connected);
+    // A reused connection was set up by an earlier exchange
+    if (reused) {
+        retval->timings[PHASE_DNS] = 0;
+        retval->timings[PHASE_CONNECT] = 0;
+        retval->timings[PHASE_TLS] = 0;
+    }
+
+    // An address that cannot be reached gives way to the next one, keeping
+    // the pool slot, as long as the connect budget lasts
+    if (resp == NULL && !reused && !connected && next + 1 < addresses.size() &&
+        steady_clock::now() < connect_end) {
+        BIO_free_all(cbio);
+        cbio = NULL;
+        next++;
+        retval->errorStr = NULL;
+        ERR_clear_error();
+        goto connect;
+    }
+
+    // Only a connection whose response was read completely can carry another request
+    if (pooled)
+        pool_checkin(host, port, use_ssl, cbio, resp != NULL);
+    else
+        BIO_free_all(cbio);
+    cbio = NULL;
+    slot = 0;
+
+    // The responder may have closed a reused connection after the health
+    // check, in that case try again before reporting an error
+    if (resp == NULL && reused && !is_timeout(retval->errorStr)) {
+        retval->errorStr = NULL;
+        goto again;
+    }
+
+ failed:
+    // Timeouts keep naming the phase that ran out
+    if (resp == NULL && !is_timeout(retval->errorStr)) {
         // BIO_printf(bio_err, "Error querying OCSP responder\n");
         retval->errorStr = "Error querying OCSP responder";
     }
 
  end:
-    SSL_CTX_free(ctx);
+    // A slot taken for a connection that was never opened
+    if (slot)
+        pool_checkin(host, port, use_ssl, NULL, 0);
+    breaker_report(host, port, use_ssl, resp != NULL,
+                   std::chrono::duration<double, std::milli>(
+                       steady_clock::now() - started).count());
     return resp;
 }
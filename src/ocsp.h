@@ -1,3 +1,6 @@
+#ifndef OCSP_OCSP_H
+#define OCSP_OCSP_H
+
 /*
  * Copyright 2001-2019 The OpenSSL Project Authors. All Rights Reserved.
  *
@@ -7,7 +10,11 @@
  * https://www.openssl.org/source/license.html
  */
 
+#include <atomic>
+#include <string>
+
 #include <openssl/ocsp.h>
+#include <openssl/x509v3.h>
 
 #include "helper.h"
 
@@ -18,11 +25,155 @@
 #  define openssl_fdset(a,b) FD_SET(a, b)
 # endif
 
+// Time budgets of one responder exchange in milliseconds, 0 for none and
+// -1 to follow configure_requests. Each phase ends at an absolute deadline,
+// never later than the end of the total budget.
+struct ocspTimeouts {
+    long total = -1;
+    long dns = -1;
+    long connect = -1;
+    long tls = -1;
+    // sending the request and reading the response
+    long read = -1;
+};
+
 // https://github.com/openssl/openssl/blob/OpenSSL_1_1_1/apps/apps.h#L494-L498
 OCSP_RESPONSE *process_responder(ocspCheck *retval, OCSP_REQUEST *req,
                                  const char *host, const char *path,
                                  const char *port, int use_ssl,
                                  STACK_OF(CONF_VALUE) *headers,
-                                 int req_timeout);
+                                 const ocspTimeouts *timeouts);
+
+/* Maximum leeway in validity period: default 5 minutes */
+# define MAX_VALIDITY_PERIOD    (5 * 60)
+
+// State of one lookup, from parsing its inputs to verifying the response
+struct ocspRequest {
+    ocspCheck retval;
+    OCSP_REQUEST *req = NULL;
+    STACK_OF(OCSP_CERTID) *ids = NULL;
+    STACK_OF(CONF_VALUE) *headers = NULL;
+    STACK_OF(X509) *issuers = NULL;
+    X509 *cert = NULL;
+    char *host = NULL;
+    char *port = NULL;
+    char *path = NULL;
+    int use_ssl = -1;
+    ocspTimeouts timeouts;
+    long nsec = MAX_VALIDITY_PERIOD;
+    long maxage = -1;
+    std::string cache_key;
+    // DER input parsed in place of the PEM arguments of prepareOCSP when
+    // set, the caller keeps it alive until prepareOCSP returns
+    const unsigned char *cert_der = NULL;
+    long cert_der_len = 0;
+    const unsigned char *issuer_der = NULL;
+    long issuer_der_len = 0;
+    // Registered issuer used in place of any issuer input when set
+    std::string issuer_handle;
+    // 0 or 1, -1 follows configure_requests
+    int nonce = -1;
+    int use_get = -1;
+    // RFC 5019 GET path replacing the POST of req when not empty
+    std::string get_path;
+    // Responder URL and header string prepareOCSP was given, NULL for
+    // responses not fetched by this request. Owned by the caller.
+    const char *url = NULL;
+    const char *header = NULL;
+    // Fetch or verify a fresh response even if one is cached, to replace it
+    int refresh = 0;
+    // Stop once cache_key, and cert_id when traced, are set, prepareOCSP
+    // then returns 1 unless the inputs did not parse
+    int key_only = 0;
+    // Reject responses failing signature or validity checks instead of
+    // only leaving them out of the cache
+    int strict = 0;
+    // Fill cert_id and count the bytes exchanged, for lookups someone is
+    // tracing. Untraced lookups skip the work.
+    int trace = 0;
+    // Counts the bytes exchanged too once this reads non-zero, for lookups
+    // that callers asking for a trace may join while they run. Owned by
+    // the caller.
+    const std::atomic<int> *traced = NULL;
+    // Hex DER of the CertID asked about
+    std::string cert_id;
+};
+
+// Sets whether requests carry a nonce and whether those short enough are
+// sent as RFC 5019 GET requests, and their time budgets, for requests not
+// choosing themselves. Requests without a nonce can be cached by HTTP
+// caches on the way.
+void configure_requests(int nonce, int use_get, const ocspTimeouts &timeouts);
+
+// Returns 1 for the errors of an exchange that ran out of time, which
+// name the phase that did
+int is_timeout(const char *error);
 
 ocspCheck verifyOCSP(const char* cert_local, const char* issuer_local, const char* header_local, const char* url_local, int timeout);
+
+// verifyOCSP for a request whose DER, issuer and request options are
+// already set
+ocspCheck verifyOCSPRequest(ocspRequest *request, const char* cert_local, const char* issuer_local, const char* header_local, const char* url_local, int timeout);
+
+// verifyOCSP for DER encoded certificates, parsed straight from the caller's memory
+ocspCheck verifyOCSPDer(const unsigned char *cert_der, long cert_len, const unsigned char *issuer_der, long issuer_len, const char* header_local, const char* url_local, int timeout);
+
+// verifyOCSPDer with an issuer added by register_issuer
+ocspCheck verifyOCSPWithIssuer(const unsigned char *cert_der, long cert_len, const std::string &issuer_handle, const char* header_local, const char* url_local, int timeout);
+
+// Verifies a DER OCSP response obtained without a request, e.g. stapled
+// in a TLS handshake, for the certificate whose DER or issuer inputs are
+// set in r. Never contacts a responder, fills the response cache.
+ocspCheck verifyStapledOCSP(ocspRequest *r, const unsigned char *resp_der, long resp_len);
+
+// Looks up requests sharing one responder, packing up to max_per_request
+// CertIDs in each exchange. Each request has its DER and issuer inputs set,
+// results land in requests[i].retval. Batches the responder rejects or
+// answers only partly are retried one certificate at a time.
+void verifyOCSPBatch(ocspRequest *requests, size_t n, size_t max_per_request,
+                     const char* header_local, const char* url_local, int timeout);
+
+// verifyOCSP in steps, for callers that drive the responder exchange
+// themselves. prepareOCSP returns 1 when the request has to be sent to
+// r->host, 0 when r->retval already holds the answer or an error. Without
+// url_local, 1 means the caller supplies the response itself. The timeout
+// of this and the verify functions is the total budget in milliseconds,
+// -1 keeps r->timeouts.total.
+int prepareOCSP(ocspRequest *r, const char* cert_local, const char* issuer_local, const char* header_local, const char* url_local, int timeout);
+void finishOCSP(ocspRequest *r, OCSP_RESPONSE *resp);
+// finishOCSP for a response to r->req covering the CertIDs of entries,
+// results land in each entry
+void finishOCSPBatch(ocspRequest *r, ocspRequest **entries, size_t n, OCSP_RESPONSE *resp);
+void freeOCSP(ocspRequest *r);
+
+// Answers r, whose exchange failed because its responder's circuit is
+// open, from a cached response past the cache margin but not its
+// nextUpdate. Returns 0 when there is none.
+int serve_stale(ocspRequest *r);
+
+// Counts the bytes of r's exchange into retval, for traced requests
+void count_exchange(const ocspRequest *r, OCSP_RESPONSE *resp, ocspCheck *retval);
+
+// Whether r counts its exchange, by its own trace or one that joined it
+int is_traced(const ocspRequest *r);
+
+BIO *new_responder_bio(ocspCheck *retval, const char *host,
+                       const char *port, int use_ssl);
+
+// Builds the HTTP request for req on cbio, including the Host header and
+// the keep-alive header for pooled connections. Without req, path is sent
+// as a GET request. Returns NULL on failure, the caller reports it.
+OCSP_REQ_CTX *new_request_ctx(BIO *cbio, const char *host, const char *path,
+                              const STACK_OF(CONF_VALUE) *headers,
+                              OCSP_REQUEST *req, int keep_alive);
+
+// The body and path process_responder and new_request_ctx send for r
+inline OCSP_REQUEST *request_body(const ocspRequest *r) {
+    return r->get_path.empty() ? r->req : NULL;
+}
+
+inline const char *request_path(const ocspRequest *r) {
+    return r->get_path.empty() ? r->path : r->get_path.c_str();
+}
+
+#endif
@@ -0,0 +1,242 @@
+#include <poll.h>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "ocsp.h"
+#include "pool.h"
+
+using std::chrono::steady_clock;
+
+struct pooledConn {
+    BIO *bio;
+    steady_clock::time_point idle_since;
+};
+
+// Idle connections are reused most recently returned first, so the ones
+// least likely to have been closed by the responder go out again
+struct hostPool {
+    std::vector<pooledConn> idle;
+    // checked out, including slots whose connection is still being opened
+    size_t active = 0;
+};
+
+static std::mutex pool_lock;
+// Signalled whenever a slot is given back
+static std::condition_variable pool_cv;
+static std::unordered_map<std::string, hostPool> pools;
+static int pool_max_per_host = 8;
+static long pool_idle_timeout = 15000;
+static poolStats pool_stats;
+
+static std::string pool_key(const char *host, const char *port, int use_ssl)
+{
+    std::string key(host);
+
+    key += ':';
+    if (port != NULL)
+        key += port;
+    key += use_ssl == 1 ? ":tls" : ":tcp";
+    return key;
+}
+
+// Caller holds pool_lock
+static void take_expired(hostPool *hp, std::vector<BIO *> *expired)
+{
+    steady_clock::time_point deadline = steady_clock::now()
+        - std::chrono::milliseconds(pool_idle_timeout);
+    size_t i = 0;
+
+    while (i < hp->idle.size()) {
+        if (hp->idle[i].idle_since <= deadline) {
+            expired->push_back(hp->idle[i].bio);
+            hp->idle.erase(hp->idle.begin() + i);
+            pool_stats.expired++;
+            pool_stats.closed++;
+        } else {
+            i++;
+        }
+    }
+}
+
+static void free_all(const std::vector<BIO *> &bios)
+{
+    for (size_t i = 0; i < bios.size(); i++)
+        BIO_free_all(bios[i]);
+}
+
+// An idle keep-alive connection must have nothing to read: anything
+// readable is either the responder closing it or stray data.
+static int conn_healthy(BIO *cbio)
+{
+    struct pollfd pfd;
+
+    if (BIO_pending(cbio) > 0)
+        return 0;
+    // poll, unlike select, takes descriptors past FD_SETSIZE
+    if (BIO_get_fd(cbio, &pfd.fd) < 0)
+        return 0;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    return poll(&pfd, 1, 0) == 0;
+}
+
+void configure_pool(int max_per_host, long idle_timeout)
+{
+    std::vector<BIO *> closing;
+
+    {
+        std::lock_guard<std::mutex> guard(pool_lock);
+        pool_max_per_host = max_per_host;
+        pool_idle_timeout = idle_timeout;
+        for (auto it = pools.begin(); it != pools.end(); ++it) {
+            hostPool &hp = it->second;
+            take_expired(&hp, &closing);
+            while (hp.idle.size() > (size_t)max_per_host) {
+                closing.push_back(hp.idle.front().bio);
+                hp.idle.erase(hp.idle.begin());
+                pool_stats.closed++;
+            }
+        }
+    }
+    // Waiting checkouts may fit under the new limit
+    pool_cv.notify_all();
+    free_all(closing);
+}
+
+poolStats get_pool_stats()
+{
+    std::vector<BIO *> expired;
+    poolStats stats;
+
+    {
+        std::lock_guard<std::mutex> guard(pool_lock);
+        for (auto it = pools.begin(); it != pools.end(); ++it) {
+            take_expired(&it->second, &expired);
+            stats.idle += it->second.idle.size();
+            stats.active += it->second.active;
+        }
+        stats.created = pool_stats.created;
+        stats.reused = pool_stats.reused;
+        stats.expired = pool_stats.expired;
+        stats.unhealthy = pool_stats.unhealthy;
+        stats.closed = pool_stats.closed;
+        stats.waited = pool_stats.waited;
+        stats.exhausted = pool_stats.exhausted;
+    }
+    free_all(expired);
+    return stats;
+}
+
+int pool_enabled()
+{
+    std::lock_guard<std::mutex> guard(pool_lock);
+    return pool_max_per_host > 0;
+}
+
+int pool_checkout(const char *host, const char *port, int use_ssl,
+                  steady_clock::time_point end, BIO **cbio, int *reused)
+{
+    std::string key = pool_key(host, port, use_ssl);
+    std::vector<BIO *> expired;
+    int waited = 0, ret = 1;
+
+    *cbio = NULL;
+    *reused = 0;
+    for (;;) {
+        {
+            std::unique_lock<std::mutex> lock(pool_lock);
+            hostPool *hp = &pools[key];
+            take_expired(hp, &expired);
+            // Idle connections count towards the limit, so one is always
+            // there to take once the host is at it
+            while (hp->idle.empty() && pool_max_per_host > 0
+                   && hp->active >= (size_t)pool_max_per_host) {
+                if (end <= steady_clock::now()) {
+                    ret = 0;
+                    break;
+                }
+                if (!waited) {
+                    pool_stats.waited++;
+                    waited = 1;
+                }
+                if (end == steady_clock::time_point::max()) {
+                    pool_cv.wait(lock);
+                } else if (pool_cv.wait_until(lock, end) == std::cv_status::timeout) {
+                    ret = 0;
+                    break;
+                }
+                take_expired(hp, &expired);
+            }
+            if (ret == 0) {
+                if (waited)
+                    pool_stats.exhausted++;
+                break;
+            }
+            hp->active++;
+            if (hp->idle.empty())
+                break;
+            *cbio = hp->idle.back().bio;
+            hp->idle.pop_back();
+        }
+
+        if (conn_healthy(*cbio)) {
+            std::lock_guard<std::mutex> guard(pool_lock);
+            pool_stats.reused++;
+            *reused = 1;
+            break;
+        }
+
+        BIO_free_all(*cbio);
+        *cbio = NULL;
+        std::lock_guard<std::mutex> guard(pool_lock);
+        pools[key].active--;
+        pool_stats.unhealthy++;
+        pool_stats.closed++;
+    }
+
+    free_all(expired);
+    return ret;
+}
+
+void pool_waited(int exhausted)
+{
+    std::lock_guard<std::mutex> guard(pool_lock);
+    if (exhausted)
+        pool_stats.exhausted++;
+    else
+        pool_stats.waited++;
+}
+
+void pool_opened()
+{
+    std::lock_guard<std::mutex> guard(pool_lock);
+    pool_stats.created++;
+}
+
+void pool_checkin(const char *host, const char *port, int use_ssl, BIO *cbio, int reusable)
+{
+    std::vector<BIO *> closing;
+
+    {
+        std::lock_guard<std::mutex> guard(pool_lock);
+        hostPool &hp = pools[pool_key(host, port, use_ssl)];
+        if (hp.active > 0)
+            hp.active--;
+        take_expired(&hp, &closing);
+        if (cbio != NULL && reusable && hp.idle.size() + hp.active < (size_t)pool_max_per_host) {
+            pooledConn conn = { cbio, steady_clock::now() };
+            hp.idle.push_back(conn);
+            cbio = NULL;
+        } else if (cbio != NULL) {
+            pool_stats.closed++;
+        }
+    }
+    pool_cv.notify_all();
+
+    free_all(closing);
+    BIO_free_all(cbio);
+}
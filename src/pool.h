@@ -0,0 +1,57 @@
+#ifndef OCSP_POOL_H
+#define OCSP_POOL_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+#include <openssl/bio.h>
+
+struct poolStats {
+    uint64_t created = 0;
+    uint64_t reused = 0;
+    uint64_t expired = 0;
+    uint64_t unhealthy = 0;
+    uint64_t closed = 0;
+    // checkouts that found their host at max_per_host and waited
+    uint64_t waited = 0;
+    // checkouts that gave up waiting
+    uint64_t exhausted = 0;
+    size_t idle = 0;
+    size_t active = 0;
+};
+
+// Allows up to max_per_host connections per host:port:tls, in use or kept
+// open between requests (0 disables pooling), closing those idle for
+// idle_timeout ms.
+void configure_pool(int max_per_host, long idle_timeout);
+
+poolStats get_pool_stats();
+
+// Returns 1 when connections to host are pooled. Pooled requests must ask
+// the responder to keep the connection open.
+int pool_enabled();
+
+// Takes a connection slot of host: *cbio is an idle connection that passed
+// its health check, or NULL if the caller has to open one and register it
+// with pool_opened. *reused is set accordingly. While the host has
+// max_per_host connections in use, waits until end for one to come back
+// and returns 0 if none did, never waiting when end has passed. The slot is
+// given back by pool_checkin.
+int pool_checkout(const char *host, const char *port, int use_ssl,
+                  std::chrono::steady_clock::time_point end, BIO **cbio, int *reused);
+
+// Counts a checkout of a caller polling pool_checkout with an end already
+// past that found its host at the limit, and once more as exhausted when
+// it gave up. Checkouts that wait count themselves.
+void pool_waited(int exhausted);
+
+// Counts a connection opened by the caller in the slot pool_checkout took.
+void pool_opened();
+
+// Gives back a slot with its connection, NULL if none was opened. The
+// connection is kept for reuse when reusable and the host is within its
+// limit, otherwise it is freed.
+void pool_checkin(const char *host, const char *port, int use_ssl, BIO *cbio, int reusable);
+
+#endif
@@ -0,0 +1,207 @@
+#include <chrono>
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unordered_map>
+
+#include "cache.h"
+#include "refresh.h"
+
+using std::chrono::system_clock;
+
+// What it takes to ask the responder again for one cached response
+struct refreshEntry {
+    std::string cert;
+    std::string issuer;
+    std::string issuer_handle;
+    std::string header;
+    std::string url;
+    int nonce;
+    int use_get;
+    ocspTimeouts timeouts;
+};
+
+// Entries are in refresh_due, keyed by the time they are due, unless a
+// thread is refreshing them
+static std::mutex refresh_lock;
+// Never destroyed, detached threads may still wait on it at exit
+static std::condition_variable *refresh_cv = NULL;
+static std::unordered_map<std::string, refreshEntry> refresh_entries;
+static std::multimap<time_t, std::string> refresh_due;
+static size_t refresh_concurrency = 0;
+// Threads running or about to, whatever they were started for
+static size_t refresh_threads = 0;
+static double refresh_fraction = 0.5;
+static double refresh_jitter = 0.1;
+static long refresh_idle = 3600;
+static refreshStats refresh_stats;
+static std::minstd_rand refresh_random;
+
+#define REFRESH_RETRY 30
+
+static std::string to_der(X509 *x)
+{
+    unsigned char *der = NULL;
+    int len = i2d_X509(x, &der);
+    std::string out;
+
+    if (len > 0)
+        out.assign((const char *)der, len);
+    OPENSSL_free(der);
+    return out;
+}
+
+// Caller holds refresh_lock
+static time_t next_due(time_t thisupd, time_t expires, time_t now)
+{
+    double window = (double)(expires - thisupd);
+    double delay = window * refresh_fraction
+        + window * refresh_jitter * std::uniform_real_distribution<double>(0, 1)(refresh_random);
+    time_t due = thisupd + (time_t)delay;
+
+    // A failed refresh leaves the old response in place, try again soon
+    if (due <= now)
+        due = now + REFRESH_RETRY
+            + std::uniform_int_distribution<int>(0, REFRESH_RETRY)(refresh_random);
+    return due;
+}
+
+static void run_refresh()
+{
+    std::unique_lock<std::mutex> lock(refresh_lock);
+
+    // Threads above the concurrency exit, whichever notices first, so the
+    // count left running always matches it
+    while (refresh_threads <= refresh_concurrency) {
+        if (refresh_due.empty()) {
+            refresh_cv->wait(lock);
+            continue;
+        }
+        auto first = refresh_due.begin();
+        if (first->first > time(NULL)) {
+            refresh_cv->wait_until(lock, system_clock::from_time_t(first->first));
+            continue;
+        }
+        std::string key = first->second;
+        refresh_due.erase(first);
+        auto it = refresh_entries.find(key);
+        if (it == refresh_entries.end())
+            continue;
+        refreshEntry entry = it->second;
+        refresh_stats.active++;
+        lock.unlock();
+
+        time_t thisupd, expires, last_read, now = time(NULL);
+        int cached = cache_times(key, &thisupd, &expires, &last_read);
+        int ok = 0;
+
+        if (cached && now - last_read <= refresh_idle) {
+            ocspRequest request;
+            request.cert_der = (const unsigned char *)entry.cert.data();
+            request.cert_der_len = (long)entry.cert.size();
+            request.issuer_der = (const unsigned char *)entry.issuer.data();
+            request.issuer_der_len = (long)entry.issuer.size();
+            request.issuer_handle = entry.issuer_handle;
+            request.nonce = entry.nonce;
+            request.use_get = entry.use_get;
+            request.timeouts = entry.timeouts;
+            request.refresh = 1;
+            ocspCheck result = verifyOCSPRequest(&request, "", "", entry.header.c_str(),
+                                                 entry.url.c_str(), -1);
+            ok = result.errorStr == NULL;
+            cached = cache_times(key, &thisupd, &expires, &last_read);
+        }
+
+        lock.lock();
+        refresh_stats.active--;
+        if (refresh_entries.count(key) == 0)
+            continue;
+        if (!cached || now - last_read > refresh_idle) {
+            refresh_entries.erase(key);
+            refresh_stats.expired++;
+            continue;
+        }
+        if (ok)
+            refresh_stats.refreshed++;
+        else
+            refresh_stats.failed++;
+        refresh_due.insert(std::make_pair(next_due(thisupd, expires, time(NULL)), key));
+    }
+    refresh_threads--;
+}
+
+void configure_refresh(size_t concurrency, double fraction, double jitter, long idle)
+{
+    std::lock_guard<std::mutex> guard(refresh_lock);
+
+    if (refresh_cv == NULL) {
+        refresh_cv = new std::condition_variable();
+        refresh_random.seed((unsigned)time(NULL));
+    }
+    refresh_concurrency = concurrency;
+    refresh_fraction = fraction;
+    refresh_jitter = jitter;
+    refresh_idle = idle;
+    if (concurrency == 0) {
+        refresh_entries.clear();
+        refresh_due.clear();
+    }
+    // Threads above the new concurrency exit once woken
+    while (refresh_threads < concurrency) {
+        std::thread(run_refresh).detach();
+        refresh_threads++;
+    }
+    refresh_cv->notify_all();
+}
+
+int refresh_enabled()
+{
+    std::lock_guard<std::mutex> guard(refresh_lock);
+    return refresh_concurrency > 0;
+}
+
+refreshStats get_refresh_stats()
+{
+    std::lock_guard<std::mutex> guard(refresh_lock);
+    refreshStats stats = refresh_stats;
+    stats.tracked = refresh_entries.size();
+    return stats;
+}
+
+void refresh_track(const ocspRequest *r)
+{
+    time_t thisupd, expires, last_read;
+    refreshEntry entry;
+
+    {
+        std::lock_guard<std::mutex> guard(refresh_lock);
+        if (refresh_concurrency == 0 || refresh_entries.count(r->cache_key) > 0)
+            return;
+    }
+    if (r->url == NULL || r->cert == NULL
+        || !cache_times(r->cache_key, &thisupd, &expires, &last_read))
+        return;
+
+    entry.cert = to_der(r->cert);
+    if (!r->issuer_handle.empty())
+        entry.issuer_handle = r->issuer_handle;
+    else if (sk_X509_num(r->issuers) > 0)
+        entry.issuer = to_der(sk_X509_value(r->issuers, 0));
+    entry.header = r->header != NULL ? r->header : "";
+    entry.url = r->url;
+    entry.nonce = r->nonce;
+    entry.use_get = r->use_get;
+    entry.timeouts = r->timeouts;
+    if (entry.cert.empty() || (entry.issuer.empty() && entry.issuer_handle.empty()))
+        return;
+
+    std::lock_guard<std::mutex> guard(refresh_lock);
+    if (refresh_concurrency == 0 || refresh_entries.count(r->cache_key) > 0)
+        return;
+    refresh_entries[r->cache_key] = std::move(entry);
+    refresh_due.insert(std::make_pair(next_due(thisupd, expires, time(NULL)), r->cache_key));
+    refresh_cv->notify_one();
+}
@@ -0,0 +1,32 @@
+#ifndef OCSP_REFRESH_H
+#define OCSP_REFRESH_H
+
+#include <cstddef>
+#include <cstdint>
+
+#include "ocsp.h"
+
+struct refreshStats {
+    uint64_t refreshed = 0;
+    uint64_t failed = 0;
+    // dropped after idle seconds without a cache hit, or evicted
+    uint64_t expired = 0;
+    size_t tracked = 0;
+    size_t active = 0;
+};
+
+// Refetches cached responses in the background, `concurrency` at a time
+// (0 disables refreshing), once `fraction` of their validity window has
+// passed plus a random delay of up to `jitter` of the window. Entries
+// without a cache hit for `idle` seconds are left to expire.
+void configure_refresh(size_t concurrency, double fraction, double jitter, long idle);
+
+int refresh_enabled();
+
+refreshStats get_refresh_stats();
+
+// Remembers how to fetch the response just cached for r again. r must
+// have been prepared with a responder URL.
+void refresh_track(const ocspRequest *r);
+
+#endif
@@ -0,0 +1,379 @@
+#include <atomic>
+#include <cstring>
+#include <mutex>
+#include <string>
+
+#include "shmcache.h"
+
+#ifndef _WIN32
+
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <chrono>
+
+// Each slot is a seqlock: writers make seq odd while they write and even
+// again once done, readers retry or give up when seq is odd or changed
+// under them. Writers hold the slot's lock while they write. A writer
+// dying mid-write leaves seq odd, which only hides the slot until the lock
+// lease runs out and another writer takes it over. A writer stalled past
+// the lease may still scribble over the slot once it resumes, so records
+// carry a checksum readers verify as well.
+#define SHM_MAGIC 0x4f435350534c4f54ULL
+#define SHM_VERSION 3
+#define SHM_READY 2
+#define SHM_KEY_MAX 128
+#define SHM_DER_MAX 3904
+#define SHM_PROBE 8
+#define SHM_READ_TRIES 4
+// Writes take microseconds, a slot locked for longer was abandoned
+#define SHM_LEASE std::chrono::seconds(1)
+
+struct shmSlot {
+    std::atomic<uint32_t> seq;
+    uint32_t key_len;
+    // 0, or the steady_clock nanoseconds a writer took the slot at. The
+    // clock is system-wide, so every process compares it alike.
+    std::atomic<int64_t> locked_at;
+    uint32_t der_len;
+    int32_t status;
+    int32_t reason;
+    int64_t thisupd;
+    int64_t nextupd;
+    int64_t revoked;
+    // record_checksum of everything above and below
+    uint64_t checksum;
+    unsigned char key[SHM_KEY_MAX];
+    unsigned char der[SHM_DER_MAX];
+};
+
+struct shmHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t slot_size;
+    // Set by the first opener, later ones use it whatever they asked for
+    uint64_t slots;
+    // SHM_READY once set up
+    std::atomic<uint32_t> state;
+};
+
+#define SHM_HEADER_SIZE 64
+
+static_assert(sizeof(shmHeader) <= SHM_HEADER_SIZE, "shared cache header too large");
+static_assert(sizeof(shmSlot) == 4096, "shared cache slots should fill a page");
+
+struct shmMapping {
+    shmSlot *slots;
+    size_t count;
+};
+
+static std::mutex shm_lock;
+// Mappings are never unmapped, lookups may still be reading a replaced one
+static std::atomic<shmMapping *> shm_mapping(NULL);
+static std::atomic<uint64_t> shm_hits(0), shm_misses(0), shm_writes(0),
+    shm_evictions(0), shm_recovered(0);
+
+#define FNV_OFFSET 14695981039346656037ULL
+
+// FNV-1a of len bytes, going on from h
+static uint64_t fnv(uint64_t h, const void *data, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+
+    for (size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 1099511628211ULL;
+    }
+    return h;
+}
+
+static uint64_t key_hash(const std::string &key)
+{
+    return fnv(FNV_OFFSET, key.data(), key.size());
+}
+
+static uint64_t record_checksum(const unsigned char *key, size_t key_len,
+                                const shmRecord &record)
+{
+    int64_t fields[] = { (int64_t)key_len, (int64_t)record.der.size(), record.status,
+                         record.reason, (int64_t)record.thisupd, (int64_t)record.nextupd,
+                         (int64_t)record.revoked };
+    uint64_t h = fnv(FNV_OFFSET, fields, sizeof(fields));
+
+    h = fnv(h, key, key_len);
+    return fnv(h, record.der.data(), record.der.size());
+}
+
+const char *configure_shm_cache(const char *name, size_t slots)
+{
+    std::lock_guard<std::mutex> guard(shm_lock);
+    struct stat st;
+    shmHeader *header = NULL;
+    size_t size = 0;
+    void *map = MAP_FAILED;
+    const char *error = NULL;
+    int fd;
+
+    if (name == NULL || name[0] == '\0') {
+        shm_mapping = NULL;
+        return NULL;
+    }
+    if (slots == 0)
+        return "Shared cache needs at least one slot";
+
+    fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+    if (fd < 0)
+        return "Error opening shared cache";
+    // Openers set the segment up one at a time under a lock the kernel
+    // drops when its holder dies, so a segment a dead opener left half set
+    // up is set up again by the next one
+    while (flock(fd, LOCK_EX) != 0) {
+        if (errno != EINTR) {
+            close(fd);
+            return "Error locking shared cache";
+        }
+    }
+    if (fstat(fd, &st) != 0) {
+        error = "Error opening shared cache";
+        goto end;
+    }
+    size = (size_t)st.st_size;
+    if (size < SHM_HEADER_SIZE + sizeof(shmSlot)) {
+        size = SHM_HEADER_SIZE + slots * sizeof(shmSlot);
+        if (ftruncate(fd, (off_t)size) != 0) {
+            error = "Error opening shared cache";
+            goto end;
+        }
+    }
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        error = "Error opening shared cache";
+        goto end;
+    }
+    header = (shmHeader *)map;
+    if (header->state.load(std::memory_order_acquire) != SHM_READY) {
+        header->magic = SHM_MAGIC;
+        header->version = SHM_VERSION;
+        header->slot_size = sizeof(shmSlot);
+        header->slots = (size - SHM_HEADER_SIZE) / sizeof(shmSlot);
+        header->state.store(SHM_READY, std::memory_order_release);
+    }
+    if (header->magic != SHM_MAGIC || header->version != SHM_VERSION
+        || header->slot_size != sizeof(shmSlot) || header->slots == 0
+        || SHM_HEADER_SIZE + header->slots * sizeof(shmSlot) > size)
+        error = "Invalid shared cache";
+
+ end:
+    // The mapping keeps the open file, and with it the lock, past close
+    flock(fd, LOCK_UN);
+    close(fd);
+    if (error != NULL) {
+        if (map != MAP_FAILED)
+            munmap(map, size);
+        return error;
+    }
+
+    shmMapping *mapping = new shmMapping();
+    mapping->slots = (shmSlot *)((char *)map + SHM_HEADER_SIZE);
+    mapping->count = (size_t)header->slots;
+    shm_mapping = mapping;
+    return NULL;
+}
+
+int shm_cache_enabled()
+{
+    return shm_mapping.load(std::memory_order_relaxed) != NULL;
+}
+
+shmStats get_shm_cache_stats()
+{
+    shmStats stats;
+
+    stats.hits = shm_hits;
+    stats.misses = shm_misses;
+    stats.writes = shm_writes;
+    stats.evictions = shm_evictions;
+    stats.recovered = shm_recovered;
+    shmMapping *mapping = shm_mapping.load();
+    stats.slots = mapping != NULL ? mapping->count : 0;
+    return stats;
+}
+
+// Copies slot if it holds key, retrying while a writer is changing it
+static int read_slot(shmSlot *slot, const std::string &key, shmRecord *record)
+{
+    for (int tries = 0; tries < SHM_READ_TRIES; tries++) {
+        uint32_t seq = slot->seq.load(std::memory_order_acquire);
+        if (seq & 1)
+            continue;
+        uint32_t key_len = slot->key_len;
+        uint32_t der_len = slot->der_len;
+        // Lengths read mid-write may be garbage, the seq check below
+        // rejects the copy but the copy must stay in bounds
+        if (seq == 0 || key_len != key.size() || key_len > SHM_KEY_MAX || der_len > SHM_DER_MAX
+            || memcmp(slot->key, key.data(), key_len) != 0) {
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (slot->seq.load(std::memory_order_relaxed) == seq)
+                return 0;
+            continue;
+        }
+        record->status = slot->status;
+        record->reason = slot->reason;
+        record->thisupd = (time_t)slot->thisupd;
+        record->nextupd = (time_t)slot->nextupd;
+        record->revoked = (time_t)slot->revoked;
+        record->der.assign((const char *)slot->der, der_len);
+        uint64_t checksum = slot->checksum;
+        std::atomic_thread_fence(std::memory_order_acquire);
+        if (slot->seq.load(std::memory_order_relaxed) != seq)
+            continue;
+        // A settled record mixing two writes is as good as none
+        return checksum == record_checksum((const unsigned char *)key.data(), key.size(),
+                                           *record);
+    }
+    return 0;
+}
+
+int shm_cache_get(const std::string &key, shmRecord *record)
+{
+    shmMapping *mapping = shm_mapping.load(std::memory_order_acquire);
+    size_t i, start;
+
+    if (mapping == NULL)
+        return 0;
+    shmSlot *slots = mapping->slots;
+    size_t count = mapping->count;
+    start = (size_t)(key_hash(key) % count);
+    for (i = 0; i < SHM_PROBE && i < count; i++) {
+        if (read_slot(&slots[(start + i) % count], key, record)) {
+            shm_hits++;
+            return 1;
+        }
+    }
+    shm_misses++;
+    return 0;
+}
+
+static int64_t now_ns()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Takes the slot's lock, or takes it over from a writer that held it for
+// longer than the lease, and makes seq odd. Returns the odd seq, or 0 when
+// another process is writing.
+static uint32_t lock_slot(shmSlot *slot, int64_t *stamp)
+{
+    int64_t now = now_ns(), held = 0;
+    uint32_t seq;
+
+    if (!slot->locked_at.compare_exchange_strong(held, now)) {
+        if (now - held < std::chrono::duration_cast<std::chrono::nanoseconds>(SHM_LEASE).count()
+            || !slot->locked_at.compare_exchange_strong(held, now))
+            return 0;
+        shm_recovered++;
+    }
+    *stamp = now;
+    // Only the lock holder changes seq, a dead writer may have left it odd
+    seq = slot->seq.load(std::memory_order_relaxed);
+    seq += (seq & 1) ? 2 : 1;
+    slot->seq.store(seq, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+    return seq;
+}
+
+void shm_cache_put(const std::string &key, const shmRecord &record)
+{
+    shmMapping *mapping = shm_mapping.load(std::memory_order_acquire);
+    shmSlot *slot = NULL, *oldest = NULL;
+    size_t i, start;
+    uint32_t seq;
+    int64_t stamp;
+
+    if (mapping == NULL)
+        return;
+    shmSlot *slots = mapping->slots;
+    size_t count = mapping->count;
+    if (key.size() > SHM_KEY_MAX || record.der.size() > SHM_DER_MAX) {
+        shm_evictions++;
+        return;
+    }
+
+    // The slot already holding key, else an empty one, else the one
+    // expiring first. Racy reads only pick the slot, lock_slot arbitrates.
+    start = (size_t)(key_hash(key) % count);
+    for (i = 0; i < SHM_PROBE && i < count; i++) {
+        shmSlot *s = &slots[(start + i) % count];
+        if (s->seq.load(std::memory_order_relaxed) == 0 || s->der_len == 0) {
+            if (slot == NULL)
+                slot = s;
+            continue;
+        }
+        if (s->key_len == key.size() && memcmp(s->key, key.data(), key.size()) == 0) {
+            slot = s;
+            break;
+        }
+        if (oldest == NULL || s->nextupd < oldest->nextupd)
+            oldest = s;
+    }
+    if (slot == NULL) {
+        slot = oldest;
+        shm_evictions++;
+    }
+
+    seq = lock_slot(slot, &stamp);
+    if (seq == 0)
+        return;
+    slot->key_len = (uint32_t)key.size();
+    memcpy(slot->key, key.data(), key.size());
+    slot->der_len = (uint32_t)record.der.size();
+    memcpy(slot->der, record.der.data(), record.der.size());
+    slot->status = record.status;
+    slot->reason = record.reason;
+    slot->thisupd = (int64_t)record.thisupd;
+    slot->nextupd = (int64_t)record.nextupd;
+    slot->revoked = (int64_t)record.revoked;
+    slot->checksum = record_checksum((const unsigned char *)key.data(), key.size(), record);
+    // A writer that stalled past the lease and lost the slot leaves seq to
+    // the one that took it over
+    if (slot->locked_at.load(std::memory_order_relaxed) != stamp)
+        return;
+    slot->seq.store(seq + 1, std::memory_order_release);
+    // Fails only if the lock was taken over meanwhile
+    slot->locked_at.compare_exchange_strong(stamp, 0);
+    shm_writes++;
+}
+
+#else
+
+const char *configure_shm_cache(const char *name, size_t slots)
+{
+    if (name == NULL || name[0] == '\0')
+        return NULL;
+    return "Shared cache requires POSIX shared memory";
+}
+
+int shm_cache_enabled()
+{
+    return 0;
+}
+
+shmStats get_shm_cache_stats()
+{
+    return shmStats();
+}
+
+int shm_cache_get(const std::string &key, shmRecord *record)
+{
+    return 0;
+}
+
+void shm_cache_put(const std::string &key, const shmRecord &record)
+{
+}
+
+#endif
@@ -0,0 +1,47 @@
+#ifndef OCSP_SHMCACHE_H
+#define OCSP_SHMCACHE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <string>
+
+struct shmRecord {
+    int status = -1;
+    int reason = -1;
+    time_t thisupd = 0;
+    time_t nextupd = 0;
+    // 0 unless revoked
+    time_t revoked = 0;
+    std::string der;
+};
+
+struct shmStats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t writes = 0;
+    // records replaced to make room, or too large to share
+    uint64_t evictions = 0;
+    // slots taken over from writers that held them past the lease, having
+    // died mid-write
+    uint64_t recovered = 0;
+    size_t slots = 0;
+};
+
+// Attaches to the POSIX shared memory segment `name`, creating it with
+// `slots` records if it does not exist yet, so every process attached to
+// it shares verified responses. Later openers use the segment's own slot
+// count. An empty name detaches. Returns NULL on success or an error
+// string.
+const char *configure_shm_cache(const char *name, size_t slots);
+
+int shm_cache_enabled();
+
+shmStats get_shm_cache_stats();
+
+// Copies the record for key, returns 0 when there is none.
+int shm_cache_get(const std::string &key, shmRecord *record);
+
+void shm_cache_put(const std::string &key, const shmRecord &record);
+
+#endif
@@ -0,0 +1,92 @@
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include "helper.h"
+#include "signers.h"
+
+#define SIGNERS_MAX 1024
+
+// Verified signers and when they expire. The store they were verified
+// against is held so a rebuilt store, never one reusing its address,
+// starts from scratch.
+static std::mutex signers_lock;
+static std::unordered_map<std::string, time_t> signers;
+static X509_STORE *signers_store = NULL;
+static signerStats signer_stats;
+
+signerStats get_signer_stats()
+{
+    std::lock_guard<std::mutex> guard(signers_lock);
+    signerStats stats = signer_stats;
+    stats.size = signers.size();
+    return stats;
+}
+
+int signer_key(OCSP_BASICRESP *bs, X509 *signer, std::string *key)
+{
+    unsigned char md[EVP_MAX_MD_SIZE];
+    unsigned int md_len;
+    ASN1_OCTET_STRING *name_hash, *key_hash;
+    ASN1_OBJECT *alg;
+    int i, nid;
+
+    if (!X509_digest(signer, EVP_sha256(), md, &md_len))
+        return 0;
+    key->assign((const char *)md, md_len);
+    for (i = 0; i < OCSP_resp_count(bs); i++) {
+        const OCSP_CERTID *id = OCSP_SINGLERESP_get0_id(OCSP_resp_get0(bs, i));
+        if (!OCSP_id_get0_info(&name_hash, &alg, &key_hash, NULL, (OCSP_CERTID *)id))
+            return 0;
+        nid = OBJ_obj2nid(alg);
+        key->append((const char *)&nid, sizeof(nid));
+        key->append((const char *)ASN1_STRING_get0_data(name_hash), ASN1_STRING_length(name_hash));
+        key->append((const char *)ASN1_STRING_get0_data(key_hash), ASN1_STRING_length(key_hash));
+    }
+    return 1;
+}
+
+int signer_verified(X509_STORE *store, const std::string &key)
+{
+    std::lock_guard<std::mutex> guard(signers_lock);
+
+    if (store != signers_store)
+        return 0;
+    auto it = signers.find(key);
+    if (it == signers.end())
+        return 0;
+    if (time(NULL) >= it->second) {
+        signers.erase(it);
+        return 0;
+    }
+    return 1;
+}
+
+void signer_remember(X509_STORE *store, const std::string &key, X509 *signer)
+{
+    time_t expires;
+
+    if (!asn1_time_to_epoch(X509_get0_notAfter(signer), &expires))
+        return;
+
+    std::lock_guard<std::mutex> guard(signers_lock);
+    if (store != signers_store) {
+        if (!X509_STORE_up_ref(store))
+            return;
+        X509_STORE_free(signers_store);
+        signers_store = store;
+        signers.clear();
+    }
+    if (signers.size() >= SIGNERS_MAX)
+        signers.clear();
+    signers[key] = expires;
+}
+
+void signer_count(int fast)
+{
+    std::lock_guard<std::mutex> guard(signers_lock);
+    if (fast)
+        signer_stats.fast++;
+    else
+        signer_stats.full++;
+}
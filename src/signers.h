@@ -0,0 +1,35 @@
+#ifndef OCSP_SIGNERS_H
+#define OCSP_SIGNERS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include <openssl/ocsp.h>
+
+struct signerStats {
+    // responses whose signer was already verified, only their signature
+    // was checked
+    uint64_t fast = 0;
+    // responses verified in full, chain and signer checks included
+    uint64_t full = 0;
+    size_t size = 0;
+};
+
+signerStats get_signer_stats();
+
+// Identifies signer signing responses about the CAs of bs: the SHA-256 of
+// signer followed by the issuer hashes of every CertID in bs.
+int signer_key(OCSP_BASICRESP *bs, X509 *signer, std::string *key);
+
+// Returns 1 when key passed full verification against store and the
+// signer has not expired since.
+int signer_verified(X509_STORE *store, const std::string &key);
+
+// Remembers that key passed full verification against store, until the
+// signer's notAfter.
+void signer_remember(X509_STORE *store, const std::string &key, X509 *signer);
+
+void signer_count(int fast);
+
+#endif
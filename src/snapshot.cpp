@@ -0,0 +1,240 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "cache.h"
+#include "snapshot.h"
+
+// The file is the magic followed by records of a native-endian uint32 key
+// length, uint32 DER length, the key and the DER response. A later record
+// for the same key wins and a truncated last record is ignored, so records
+// can be appended to a file at any time.
+#define SNAPSHOT_MAGIC "OCSPSNP1"
+#define SNAPSHOT_MAGIC_LEN 8
+
+struct snapshotRecord {
+    size_t offset;
+    size_t len;
+};
+
+static std::mutex snapshot_lock;
+// Never destroyed, the detached writer may still wait on it at exit
+static std::condition_variable *snapshot_cv = NULL;
+static std::string snapshot_path;
+static long snapshot_interval = 0;
+static unsigned long snapshot_generation = 0;
+static const unsigned char *snapshot_map = NULL;
+static size_t snapshot_map_len = 0;
+static std::unordered_map<std::string, snapshotRecord> snapshot_index;
+static snapshotStats snapshot_stats;
+// Serialises save, taken before snapshot_lock
+static std::mutex save_lock;
+
+// Caller holds snapshot_lock
+static void unmap()
+{
+    if (snapshot_map != NULL)
+        munmap((void *)snapshot_map, snapshot_map_len);
+    snapshot_map = NULL;
+    snapshot_map_len = 0;
+    snapshot_index.clear();
+}
+
+// Caller holds snapshot_lock
+static const char *load(const std::string &path)
+{
+    struct stat st;
+    const unsigned char *map;
+    size_t pos;
+    uint32_t key_len, der_len;
+    int fd;
+
+    fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return errno == ENOENT ? NULL : "Error opening snapshot";
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return "Error opening snapshot";
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    map = (const unsigned char *)mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return "Error opening snapshot";
+    snapshot_map = map;
+    snapshot_map_len = (size_t)st.st_size;
+
+    if (snapshot_map_len < SNAPSHOT_MAGIC_LEN
+        || memcmp(map, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) != 0) {
+        unmap();
+        return "Invalid snapshot file";
+    }
+    pos = SNAPSHOT_MAGIC_LEN;
+    while (snapshot_map_len - pos >= 2 * sizeof(uint32_t)) {
+        memcpy(&key_len, map + pos, sizeof(key_len));
+        memcpy(&der_len, map + pos + sizeof(key_len), sizeof(der_len));
+        pos += 2 * sizeof(uint32_t);
+        if (snapshot_map_len - pos < (size_t)key_len + der_len)
+            break;
+        snapshotRecord &record = snapshot_index[std::string((const char *)map + pos, key_len)];
+        record.offset = pos + key_len;
+        record.len = der_len;
+        pos += (size_t)key_len + der_len;
+    }
+    snapshot_stats.loaded += snapshot_index.size();
+    if (snapshot_index.empty())
+        unmap();
+    return NULL;
+}
+
+// Writes to a temporary file renamed over path, so readers only ever see
+// complete snapshots. The file name is unique, other processes saving to
+// the same path never write to it.
+static const char *save(const std::string &path)
+{
+    std::lock_guard<std::mutex> save_guard(save_lock);
+    std::vector<std::pair<std::string, std::string>> entries;
+    std::string tmp = path + ".XXXXXX";
+    FILE *f;
+    uint32_t lens[2];
+    int fd, ok;
+
+    cache_entries(&entries);
+    fd = mkstemp(&tmp[0]);
+    if (fd < 0)
+        return "Error writing snapshot";
+    f = fdopen(fd, "wb");
+    if (f == NULL) {
+        close(fd);
+        remove(tmp.c_str());
+        return "Error writing snapshot";
+    }
+    ok = fwrite(SNAPSHOT_MAGIC, 1, SNAPSHOT_MAGIC_LEN, f) == SNAPSHOT_MAGIC_LEN;
+    for (size_t i = 0; ok && i < entries.size(); i++) {
+        lens[0] = (uint32_t)entries[i].first.size();
+        lens[1] = (uint32_t)entries[i].second.size();
+        ok = fwrite(lens, sizeof(lens), 1, f) == 1
+            && fwrite(entries[i].first.data(), 1, lens[0], f) == lens[0]
+            && fwrite(entries[i].second.data(), 1, lens[1], f) == lens[1];
+    }
+    ok = fflush(f) == 0 && fsync(fileno(f)) == 0 && ok;
+    if (fclose(f) != 0 || !ok || rename(tmp.c_str(), path.c_str()) != 0) {
+        remove(tmp.c_str());
+        return "Error writing snapshot";
+    }
+
+    std::lock_guard<std::mutex> guard(snapshot_lock);
+    snapshot_stats.written += entries.size();
+    return NULL;
+}
+
+static void run_writer()
+{
+    std::unique_lock<std::mutex> lock(snapshot_lock);
+
+    for (;;) {
+        unsigned long generation = snapshot_generation;
+        if (snapshot_path.empty() || snapshot_interval == 0) {
+            snapshot_cv->wait(lock);
+            continue;
+        }
+        if (snapshot_cv->wait_for(lock, std::chrono::seconds(snapshot_interval),
+                                  [generation] { return generation != snapshot_generation; }))
+            continue;
+        std::string path = snapshot_path;
+        lock.unlock();
+        save(path);
+        lock.lock();
+    }
+}
+
+const char *configure_snapshot(const char *path, long interval)
+{
+    const char *error = NULL;
+    std::string last;
+
+    {
+        std::lock_guard<std::mutex> guard(snapshot_lock);
+        if (snapshot_cv == NULL) {
+            snapshot_cv = new std::condition_variable();
+            std::thread(run_writer).detach();
+        }
+        last = snapshot_path;
+        unmap();
+        snapshot_path = path != NULL ? path : "";
+        snapshot_interval = interval;
+        snapshot_generation++;
+        if (!snapshot_path.empty())
+            error = load(snapshot_path);
+        // Never save over a file that is not a snapshot
+        if (error != NULL)
+            snapshot_path.clear();
+        snapshot_cv->notify_all();
+    }
+    if (path == NULL || path[0] == '\0') {
+        if (!last.empty())
+            error = save(last);
+    }
+    return error;
+}
+
+const char *write_snapshot()
+{
+    std::string path;
+
+    {
+        std::lock_guard<std::mutex> guard(snapshot_lock);
+        path = snapshot_path;
+    }
+    if (path.empty())
+        return "No snapshot file configured";
+    return save(path);
+}
+
+snapshotStats get_snapshot_stats()
+{
+    std::lock_guard<std::mutex> guard(snapshot_lock);
+    snapshotStats stats = snapshot_stats;
+    stats.pending = snapshot_index.size();
+    return stats;
+}
+
+int snapshot_take(const std::string &key, std::string *der)
+{
+    std::lock_guard<std::mutex> guard(snapshot_lock);
+
+    if (snapshot_index.empty())
+        return 0;
+    auto it = snapshot_index.find(key);
+    if (it == snapshot_index.end())
+        return 0;
+    der->assign((const char *)snapshot_map + it->second.offset, it->second.len);
+    snapshot_index.erase(it);
+    if (snapshot_index.empty())
+        unmap();
+    return 1;
+}
+
+void snapshot_verified(int ok)
+{
+    std::lock_guard<std::mutex> guard(snapshot_lock);
+    if (ok)
+        snapshot_stats.served++;
+    else
+        snapshot_stats.rejected++;
+}
@@ -0,0 +1,36 @@
+#ifndef OCSP_SNAPSHOT_H
+#define OCSP_SNAPSHOT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+struct snapshotStats {
+    uint64_t loaded = 0;
+    uint64_t served = 0;
+    // failed signature or validity checks when first looked up
+    uint64_t rejected = 0;
+    uint64_t written = 0;
+    // loaded responses not looked up yet
+    size_t pending = 0;
+};
+
+// Maps the responses saved at path, replacing any loaded before, and saves
+// the cached responses there every interval seconds (0 only saves on
+// write_snapshot). An empty path saves one last time and stops saving.
+// Returns NULL on success or an error string.
+const char *configure_snapshot(const char *path, long interval);
+
+// Saves the cached responses now. Returns NULL on success or an error string.
+const char *write_snapshot();
+
+snapshotStats get_snapshot_stats();
+
+// Moves the loaded DER response for key into der, each one is handed out
+// once and then lives in the cache. Returns 0 when there is none.
+int snapshot_take(const std::string &key, std::string *der);
+
+// Reports whether a response from snapshot_take passed verification.
+void snapshot_verified(int ok);
+
+#endif
@@ -0,0 +1,257 @@
+#include <sys/stat.h>
+#include <atomic>
+#include <cstdlib>
+#include <ctime>
+#include <mutex>
+#include <string>
+
+#include <openssl/err.h>
+#include <openssl/pem.h>
+#include <openssl/x509v3.h>
+
+#include "store.h"
+
+struct storeConfig {
+    std::string CAfile;
+    std::string CApath;
+    std::string CApem;
+    long reload_interval = 60;
+};
+
+struct fileStamp {
+    time_t mtime = 0;
+    ino_t ino = 0;
+    off_t size = 0;
+};
+
+// shared_store is only ever swapped, never modified once published, so
+// the lock just guards the pointer and the reload bookkeeping.
+static std::mutex store_lock;
+static X509_STORE *shared_store = NULL;
+static storeConfig store_config;
+static unsigned long store_generation = 0;
+static time_t store_checked = 0;
+static fileStamp CAfile_stamp, CApath_stamp;
+static std::atomic_flag store_reloading = ATOMIC_FLAG_INIT;
+
+static bool stamp_differs(const fileStamp &a, const fileStamp &b)
+{
+    return a.mtime != b.mtime || a.ino != b.ino || a.size != b.size;
+}
+
+static fileStamp stamp_path(const char *path)
+{
+    fileStamp stamp;
+    struct stat st;
+
+    if (path != NULL && stat(path, &st) == 0) {
+        stamp.mtime = st.st_mtime;
+        stamp.ino = st.st_ino;
+        stamp.size = st.st_size;
+    }
+    return stamp;
+}
+
+static bool use_defaults(const storeConfig &cfg)
+{
+    return cfg.CAfile.empty() && cfg.CApath.empty() && cfg.CApem.empty();
+}
+
+// Same lookup order as X509_LOOKUP_load_file/add_dir with X509_FILETYPE_DEFAULT
+static const char *watched_file(const storeConfig &cfg)
+{
+    const char *file;
+
+    if (!cfg.CAfile.empty())
+        return cfg.CAfile.c_str();
+    if (!use_defaults(cfg))
+        return NULL;
+    file = getenv(X509_get_default_cert_file_env());
+    return file != NULL ? file : X509_get_default_cert_file();
+}
+
+static const char *watched_dir(const storeConfig &cfg)
+{
+    const char *dir;
+
+    if (!cfg.CApath.empty())
+        return cfg.CApath.c_str();
+    if (!use_defaults(cfg))
+        return NULL;
+    dir = getenv(X509_get_default_cert_dir_env());
+    return dir != NULL ? dir : X509_get_default_cert_dir();
+}
+
+static int load_pem_bundle(X509_STORE *store, const std::string &pem)
+{
+    BIO *bio = NULL;
+    STACK_OF(X509_INFO) *infos = NULL;
+    int i, loaded = 0;
+
+    bio = BIO_new_mem_buf(pem.data(), (int)pem.size());
+    if (bio == NULL)
+        goto end;
+    infos = PEM_X509_INFO_read_bio(bio, NULL, NULL, NULL);
+    if (infos == NULL)
+        goto end;
+    for (i = 0; i < sk_X509_INFO_num(infos); i++) {
+        X509_INFO *info = sk_X509_INFO_value(infos, i);
+        if (info->x509 == NULL)
+            continue;
+        if (!X509_STORE_add_cert(store, info->x509))
+            goto end;
+        loaded++;
+    }
+
+ end:
+    sk_X509_INFO_pop_free(infos, X509_INFO_free);
+    BIO_free(bio);
+    return loaded;
+}
+
+static X509_STORE *build_store(ocspCheck *retval, const storeConfig &cfg)
+{
+    X509_STORE *store;
+    int noCAfile = 0, noCApath = 0;
+
+    if (!use_defaults(cfg)) {
+        noCAfile = cfg.CAfile.empty();
+        noCApath = cfg.CApath.empty();
+    }
+    store = setup_verify(retval,
+                         cfg.CAfile.empty() ? NULL : cfg.CAfile.c_str(),
+                         cfg.CApath.empty() ? NULL : cfg.CApath.c_str(),
+                         noCAfile, noCApath);
+    if (store == NULL)
+        return NULL;
+
+    if (!cfg.CApem.empty() && load_pem_bundle(store, cfg.CApem) == 0) {
+        retval->errorStr = "Error loading PEM bundle";
+        X509_STORE_free(store);
+        return NULL;
+    }
+    ERR_clear_error();
+    return store;
+}
+
+// Publishes store unless configure_store ran since generation was read.
+static void install_store(X509_STORE *store, unsigned long generation)
+{
+    X509_STORE *old;
+
+    {
+        std::lock_guard<std::mutex> guard(store_lock);
+        if (generation != store_generation) {
+            old = store;
+        } else {
+            old = shared_store;
+            shared_store = store;
+        }
+    }
+    // In-flight lookups hold their own reference
+    X509_STORE_free(old);
+}
+
+static void reload_if_changed(const storeConfig &cfg, unsigned long generation)
+{
+    ocspCheck retval;
+    X509_STORE *store;
+    fileStamp file = stamp_path(watched_file(cfg));
+    fileStamp dir = stamp_path(watched_dir(cfg));
+
+    {
+        std::lock_guard<std::mutex> guard(store_lock);
+        if (generation != store_generation)
+            return;
+        if (!stamp_differs(file, CAfile_stamp) && !stamp_differs(dir, CApath_stamp))
+            return;
+        CAfile_stamp = file;
+        CApath_stamp = dir;
+    }
+
+    // Keep serving the previous store if the new files do not load
+    store = build_store(&retval, cfg);
+    if (store != NULL)
+        install_store(store, generation);
+}
+
+const char *configure_store(const char *CAfile, const char *CApath,
+                            const char *CApem, long reload_interval)
+{
+    ocspCheck retval;
+    storeConfig cfg;
+    X509_STORE *store;
+    fileStamp file, dir;
+    unsigned long generation;
+
+    if (CAfile != NULL)
+        cfg.CAfile = CAfile;
+    if (CApath != NULL)
+        cfg.CApath = CApath;
+    if (CApem != NULL)
+        cfg.CApem = CApem;
+    cfg.reload_interval = reload_interval;
+
+    file = stamp_path(watched_file(cfg));
+    dir = stamp_path(watched_dir(cfg));
+    store = build_store(&retval, cfg);
+    if (store == NULL)
+        return retval.errorStr != NULL ? retval.errorStr : "Error creating trust store";
+
+    {
+        std::lock_guard<std::mutex> guard(store_lock);
+        generation = ++store_generation;
+        store_config = cfg;
+        store_checked = time(NULL);
+        CAfile_stamp = file;
+        CApath_stamp = dir;
+    }
+    install_store(store, generation);
+    return NULL;
+}
+
+X509_STORE *get_shared_store(ocspCheck *retval)
+{
+    X509_STORE *store = NULL;
+    storeConfig cfg;
+    unsigned long generation;
+    bool check = false;
+    time_t now = time(NULL);
+
+    {
+        std::lock_guard<std::mutex> guard(store_lock);
+        if (shared_store != NULL) {
+            X509_STORE_up_ref(shared_store);
+            store = shared_store;
+        }
+        if (store_config.reload_interval > 0
+            && now - store_checked >= store_config.reload_interval) {
+            store_checked = now;
+            check = true;
+        }
+        if (check || store == NULL) {
+            cfg = store_config;
+            generation = store_generation;
+        }
+    }
+
+    if (store == NULL) {
+        // Module init could not build the store; retry with the current config
+        store = build_store(retval, cfg);
+        if (store == NULL) {
+            if (retval->errorStr == NULL)
+                retval->errorStr = "Error creating trust store";
+            return NULL;
+        }
+        X509_STORE_up_ref(store);
+        install_store(store, generation);
+        return store;
+    }
+
+    // A single caller rebuilds; everybody else keeps using the current store
+    if (check && !store_reloading.test_and_set()) {
+        reload_if_changed(cfg, generation);
+        store_reloading.clear();
+    }
+    return store;
+}
@@ -0,0 +1,21 @@
+#ifndef OCSP_STORE_H
+#define OCSP_STORE_H
+
+#include <openssl/x509.h>
+
+#include "helper.h"
+
+// Builds the process-wide trust store used by OCSP_basic_verify.
+// Any of CAfile, CApath and CApem may be NULL; when all are NULL the
+// OpenSSL default CA file and hash directory are used, like setup_verify.
+// CAfile and CApath are re-checked every reload_interval seconds
+// (0 disables hot reload) and the store is rebuilt when they change.
+// Returns NULL on success, or an error string.
+const char *configure_store(const char *CAfile, const char *CApath,
+                            const char *CApem, long reload_interval);
+
+// Returns a reference to the current shared store, or NULL on error.
+// The caller owns the reference and releases it with X509_STORE_free.
+X509_STORE *get_shared_store(ocspCheck *retval);
+
+#endif
@@ -0,0 +1,220 @@
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "workers.h"
+
+struct workerTask {
+    std::string responder;
+    worker_execute_cb execute;
+    worker_complete_cb complete;
+    void *data;
+    int status;
+};
+
+static std::mutex workers_lock;
+// Never destroyed, detached threads may still wait on it at exit
+static std::condition_variable *workers_cv = NULL;
+// Indexed by priority
+static std::deque<workerTask> workers_queue[2];
+// Tasks running per responder
+static std::unordered_map<std::string, size_t> workers_running;
+static size_t workers_wanted = 0;
+static size_t workers_threads = 0;
+static size_t workers_per_host = 0;
+static size_t workers_max_queued = 0;
+static int workers_shed = 0;
+static size_t workers_active = 0;
+static uint64_t workers_completed = 0;
+static uint64_t workers_rejected = 0;
+static uint64_t workers_shed_count = 0;
+
+// Main thread only
+static uv_async_t workers_async;
+static size_t workers_pending = 0;
+
+static std::mutex done_lock;
+static std::vector<workerTask> done_tasks;
+
+// Caller holds workers_lock
+static size_t queued()
+{
+    return workers_queue[WORKER_HIGH].size() + workers_queue[WORKER_LOW].size();
+}
+
+// Caller holds workers_lock
+static int throttled(const workerTask &task)
+{
+    if (workers_per_host == 0 || task.responder.empty())
+        return 0;
+    auto it = workers_running.find(task.responder);
+    return it != workers_running.end() && it->second >= workers_per_host;
+}
+
+static void run_worker()
+{
+    std::unique_lock<std::mutex> lock(workers_lock);
+
+    for (;;) {
+        // Threads above the wanted count exit, the last one only once the
+        // queue is drained
+        if (workers_threads > (workers_wanted > 0 || queued() == 0 ? workers_wanted : 1))
+            break;
+        std::deque<workerTask> *queue = &workers_queue[WORKER_HIGH];
+        auto it = queue->begin();
+        while (it != queue->end() && throttled(*it))
+            ++it;
+        if (it == queue->end()) {
+            queue = &workers_queue[WORKER_LOW];
+            it = queue->begin();
+            while (it != queue->end() && throttled(*it))
+                ++it;
+        }
+        // Woken again by new tasks, the thread finishing a task of a
+        // throttled responder picks up the next one itself
+        if (it == queue->end()) {
+            workers_cv->wait(lock);
+            continue;
+        }
+        workerTask task = *it;
+        queue->erase(it);
+        if (!task.responder.empty())
+            workers_running[task.responder]++;
+        workers_active++;
+        lock.unlock();
+
+        task.execute(task.data);
+
+        // Counted before completion runs, so stats read there include it
+        lock.lock();
+        workers_active--;
+        workers_completed++;
+        if (!task.responder.empty() && --workers_running[task.responder] == 0)
+            workers_running.erase(task.responder);
+        {
+            std::lock_guard<std::mutex> guard(done_lock);
+            done_tasks.push_back(task);
+        }
+        uv_async_send(&workers_async);
+    }
+    workers_threads--;
+}
+
+static void drain_done(uv_async_t *)
+{
+    std::vector<workerTask> tasks;
+
+    {
+        std::lock_guard<std::mutex> guard(done_lock);
+        tasks.swap(done_tasks);
+    }
+    for (size_t i = 0; i < tasks.size(); i++) {
+        // Only pending tasks keep the process alive
+        if (--workers_pending == 0)
+            uv_unref((uv_handle_t *)&workers_async);
+        tasks[i].complete(tasks[i].data, tasks[i].status);
+    }
+}
+
+void configure_workers(uv_loop_t *loop, size_t threads, size_t max_per_host,
+                       size_t max_queued, int shed)
+{
+    std::lock_guard<std::mutex> guard(workers_lock);
+
+    if (workers_cv == NULL) {
+        workers_cv = new std::condition_variable();
+        uv_async_init(loop, &workers_async, drain_done);
+        uv_unref((uv_handle_t *)&workers_async);
+    }
+    workers_wanted = threads;
+    workers_per_host = max_per_host;
+    workers_max_queued = max_queued;
+    workers_shed = shed;
+    while (workers_threads < threads) {
+        std::thread(run_worker).detach();
+        workers_threads++;
+    }
+    workers_cv->notify_all();
+}
+
+int workers_enabled()
+{
+    std::lock_guard<std::mutex> guard(workers_lock);
+    return workers_wanted > 0;
+}
+
+void get_worker_limits(size_t *max_per_host, size_t *max_queued, int *shed)
+{
+    std::lock_guard<std::mutex> guard(workers_lock);
+    *max_per_host = workers_per_host;
+    *max_queued = workers_max_queued;
+    *shed = workers_shed;
+}
+
+workerStats get_worker_stats()
+{
+    std::lock_guard<std::mutex> guard(workers_lock);
+    workerStats stats;
+
+    stats.threads = workers_threads;
+    stats.active = workers_active;
+    stats.queued = queued();
+    for (int priority = WORKER_HIGH; priority <= WORKER_LOW; priority++) {
+        for (size_t i = 0; i < workers_queue[priority].size(); i++) {
+            if (throttled(workers_queue[priority][i]))
+                stats.throttled++;
+        }
+    }
+    stats.completed = workers_completed;
+    stats.rejected = workers_rejected;
+    stats.shed = workers_shed_count;
+    return stats;
+}
+
+// Completes a task that did not run, on the loop as if it had
+static void turn_away(workerTask task, int status)
+{
+    task.status = status;
+    {
+        std::lock_guard<std::mutex> guard(done_lock);
+        done_tasks.push_back(task);
+    }
+    uv_async_send(&workers_async);
+}
+
+void workers_submit(const std::string &responder, int priority, worker_execute_cb execute,
+                    worker_complete_cb complete, void *data)
+{
+    workerTask task = { responder, execute, complete, data, WORKER_DONE };
+    workerTask shed;
+    int status = WORKER_DONE;
+
+    if (workers_pending++ == 0)
+        uv_ref((uv_handle_t *)&workers_async);
+    {
+        std::lock_guard<std::mutex> guard(workers_lock);
+        if (workers_max_queued > 0 && queued() >= workers_max_queued) {
+            if (workers_shed && !workers_queue[WORKER_LOW].empty()) {
+                shed = workers_queue[WORKER_LOW].front();
+                workers_queue[WORKER_LOW].pop_front();
+                workers_shed_count++;
+                status = WORKER_SHED;
+            } else {
+                workers_rejected++;
+                status = WORKER_REJECTED;
+            }
+        }
+        if (status != WORKER_REJECTED)
+            workers_queue[priority].push_back(task);
+    }
+    if (status == WORKER_REJECTED) {
+        turn_away(task, WORKER_REJECTED);
+        return;
+    }
+    if (status == WORKER_SHED)
+        turn_away(shed, WORKER_SHED);
+    workers_cv->notify_one();
+}
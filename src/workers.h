@@ -0,0 +1,60 @@
+#ifndef OCSP_WORKERS_H
+#define OCSP_WORKERS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+#include <uv.h>
+
+// Task priorities, high priority tasks run first
+#define WORKER_HIGH 0
+#define WORKER_LOW 1
+
+// How a task completed
+#define WORKER_DONE 0
+// turned away by a full queue, or dropped from it for a newer task
+#define WORKER_REJECTED 1
+#define WORKER_SHED 2
+
+struct workerStats {
+    size_t threads = 0;
+    // tasks running, and waiting for a thread or for their responder
+    // to drop below max_per_host
+    size_t active = 0;
+    size_t queued = 0;
+    size_t throttled = 0;
+    uint64_t completed = 0;
+    uint64_t rejected = 0;
+    uint64_t shed = 0;
+};
+
+// Runs on a worker thread
+typedef void (*worker_execute_cb)(void *data);
+// Runs on the loop passed to configure_workers once execute returned, or
+// without execute having run when status is not WORKER_DONE
+typedef void (*worker_complete_cb)(void *data, int status);
+
+// Runs lookups on `threads` threads of the module's own (0 leaves them to
+// the libuv threadpool), at most max_per_host at a time per responder (0
+// for no limit). Threads above a lowered count exit once their task is
+// done. Once max_queued tasks wait (0 for no limit), new ones are
+// rejected, or with shed the oldest low priority one is dropped for them.
+// Main thread only.
+void configure_workers(uv_loop_t *loop, size_t threads, size_t max_per_host,
+                       size_t max_queued, int shed);
+
+int workers_enabled();
+
+// The limits last passed to configure_workers, which the event engine
+// applies to its lookups as well
+void get_worker_limits(size_t *max_per_host, size_t *max_queued, int *shed);
+
+workerStats get_worker_stats();
+
+// Queues a task for responder, a host:port string or empty for tasks not
+// contacting one. Main thread only.
+void workers_submit(const std::string &responder, int priority, worker_execute_cb execute,
+                    worker_complete_cb complete, void *data);
+
+#endif
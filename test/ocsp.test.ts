@@ -1,3 +1,8 @@
+import * as childProcess from 'child_process';
+import * as fs from 'fs';
+import * as net from 'net';
+import * as os from 'os';
+import * as path from 'path';
 import * as tls from 'tls';
 
 import * as ocsp from '../index';
@@ -287,7 +292,11 @@ gA/7zuIpalhQ6abX6xwyNrVip8H65g==
                         statusStr: ocsp.CertificateStatus.Good,
                         reason: 0,
                         reasonStr: ocsp.RevokedStatus.Unspecified,
+                        thisUpdate: expect.any(Number),
                     });
+                    expect(response!.thisUpdate).toBeLessThanOrEqual(
+                        Date.now() + 5 * 60 * 1000
+                    );
                     socket.removeAllListeners();
                     socket.end();
                     socket.destroy();
@@ -337,6 +346,23 @@ describe('wrong OCSP requests', () => {
             }
         );
     });
+    test('concurrent identical lookups all get the result', done => {
+        let pending = 3;
+        for (let i = 0; i < 3; i++) {
+            ocsp.getRevocationStatusAsyncForTesting(
+                '',
+                '',
+                '',
+                '',
+                (err, response) => {
+                    expect(err).toBe('Error parsing URL');
+                    if (--pending === 0) {
+                        done();
+                    }
+                }
+            );
+        }
+    });
     test('Wrong issuer', done => {
         ocsp.getRevocationStatusAsyncForTesting(
             '',
@@ -349,6 +375,18 @@ describe('wrong OCSP requests', () => {
             }
         );
     });
+    test('Wrong DER issuer', done => {
+        ocsp.getRevocationStatusDerAsyncForTesting(
+            Buffer.alloc(0),
+            Buffer.from('not DER'),
+            '',
+            'http://ocsp.sca1b.amazontrust.com',
+            (err, response) => {
+                expect(err).toBe('Unable to load issuer certificate');
+                done();
+            }
+        );
+    });
     test('Wrong cert', done => {
         ocsp.getRevocationStatusAsyncForTesting(
             '',
@@ -543,3 +581,976 @@ lszJxb8EfsdWlTq9MriACO4CK8AEBvs48zdWqLRzJoS2uh1dFOCXHK3hcymQVVh0
         );
     });
 });
+
+describe('trust store', () => {
+    test('Error loading file', () => {
+        expect(() =>
+            ocsp.configureTrustStore({ caFile: '/nonexistent/ca.pem' })
+        ).toThrow('Error loading file');
+        // the previous store is kept, reset to the defaults anyway
+        ocsp.configureTrustStore({});
+    });
+});
+
+describe('issuer registry', () => {
+    test('Unable to load issuer certificate', () => {
+        expect(() => ocsp.registerIssuer(Buffer.from('not DER'))).toThrow(
+            'Unable to load issuer certificate'
+        );
+    });
+    test('Unknown issuer', done => {
+        expect(ocsp.unregisterIssuer('00')).toBe(false);
+        ocsp.getRevocationStatusForIssuerAsync(
+            Buffer.alloc(0),
+            '00',
+            'http://ocsp.sca1b.amazontrust.com',
+            (err, response) => {
+                expect(err).toBe('Unknown issuer');
+                done();
+            }
+        );
+    });
+});
+
+describe('batched lookups', () => {
+    test('results follow the order of entries', done => {
+        ocsp.getRevocationStatusBatchAsync(
+            [
+                {
+                    cert: Buffer.alloc(0),
+                    issuer: Buffer.alloc(0),
+                    url: 'http://ocsp.sca1b.amazontrust.com',
+                },
+                {
+                    cert: Buffer.alloc(0),
+                    issuer: '00',
+                    url: 'http://ocsp.sca1b.amazontrust.com',
+                },
+            ],
+            {},
+            (err, results) => {
+                expect(err).toBe(null);
+                expect(results!.map(result => result.error)).toEqual([
+                    'Unable to load issuer certificate',
+                    'Unknown issuer',
+                ]);
+                done();
+            }
+        );
+    });
+});
+
+describe('bulk lookups', () => {
+    const entries = [
+        {
+            cert: Buffer.alloc(0),
+            issuer: Buffer.alloc(0),
+            url: 'http://ocsp.sca1b.amazontrust.com',
+        },
+        {
+            cert: Buffer.alloc(0),
+            issuer: '00',
+            url: 'http://ocsp.digicert.com',
+        },
+        {
+            cert: Buffer.alloc(0),
+            issuer: '00',
+            url: 'http://ocsp.sca1b.amazontrust.com',
+        },
+    ];
+    test('objects', async () => {
+        const results = await ocsp.getRevocationStatusMany(entries);
+        expect((results as ocsp.BatchResult[]).map(r => r.error)).toEqual([
+            'Unable to load issuer certificate',
+            'Unknown issuer',
+            'Unknown issuer',
+        ]);
+    });
+    test('typed arrays', async () => {
+        const results = (await ocsp.getRevocationStatusMany(entries, {
+            typed: true,
+        })) as ocsp.TypedResults;
+        expect(Array.from(results.error)).toEqual([1, 2, 2]);
+        expect(results.errors).toEqual([
+            'Unable to load issuer certificate',
+            'Unknown issuer',
+        ]);
+        expect(Array.from(results.status)).toEqual([-1, -1, -1]);
+    });
+    test('no entries', async () => {
+        expect(await ocsp.getRevocationStatusMany([])).toEqual([]);
+    });
+});
+
+describe('stapled responses', () => {
+    test('Unable to load issuer certificate', () => {
+        expect(() =>
+            ocsp.verifyStapledResponse(
+                Buffer.from('not DER'),
+                Buffer.alloc(0),
+                Buffer.alloc(0)
+            )
+        ).toThrow('Unable to load issuer certificate');
+    });
+    test('Unknown issuer', done => {
+        ocsp.verifyStapledResponseAsync(
+            Buffer.from('not DER'),
+            Buffer.alloc(0),
+            '00',
+            (err, response) => {
+                expect(err).toBe('Unknown issuer');
+                done();
+            }
+        );
+    });
+});
+
+// Parses fine, the responder is whatever the tests point it to
+const certPem = `-----BEGIN CERTIFICATE-----
+MIIFdzCCBF+gAwIBAgIQCXekOMYr/qbDSHzhdAH7szANBgkqhkiG9w0BAQsFADBG
+MQswCQYDVQQGEwJVUzEPMA0GA1UEChMGQW1hem9uMRUwEwYDVQQLEwxTZXJ2ZXIg
+Q0EgMUIxDzANBgNVBAMTBkFtYXpvbjAeFw0xODA5MjEwMDAwMDBaFw0xOTEwMjEx
+MjAwMDBaMBgxFjAUBgNVBAMTDWRhdGFkb2docS5jb20wggEiMA0GCSqGSIb3DQEB
+AQUAA4IBDwAwggEKAoIBAQC7VnIMiWl89z1CDASb90CGd8321Jzm7bqYjmx/uJtw
+gt/gArDxQxJ5ldisumsjirKSegBpzncRuC4fnDf/vaT0sYpYFPOcL1zJ7eKq+V03
+AIh2rGpskUtbW2waUz0pbW5fyxZ7fC1LD4TYLu4TT5O4XV33st+O5nfWdXq6dIgU
+5I9ZLmzuc8MQFHQbIVgM2QAtJq/uLYayLLySJeKZ2T90uQDj8orUlTDJf65D7Yy3
+fsI9WfjuWaTIPsmhMFlRUZQZf5FnvxxFE5DrmnIwi05+JMhJcETGymQkfulZNkmI
+550VfB9M8YRRlBQ1bOKAZ+3kcZN7nzzIM7aLRayMojpLAgMBAAGjggKNMIICiTAf
+BgNVHSMEGDAWgBRZpGYGUqB7lZI8o5QHJ5Z0W/k90DAdBgNVHQ4EFgQUsaUEh5Aj
+d5mYgl+LbR1RyaVD8RUwKwYDVR0RBCQwIoINZGF0YWRvZ2hxLmNvbYIRd3d3LmRh
+dGFkb2docS5jb20wDgYDVR0PAQH/BAQDAgWgMB0GA1UdJQQWMBQGCCsGAQUFBwMB
+BggrBgEFBQcDAjA7BgNVHR8ENDAyMDCgLqAshipodHRwOi8vY3JsLnNjYTFiLmFt
+YXpvbnRydXN0LmNvbS9zY2ExYi5jcmwwIAYDVR0gBBkwFzALBglghkgBhv1sAQIw
+CAYGZ4EMAQIBMHUGCCsGAQUFBwEBBGkwZzAtBggrBgEFBQcwAYYhaHR0cDovL29j
+c3Auc2NhMWIuYW1hem9udHJ1c3QuY29tMDYGCCsGAQUFBzAChipodHRwOi8vY3J0
+LnNjYTFiLmFtYXpvbnRydXN0LmNvbS9zY2ExYi5jcnQwDAYDVR0TAQH/BAIwADCC
+AQUGCisGAQQB1nkCBAIEgfYEgfMA8QB2AKS5CZC0GFgUh7sTosxncAo8NZgE+Rvf
+uON3zQ7IDdwQAAABZfmDRsQAAAQDAEcwRQIgGcTtvqH9JEgMumjNBAoGRz1VfyCX
+3YpOPd1rphjqM48CIQCfNhGbS+r1u4tkcoAjdBD//BSo5niTOK43eSac628XtgB3
+AId1v+dZfPiMQ5lfvfNu/1aNR1Y2/0q1YMG06v9eoIMPAAABZfmDR5kAAAQDAEgw
+RgIhALqkVYFm/KUD0u+zUQbYuk7u0Ks87ctWvL6GG7VhSmRhAiEAwdMHSWLdEj9K
+grKkDoPPz9HNaNkzroVh2cdBswwT3swwDQYJKoZIhvcNAQELBQADggEBADCTjA9g
+Ldhcn2wMf80SHdWoXaREmZhsMhETLDfOEU7sp5pNfBNdHpzAQtd2Et/Px5V3XhJI
+4zxc8FGHksAPQ/7esOvtgbkLqVw8d1hdz0Zy9VJ3DGWMU1QeHXQZd9mJzOLyx+10
+EZNDMX+x5ZxGLJURxru5uNCCoMzVZBNYOt77W3Vre1UL3lMVoeaN5KoKJtltya6Y
+0yebuvcfCCAZg791WYpupSVq5Z2tQbl5le9CFoWYnU5qL1pG9iprM/bQoDNV+tkW
+lszJxb8EfsdWlTq9MriACO4CK8AEBvs48zdWqLRzJoS2uh1dFOCXHK3hcymQVVh0
+6+xpb0/W0HZmE7c=
+-----END CERTIFICATE-----`;
+const issuerPem = `-----BEGIN CERTIFICATE-----
+MIIFdzCCBF+gAwIBAgIQCXekOMYr/qbDSHzhdAH7szANBgkqhkiG9w0BAQsFADBG
+MQswCQYDVQQGEwJVUzEPMA0GA1UEChMGQW1hem9uMRUwEwYDVQQLEwxTZXJ2ZXIg
+Q0EgMUIxDzANBgNVBAMTBkFtYXpvbjAeFw0xODA5MjEwMDAwMDBaFw0xOTEwMjEx
+MjAwMDBaMBgxFjAUBgNVBAMTDWRhdGFkb2docS5jb20wggEiMA0GCSqGSIb3DQEB
+AQUAA4IBDwAwggEKAoIBAQC7VnIMiWl89z1CDASb90CGd8321Jzm7bqYjmx/uJtw
+gt/gArDxQxJ5ldisumsjirKSegBpzncRuC4fnDf/vaT0sYpYFPOcL1zJ7eKq+V03
+AIh2rGpskUtbW2waUz0pbW5fyxZ7fC1LD4TYLu4TT5O4XV33st+O5nfWdXq6dIgU
+5I9ZLmzuc8MQFHQbIVgM2QAtJq/uLYayLLySJeKZ2T90uQDj8orUlTDJf65D7Yy3
+fsI9WfjuWaTIPsmhMFlRUZQZf5FnvxxFE5DrmnIwi05+JMhJcETGymQkfulZNkmI
+550VfB9M8YRRlBQ1bOKAZ+3kcZN7nzzIM7aLRayMojpLAgMBAAGjggKNMIICiTAf
+BgNVHSMEGDAWgBRZpGYGUqB7lZI8o5QHJ5Z0W/k90DAdBgNVHQ4EFgQUsaUEh5Aj
+d5mYgl+LbR1RyaVD8RUwKwYDVR0RBCQwIoINZGF0YWRvZ2hxLmNvbYIRd3d3LmRh
+dGFkb2docS5jb20wDgYDVR0PAQH/BAQDAgWgMB0GA1UdJQQWMBQGCCsGAQUFBwMB
+BggrBgEFBQcDAjA7BgNVHR8ENDAyMDCgLqAshipodHRwOi8vY3JsLnNjYTFiLmFt
+YXpvbnRydXN0LmNvbS9zY2ExYi5jcmwwIAYDVR0gBBkwFzALBglghkgBhv1sAQIw
+CAYGZ4EMAQIBMHUGCCsGAQUFBwEBBGkwZzAtBggrBgEFBQcwAYYhaHR0cDovL29j
+c3Auc2NhMWIuYW1hem9udHJ1c3QuY29tMDYGCCsGAQUFBzAChipodHRwOi8vY3J0
+LnNjYTFiLmFtYXpvbnRydXN0LmNvbS9zY2ExYi5jcnQwDAYDVR0TAQH/BAIwADCC
+AQUGCisGAQQB1nkCBAIEgfYEgfMA8QB2AKS5CZC0GFgUh7sTosxncAo8NZgE+Rvf
+uON3zQ7IDdwQAAABZfmDRsQAAAQDAEcwRQIgGcTtvqH9JEgMumjNBAoGRz1VfyCX
+3YpOPd1rphjqM48CIQCfNhGbS+r1u4tkcoAjdBD//BSo5niTOK43eSac628XtgB3
+AId1v+dZfPiMQ5lfvfNu/1aNR1Y2/0q1YMG06v9eoIMPAAABZfmDR5kAAAQDAEgw
+RgIhALqkVYFm/KUD0u+zUQbYuk7u0Ks87ctWvL6GG7VhSmRhAiEAwdMHSWLdEj9K
+grKkDoPPz9HNaNkzroVh2cdBswwT3swwDQYJKoZIhvcNAQELBQADggEBADCTjA9g
+Ldhcn2wMf80SHdWoXaREmZhsMhETLDfOEU7sp5pNfBNdHpzAQtd2Et/Px5V3XhJI
+4zxc8FGHksAPQ/7esOvtgbkLqVw8d1hdz0Zy9VJ3DGWMU1QeHXQZd9mJzOLyx+10
+EZNDMX+x5ZxGLJURxru5uNCCoMzVZBNYOt77W3Vre1UL3lMVoeaN5KoKJtltya6Y
+0yebuvcfCCAZg791WYpupSVq5Z2tQbl5le9CFoWYnU5qL1pG9iprM/bQoDNV+tkW
+lszJxb8EfsdWlTq9MriACO4CK8AEBvs48zdWqLRzJoS2uh1dFOCXHK3hcymQVVh0
+6+xpb0/W0HZmE7c=
+-----END CERTIFICATE-----`;
+
+describe('request options', () => {
+    test('per lookup', done => {
+        ocsp.getRevocationStatusAsyncForTesting(
+            '',
+            '',
+            '',
+            '',
+            err => {
+                expect(err).toBe('Error parsing URL');
+                done();
+            },
+            { nonce: false, get: true }
+        );
+    });
+    test('defaults', done => {
+        ocsp.configureRequests({ nonce: false, get: true });
+        ocsp.getRevocationStatusDerAsyncForTesting(
+            Buffer.alloc(0),
+            Buffer.alloc(0),
+            'Host=ocsp.sca1b.amazontrust.com',
+            'http://ocsp.sca1b.amazontrust.com',
+            err => {
+                expect(err).toBe('Unable to load issuer certificate');
+                ocsp.configureRequests({});
+                done();
+            }
+        );
+    });
+    test('Timeouts must be positive', () => {
+        expect(() =>
+            ocsp.getRevocationStatusAsyncForTesting(
+                '',
+                '',
+                '',
+                '',
+                () => undefined,
+                { timeout: -1 }
+            )
+        ).toThrow('Timeouts must be positive');
+        expect(() => ocsp.configureRequests({ readTimeout: -1 })).toThrow(
+            'Timeouts must be positive'
+        );
+        expect(() => ocsp.configureRequests({ timeout: Infinity })).toThrow(
+            'Timeouts must be positive'
+        );
+    });
+    test('timeouts name the phase that ran out', done => {
+        // Accepts the connection and never answers
+        const server = net.createServer(() => undefined);
+        server.listen(0, '127.0.0.1', () => {
+            const port = (server.address() as net.AddressInfo).port;
+            const started = Date.now();
+            ocsp.getRevocationStatusAsyncForTesting(
+                certPem,
+                issuerPem,
+                'Host=127.0.0.1',
+                `http://127.0.0.1:${port}`,
+                err => {
+                    expect(err).toBe('Timeout on read');
+                    expect(Date.now() - started).toBeLessThan(2000);
+                    server.close();
+                    done();
+                },
+                { timeout: 5000, readTimeout: 100 }
+            );
+        });
+    });
+});
+
+describe('response cache', () => {
+    test('stats', () => {
+        expect(ocsp.getCacheStats()).toMatchObject({
+            hits: expect.any(Number),
+            misses: expect.any(Number),
+            evictions: expect.any(Number),
+            size: expect.any(Number),
+        });
+    });
+    test('disabling the cache evicts everything', () => {
+        ocsp.configureCache({ maxEntries: 0, margin: 60 });
+        expect(ocsp.getCacheStats().size).toBe(0);
+        ocsp.configureCache({ maxEntries: 10000, margin: 60 });
+    });
+    test('peeking misses without a cached response', () => {
+        const der = (pem: string) =>
+            Buffer.from(pem.replace(/-----[A-Z ]+-----|\s/g, ''), 'base64');
+        const misses = ocsp.getCacheStats().peekMisses;
+        expect(
+            ocsp.peekRevocationStatus(der(certPem), der(issuerPem))
+        ).toBeUndefined();
+        expect(ocsp.getCacheStats().peekMisses).toBe(misses + 1);
+    });
+    test('Unable to load certificate', () => {
+        expect(() =>
+            ocsp.peekRevocationStatus(
+                Buffer.alloc(0),
+                Buffer.from(
+                    issuerPem.replace(/-----[A-Z ]+-----|\s/g, ''),
+                    'base64'
+                )
+            )
+        ).toThrow('Unable to load certificate');
+    });
+});
+
+describe('signer verification cache', () => {
+    test('stats', () => {
+        expect(ocsp.getSignerStats()).toMatchObject({
+            fast: expect.any(Number),
+            full: expect.any(Number),
+            size: expect.any(Number),
+        });
+    });
+});
+
+describe('shared cache', () => {
+    test('attaching and detaching', () => {
+        const name = `/ocsp-test-${process.pid}`;
+        ocsp.configureSharedCache({ name, slots: 16 });
+        expect(ocsp.getSharedCacheStats().slots).toBe(16);
+        ocsp.configureSharedCache({ name: '' });
+        expect(ocsp.getSharedCacheStats().slots).toBe(0);
+        if (fs.existsSync(`/dev/shm${name}`)) {
+            fs.unlinkSync(`/dev/shm${name}`);
+        }
+    });
+    test('Shared cache needs at least one slot', () => {
+        expect(() => ocsp.configureSharedCache({ name: '/ocsp', slots: 0 })).toThrow(
+            RangeError
+        );
+    });
+});
+
+describe('background refresh', () => {
+    test('stats', () => {
+        ocsp.configureRefresh({ concurrency: 2 });
+        expect(ocsp.getRefreshStats()).toMatchObject({
+            refreshed: 0,
+            failed: 0,
+            tracked: 0,
+            active: 0,
+        });
+        ocsp.configureRefresh({ concurrency: 0 });
+    });
+    test('fraction and jitter must leave part of the window', () => {
+        expect(() =>
+            ocsp.configureRefresh({ concurrency: 1, fraction: 0.8, jitter: 0.2 })
+        ).toThrow(RangeError);
+    });
+});
+
+describe('response snapshot', () => {
+    test('Invalid snapshot file', () => {
+        expect(() => ocsp.configureSnapshot({ path: __filename })).toThrow(
+            'Invalid snapshot file'
+        );
+        ocsp.configureSnapshot({ path: '' });
+    });
+    test('No snapshot file configured', () => {
+        expect(() => ocsp.writeSnapshot()).toThrow('No snapshot file configured');
+    });
+    test('saving and loading', () => {
+        const path = `${os.tmpdir()}/ocsp-snapshot-${process.pid}`;
+        ocsp.configureSnapshot({ path, interval: 0 });
+        ocsp.writeSnapshot();
+        ocsp.configureSnapshot({ path, interval: 0 });
+        expect(ocsp.getSnapshotStats().pending).toBe(ocsp.getCacheStats().size);
+        ocsp.configureSnapshot({ path: '' });
+        fs.unlinkSync(path);
+    });
+});
+
+describe('circuit breaker', () => {
+    test('opens after consecutive failures', async () => {
+        ocsp.configureBreaker({ failures: 2, cooldown: 60000 });
+        const lookup = () =>
+            new Promise(resolve =>
+                ocsp.getRevocationStatusAsyncForTesting(
+                    certPem,
+                    issuerPem,
+                    'Host=127.0.0.1',
+                    'http://127.0.0.1:1',
+                    err => resolve(err)
+                )
+            );
+        expect(await lookup()).toBe('Error querying OCSP responder');
+        expect(await lookup()).toBe('Error querying OCSP responder');
+        expect(await lookup()).toBe('Responder circuit open');
+        expect(ocsp.getBreakerStates()).toContainEqual(
+            expect.objectContaining({
+                responder: '127.0.0.1:1:tcp',
+                state: 'open',
+                consecutiveFailures: 2,
+                rejected: 1,
+            })
+        );
+        ocsp.configureBreaker({ failures: 0 });
+        expect(ocsp.getBreakerStates()).toEqual([]);
+    });
+});
+
+describe('worker threads', () => {
+    test('lookups are counted', done => {
+        ocsp.configureWorkers({ threads: 2, maxPerHost: 1 });
+        const completed = ocsp.getWorkerStats().completed;
+        ocsp.getRevocationStatusAsyncForTesting('', '', '', '', err => {
+            expect(err).toBe('Error parsing URL');
+            expect(ocsp.getWorkerStats()).toEqual(
+                expect.objectContaining({
+                    active: 0,
+                    queued: 0,
+                    throttled: 0,
+                    completed: completed + 1,
+                })
+            );
+            ocsp.configureWorkers({ threads: 4 });
+            done();
+        });
+    });
+    test('the libuv threadpool', done => {
+        ocsp.configureWorkers({ threads: 0 });
+        ocsp.getRevocationStatusAsyncForTesting('', '', '', '', err => {
+            expect(err).toBe('Error parsing URL');
+            ocsp.configureWorkers({ threads: 4 });
+            done();
+        });
+    });
+    test('Worker threads and limits must be positive', () => {
+        expect(() => ocsp.configureWorkers({ threads: -1 })).toThrow(
+            'Worker threads and limits must be positive'
+        );
+        expect(() =>
+            ocsp.configureWorkers({ threads: 4, maxQueued: Infinity })
+        ).toThrow('Worker threads and limits must be positive');
+        expect(() => ocsp.configureWorkers({ threads: 1e9 })).toThrow(
+            'Worker threads must be at most 1024'
+        );
+    });
+    describe('with a full queue', () => {
+        // Keeps the only thread busy until its read timeout
+        const server = net.createServer(() => undefined);
+        const lookup = (cert: string, options: ocsp.RequestOptions = {}) =>
+            new Promise(resolve =>
+                ocsp.getRevocationStatusAsyncForTesting(
+                    cert,
+                    issuerPem,
+                    'Host=127.0.0.1',
+                    `http://127.0.0.1:${
+                        (server.address() as net.AddressInfo).port
+                    }`,
+                    err => resolve(err),
+                    { readTimeout: 300, ...options }
+                )
+            );
+        const wait = (ms: number) =>
+            new Promise(resolve => setTimeout(resolve, ms));
+
+        beforeAll(done => server.listen(0, '127.0.0.1', done));
+        afterAll(done => {
+            ocsp.configureWorkers({ threads: 4 });
+            server.close(done);
+        });
+
+        test('new lookups are rejected', async () => {
+            ocsp.configureWorkers({ threads: 1, maxQueued: 1 });
+            const busy = lookup(certPem);
+            await wait(50);
+            const queued = lookup('queued');
+            expect(await lookup('rejected')).toBe('Lookup queue full');
+            expect(await queued).not.toBe('Lookup queue full');
+            expect(await busy).toBe('Timeout on read');
+            expect(ocsp.getWorkerStats().rejected).toBeGreaterThan(0);
+        });
+        test('low priority lookups are shed', async () => {
+            ocsp.configureWorkers({
+                threads: 1,
+                maxQueued: 1,
+                overflow: 'shed',
+            });
+            const busy = lookup(certPem);
+            await wait(50);
+            const background = lookup('background', { priority: 'low' });
+            const interactive = lookup('interactive');
+            expect(await background).toBe('Lookup shed from queue');
+            expect(await interactive).not.toBe('Lookup shed from queue');
+            expect(await busy).toBe('Timeout on read');
+            expect(ocsp.getWorkerStats().shed).toBeGreaterThan(0);
+        });
+    });
+});
+
+describe('event engine', () => {
+    test('lookups are answered by the engine', done => {
+        ocsp.configureEngine({ threads: 2 });
+        ocsp.getRevocationStatusAsyncForTesting('', '', '', '', err => {
+            expect(err).toBe('Error parsing URL');
+            ocsp.configureEngine({ threads: 0 });
+            done();
+        });
+    });
+    describe('with a full queue', () => {
+        // Keeps the only lookup the responder may have until its read timeout
+        const server = net.createServer(() => undefined);
+        const lookup = (cert: string, options: ocsp.RequestOptions = {}) =>
+            new Promise(resolve =>
+                ocsp.getRevocationStatusAsyncForTesting(
+                    cert,
+                    issuerPem,
+                    'Host=127.0.0.1',
+                    `http://127.0.0.1:${
+                        (server.address() as net.AddressInfo).port
+                    }`,
+                    err => resolve(err),
+                    { readTimeout: 300, ...options }
+                )
+            );
+
+        beforeAll(done => {
+            ocsp.configureEngine({ threads: 1 });
+            server.listen(0, '127.0.0.1', done);
+        });
+        afterAll(done => {
+            ocsp.configureEngine({ threads: 0 });
+            ocsp.configureWorkers({ threads: 4 });
+            server.close(done);
+        });
+
+        test('new lookups are rejected', async () => {
+            ocsp.configureWorkers({ threads: 4, maxPerHost: 1, maxQueued: 1 });
+            const rejected = ocsp.getWorkerStats().rejected;
+            const busy = lookup(certPem);
+            const queued = lookup('queued');
+            expect(ocsp.getWorkerStats().queued).toBe(1);
+            expect(await lookup('rejected')).toBe('Lookup queue full');
+            expect(await queued).not.toBe('Lookup queue full');
+            expect(await busy).toBe('Timeout on read');
+            expect(ocsp.getWorkerStats().rejected).toBe(rejected + 1);
+        });
+        test('low priority lookups are shed', async () => {
+            ocsp.configureWorkers({
+                threads: 4,
+                maxPerHost: 1,
+                maxQueued: 1,
+                overflow: 'shed',
+            });
+            const shed = ocsp.getWorkerStats().shed;
+            const busy = lookup(certPem);
+            const background = lookup('background', { priority: 'low' });
+            const interactive = lookup('interactive');
+            expect(await background).toBe('Lookup shed from queue');
+            expect(await interactive).not.toBe('Lookup shed from queue');
+            expect(await busy).toBe('Timeout on read');
+            expect(ocsp.getWorkerStats().shed).toBe(shed + 1);
+        });
+        test('lookups wait for room in flight', async () => {
+            ocsp.configureEngine({ threads: 1, maxInFlight: 1 });
+            ocsp.configureWorkers({ threads: 4, maxQueued: 1 });
+            const rejected = ocsp.getWorkerStats().rejected;
+            const busy = lookup(certPem);
+            const queued = lookup('queued');
+            expect(ocsp.getWorkerStats()).toMatchObject({
+                queued: 1,
+                throttled: 0,
+            });
+            expect(await lookup('rejected')).toBe('Lookup queue full');
+            expect(await queued).not.toBe('Lookup queue full');
+            expect(await busy).toBe('Timeout on read');
+            expect(ocsp.getWorkerStats().rejected).toBe(rejected + 1);
+            ocsp.configureEngine({ threads: 1 });
+        });
+        test('the in-flight limit must be positive', () => {
+            expect(() =>
+                ocsp.configureEngine({ threads: 1, maxInFlight: -1 })
+            ).toThrow('Engine in-flight limit must be positive');
+        });
+    });
+});
+
+describe('latency histograms', () => {
+    test('lookups are timed by phase', done => {
+        ocsp.getLatencyStats(true);
+        ocsp.getRevocationStatusAsyncForTesting(
+            '',
+            '',
+            '',
+            '',
+            (err, response) => {
+                expect(err).toBe('Error parsing URL');
+                expect(response.timings).toEqual({
+                    queue: expect.any(Number),
+                    callback: expect.any(Number),
+                    total: expect.any(Number),
+                });
+                const stats = ocsp.getLatencyStats(true)[''];
+                expect(stats.total.count).toBe(1);
+                expect(stats.total.p50).toBeLessThanOrEqual(stats.total.max);
+                expect(ocsp.getLatencyStats()['']).toEqual({});
+                done();
+            },
+            { timings: true }
+        );
+    });
+    test('results only carry timings when asked', done => {
+        ocsp.getRevocationStatusAsyncForTesting(
+            '',
+            '',
+            '',
+            '',
+            (err, response) => {
+                expect(err).toBe('Error parsing URL');
+                expect(response.timings).toBeUndefined();
+                done();
+            }
+        );
+    });
+});
+
+describe('tracing', () => {
+    // tslint:disable:no-var-requires
+    const diagnostics = require('diagnostics_channel');
+    const { performance } = require('perf_hooks');
+    // tslint:enable:no-var-requires
+
+    test('lookups publish start, phase and end events', done => {
+        const events: string[] = [];
+        const onStart = (lookup: ocsp.LookupTrace) => {
+            expect(lookup).toEqual({ url: '' });
+            events.push('start');
+        };
+        const onPhase = (phase: ocsp.PhaseTrace) => events.push(phase.phase);
+        const onEnd = (lookup: ocsp.LookupTrace) => {
+            events.push('end');
+            expect(lookup).toEqual({
+                url: '',
+                error: 'Error parsing URL',
+                certId: '',
+                responder: '',
+                cache: 'miss',
+                sent: 0,
+                received: 0,
+                timings: {
+                    queue: expect.any(Number),
+                    callback: expect.any(Number),
+                    total: expect.any(Number),
+                },
+            });
+        };
+        diagnostics.channel('ocsp:lookup:start').subscribe(onStart);
+        diagnostics.channel('ocsp:lookup:phase').subscribe(onPhase);
+        diagnostics.channel('ocsp:lookup:end').subscribe(onEnd);
+        ocsp.getRevocationStatusAsyncForTesting('', '', '', '', err => {
+            expect(err).toBe('Error parsing URL');
+            expect(events).toEqual([
+                'start',
+                'queue',
+                'callback',
+                'total',
+                'end',
+            ]);
+            diagnostics.channel('ocsp:lookup:start').unsubscribe(onStart);
+            diagnostics.channel('ocsp:lookup:phase').unsubscribe(onPhase);
+            diagnostics.channel('ocsp:lookup:end').unsubscribe(onEnd);
+            done();
+        });
+    });
+    // measure only takes options from Node 16
+    const measureOptions = Number(process.versions.node.split('.')[0]) >= 16;
+
+    (measureOptions ? test : test.skip)(
+        'lookups emit PerformanceEntries',
+        done => {
+            ocsp.configureTracing({ performanceEntries: true });
+            ocsp.getRevocationStatusAsyncForTesting('', '', '', '', err => {
+                expect(err).toBe('Error parsing URL');
+                ocsp.configureTracing({ performanceEntries: false });
+                const entries = performance.getEntriesByName('ocsp.lookup');
+                expect(entries.length).toBe(1);
+                expect(entries[0].detail.cache).toBe('miss');
+                performance.clearMeasures('ocsp.lookup');
+                done();
+            });
+        }
+    );
+    test('lookups complete with PerformanceEntries on any Node', done => {
+        ocsp.configureTracing({ performanceEntries: true });
+        ocsp.getRevocationStatusAsyncForTesting('', '', '', '', err => {
+            expect(err).toBe('Error parsing URL');
+            ocsp.configureTracing({ performanceEntries: false });
+            if (measureOptions) {
+                performance.clearMeasures('ocsp.lookup');
+            }
+            done();
+        });
+    });
+});
+
+describe('mock responder', () => {
+    const dir = fs.mkdtempSync(path.join(os.tmpdir(), 'ocsp-responder-'));
+    const der = (name: string) =>
+        Buffer.from(
+            fs
+                .readFileSync(path.join(dir, name), 'ascii')
+                .replace(/-----[^-]+-----|\s/g, ''),
+            'base64'
+        );
+    const lookup = (leaf: string) =>
+        new Promise<any>(resolve =>
+            ocsp.getRevocationStatusDerAsyncForTesting(
+                der(leaf),
+                der('ca.pem'),
+                'Host=127.0.0.1',
+                url,
+                (err, response) => resolve({ err, response })
+            )
+        );
+    const wait = (ms: number) =>
+        new Promise(resolve => setTimeout(resolve, ms));
+    let responder: childProcess.ChildProcess;
+    let url = '';
+
+    beforeAll(done => {
+        // Slow enough for concurrent lookups to overlap
+        responder = childProcess.spawn(
+            path.join(__dirname, '..', 'build', 'Release', 'ocsp_responder'),
+            ['--dir', dir, '--certs', '4', '--revoked', '2', '--latency', '50']
+        );
+        responder.stdout!.once('data', data => {
+            url = `http://127.0.0.1:${String(data).split(' ')[1].trim()}`;
+            done();
+        });
+    });
+    afterAll(() => {
+        responder.kill();
+        for (const name of fs.readdirSync(dir)) {
+            fs.unlinkSync(path.join(dir, name));
+        }
+        fs.rmdirSync(dir);
+    });
+
+    test('answers good and revoked', async () => {
+        const good = await lookup('leaf0.pem');
+        expect(good.err).toBeNull();
+        expect(good.response.statusStr).toBe('good');
+        const revoked = await lookup('leaf1.pem');
+        expect(revoked.err).toBeNull();
+        expect(revoked.response.statusStr).toBe('revoked');
+    });
+
+    describe('connection pool', () => {
+        // Every lookup goes to the responder
+        beforeAll(() => ocsp.configureCache({ maxEntries: 0, margin: 60 }));
+        afterAll(() => {
+            ocsp.configureCache({ maxEntries: 10000, margin: 60 });
+            ocsp.configurePool({ maxPerHost: 8, idleTimeout: 15000 });
+        });
+
+        test('connections are reused', async () => {
+            ocsp.configurePool({ maxPerHost: 8, idleTimeout: 15000 });
+            await lookup('leaf0.pem');
+            const before = ocsp.getPoolStats();
+            const result = await lookup('leaf0.pem');
+            expect(result.err).toBeNull();
+            expect(result.response.statusStr).toBe('good');
+            const after = ocsp.getPoolStats();
+            expect(after.reused).toBe(before.reused + 1);
+            expect(after.created).toBe(before.created);
+        });
+        test('idle connections expire', async () => {
+            ocsp.configurePool({ maxPerHost: 8, idleTimeout: 50 });
+            await lookup('leaf0.pem');
+            const expired = ocsp.getPoolStats().expired;
+            await wait(150);
+            const stats = ocsp.getPoolStats();
+            expect(stats.expired).toBeGreaterThan(expired);
+            expect(stats.idle).toBe(0);
+        });
+        test('lookups beyond maxPerHost wait for a connection', async () => {
+            ocsp.configurePool({ maxPerHost: 1, idleTimeout: 15000 });
+            const before = ocsp.getPoolStats();
+            const results = await Promise.all(
+                ['leaf0.pem', 'leaf1.pem', 'leaf2.pem', 'leaf3.pem'].map(
+                    lookup
+                )
+            );
+            expect(results.map(result => result.response.statusStr)).toEqual([
+                'good',
+                'revoked',
+                'good',
+                'revoked',
+            ]);
+            const after = ocsp.getPoolStats();
+            expect(after.created - before.created).toBeLessThanOrEqual(1);
+            expect(after.waited).toBeGreaterThan(before.waited);
+            expect(after.active).toBe(0);
+            expect(after.idle).toBeLessThanOrEqual(1);
+        });
+        test('PEM and DER lookups of a certificate share one exchange', async () => {
+            ocsp.configurePool({ maxPerHost: 8, idleTimeout: 15000 });
+            const before = ocsp.getPoolStats();
+            const pem = new Promise<any>(resolve =>
+                ocsp.getRevocationStatusAsyncForTesting(
+                    fs.readFileSync(path.join(dir, 'leaf0.pem'), 'ascii'),
+                    fs.readFileSync(path.join(dir, 'ca.pem'), 'ascii'),
+                    'Host=127.0.0.1',
+                    url,
+                    (err, response) => resolve({ err, response })
+                )
+            );
+            const results = await Promise.all([lookup('leaf0.pem'), pem]);
+            expect(results.map(result => result.response.statusStr)).toEqual([
+                'good',
+                'good',
+            ]);
+            const after = ocsp.getPoolStats();
+            expect(after.created + after.reused).toBe(
+                before.created + before.reused + 1
+            );
+        });
+    });
+
+    describe('response cache', () => {
+        // Responses are valid for an hour, a margin 2 seconds short of it
+        // expires them 2 seconds after thisUpdate
+        beforeAll(() => {
+            ocsp.configureCache({ maxEntries: 0, margin: 60 });
+            ocsp.configureCache({ maxEntries: 10000, margin: 3598 });
+        });
+        afterAll(() => ocsp.configureCache({ maxEntries: 10000, margin: 60 }));
+
+        test('lookups hit until nextUpdate less the margin', async () => {
+            const before = ocsp.getCacheStats();
+            const miss = await lookup('leaf0.pem');
+            expect(miss.err).toBeNull();
+            expect(miss.response.statusStr).toBe('good');
+            expect(ocsp.getCacheStats().misses).toBe(before.misses + 1);
+            const hit = await lookup('leaf0.pem');
+            expect(hit.err).toBeNull();
+            expect(hit.response.statusStr).toBe('good');
+            expect(ocsp.getCacheStats().hits).toBe(before.hits + 1);
+            await wait(2100);
+            const expired = await lookup('leaf0.pem');
+            expect(expired.err).toBeNull();
+            expect(expired.response.statusStr).toBe('good');
+            const after = ocsp.getCacheStats();
+            expect(after.hits).toBe(before.hits + 1);
+            expect(after.misses).toBe(before.misses + 2);
+        }, 10000);
+    });
+
+    describe('background refresh', () => {
+        beforeAll(() => {
+            ocsp.configureCache({ maxEntries: 0, margin: 60 });
+            ocsp.configureCache({ maxEntries: 10000, margin: 60 });
+        });
+        afterAll(() => ocsp.configureRefresh({ concurrency: 0 }));
+
+        test('cached responses are fetched again', async () => {
+            // Due about 2 seconds into the 3540 second window
+            ocsp.configureRefresh({
+                concurrency: 1,
+                fraction: 0.0006,
+                jitter: 0,
+            });
+            const before = ocsp.getRefreshStats();
+            const result = await lookup('leaf2.pem');
+            expect(result.err).toBeNull();
+            expect(result.response.statusStr).toBe('good');
+            expect(ocsp.getRefreshStats().tracked).toBe(before.tracked + 1);
+            const deadline = Date.now() + 5000;
+            while (
+                ocsp.getRefreshStats().refreshed === before.refreshed &&
+                Date.now() < deadline
+            ) {
+                await wait(100);
+            }
+            const after = ocsp.getRefreshStats();
+            expect(after.refreshed).toBeGreaterThan(before.refreshed);
+            expect(after.failed).toBe(before.failed);
+            // The refreshed response keeps the lookup a hit
+            const hits = ocsp.getCacheStats().hits;
+            const refreshed = await lookup('leaf2.pem');
+            expect(refreshed.response.statusStr).toBe('good');
+            expect(ocsp.getCacheStats().hits).toBe(hits + 1);
+        }, 10000);
+    });
+
+    describe('shared cache', () => {
+        const name = `/ocsp-test-shared-${process.pid}`;
+        const addon = path.join(__dirname, '../build/Release/ocsp.node');
+        // Looks up a certificate in a process of its own, attached to the
+        // same segment
+        const writer = `
+            const ocsp = require(process.argv[1]);
+            ocsp.configureSharedCache(process.argv[2], 16);
+            ocsp.getRevocationStatusDerAsync(
+                Buffer.from(process.argv[4], 'base64'),
+                Buffer.from(process.argv[5], 'base64'),
+                'Host=127.0.0.1',
+                process.argv[3],
+                (err, response) => console.log(err || response.statusStr)
+            );
+        `;
+        const lookupElsewhere = (leaf: string) =>
+            new Promise<string>((resolve, reject) =>
+                childProcess.execFile(
+                    process.execPath,
+                    [
+                        '-e',
+                        writer,
+                        addon,
+                        name,
+                        url,
+                        der(leaf).toString('base64'),
+                        der('ca.pem').toString('base64'),
+                    ],
+                    (error, stdout) =>
+                        error ? reject(error) : resolve(stdout.trim())
+                )
+            );
+
+        beforeAll(() => {
+            ocsp.configureCache({ maxEntries: 0, margin: 60 });
+            ocsp.configureCache({ maxEntries: 10000, margin: 60 });
+            ocsp.configureSharedCache({ name, slots: 16 });
+        });
+        afterAll(() => {
+            ocsp.configureSharedCache({ name: '' });
+            if (fs.existsSync(`/dev/shm${name}`)) {
+                fs.unlinkSync(`/dev/shm${name}`);
+            }
+        });
+
+        test('a response another process fetched is a hit', async () => {
+            expect(await lookupElsewhere('leaf1.pem')).toBe('revoked');
+            const before = ocsp.getSharedCacheStats();
+            const hits = ocsp.getCacheStats().hits;
+            const result = await lookup('leaf1.pem');
+            expect(result.err).toBeNull();
+            expect(result.response.statusStr).toBe('revoked');
+            const after = ocsp.getSharedCacheStats();
+            expect(after.hits).toBe(before.hits + 1);
+            expect(after.writes).toBe(before.writes);
+            expect(ocsp.getCacheStats().hits).toBe(hits + 1);
+        }, 10000);
+    });
+
+    describe('signer verification cache', () => {
+        // Every lookup verifies a response
+        beforeAll(() => ocsp.configureCache({ maxEntries: 0, margin: 60 }));
+        afterAll(() => ocsp.configureCache({ maxEntries: 10000, margin: 60 }));
+
+        test('a signer verified once is trusted after', async () => {
+            const first = await lookup('leaf3.pem');
+            expect(first.err).toBeNull();
+            expect(first.response.statusStr).toBe('revoked');
+            const before = ocsp.getSignerStats();
+            expect(before.size).toBeGreaterThan(0);
+            const second = await lookup('leaf3.pem');
+            expect(second.err).toBeNull();
+            expect(second.response.statusStr).toBe('revoked');
+            const after = ocsp.getSignerStats();
+            expect(after.fast).toBe(before.fast + 1);
+            expect(after.full).toBe(before.full);
+        });
+    });
+
+    describe('stapled responses', () => {
+        test('a staple is verified even when the status is cached', async () => {
+            await lookup('leaf0.pem');
+            const cached = await lookup('leaf0.pem');
+            expect(cached.response.statusStr).toBe('good');
+            const hits = ocsp.getCacheStats().hits;
+            expect(() =>
+                ocsp.verifyStapledResponse(
+                    Buffer.from('not DER'),
+                    der('leaf0.pem'),
+                    der('ca.pem')
+                )
+            ).toThrow('Error parsing response');
+            expect(ocsp.getCacheStats().hits).toBe(hits);
+        });
+    });
+});